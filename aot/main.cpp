@@ -0,0 +1,321 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <set>
+#include <memory>
+#include <iomanip>
+#include "arch.hpp"
+#include "decode.hpp"
+#include "memory.hpp"
+#include "loader.hpp"
+
+using namespace std;
+
+shared_ptr<vector<uint16_t>> read_binary(char *file_path) {
+    // アセンブラが出力したイメージを読み込み、0番地からセクションの終わりまでのワードを取り出す
+    shared_ptr<Memory> memory(new Memory());
+    LoadedProgram program = load_program(memory, string(file_path));
+    if (program.entry != 0) {
+        cerr << "program must start at address 0 (entry is " << program.entry << ")" << endl;
+        exit(1);
+    }
+    shared_ptr<vector<uint16_t>> image(new vector<uint16_t>());
+    for (uint32_t addr = 0; addr < program.end; addr++) {
+        image->push_back(memory->read(addr));
+    }
+    return image;
+}
+
+bool writes_pc(const DecodedInst &inst, int pc) {
+    switch (inst.type) {
+        case InstructionType::MOV:
+        case InstructionType::ADD:
+        case InstructionType::SUB:
+        case InstructionType::AND:
+        case InstructionType::OR:
+        case InstructionType::SL:
+        case InstructionType::SR:
+        case InstructionType::LDL:
+        case InstructionType::LDH:
+        case InstructionType::LD:
+            return inst.first_operand == pc;
+        default:
+            return false;
+    }
+}
+
+bool reads_pc(const DecodedInst &inst, int pc) {
+    int source = inst.second_operand >> 5;
+    switch (inst.type) {
+        case InstructionType::MOV:
+            return source == pc;
+        case InstructionType::ADD:
+        case InstructionType::SUB:
+        case InstructionType::AND:
+        case InstructionType::OR:
+        case InstructionType::CMP:
+            return source == pc || inst.first_operand == pc;
+        case InstructionType::SL:
+        case InstructionType::SR:
+        case InstructionType::LDL:
+        case InstructionType::LDH:
+        case InstructionType::ST:
+            return inst.first_operand == pc;
+        default:
+            return false;
+    }
+}
+
+shared_ptr<set<int>> find_leaders(shared_ptr<CpuArch> arch, shared_ptr<vector<uint16_t>> image) {
+    // je, jmpの飛び先とその次の命令を基本ブロックの先頭とする
+    //   PCに直接書き込む命令があるなら飛び先が分からないので全ての命令を先頭にする
+    const DecodeTable &decode_table = DecodeTable::get_instance();
+    shared_ptr<set<int>> leaders(new set<int>());
+    leaders->insert(0);
+    for (int addr = 0; addr < image->size(); addr++) {
+        const DecodedInst &inst = decode_table.decode(image->at(addr));
+        if (inst.type == InstructionType::JE || inst.type == InstructionType::JMP) {
+            if (inst.second_operand < image->size()) {
+                leaders->insert(inst.second_operand);
+            }
+            leaders->insert(addr + 1);
+        }
+        if (writes_pc(inst, arch->PC_REG_NUMBER)) {
+            for (int i = 0; i < image->size(); i++) {
+                leaders->insert(i);
+            }
+            break;
+        }
+    }
+    return leaders;
+}
+
+void check_self_modifying(shared_ptr<vector<uint16_t>> image) {
+    // コード領域へのstがあるプログラムはネイティブコードにできない
+    const DecodeTable &decode_table = DecodeTable::get_instance();
+    for (int addr = 0; addr < image->size(); addr++) {
+        const DecodedInst &inst = decode_table.decode(image->at(addr));
+        if (inst.is_valid && inst.type == InstructionType::ST && inst.second_operand < image->size()) {
+            cerr << "self-modifying program (st into 0x" << hex << static_cast<int>(inst.second_operand)
+                 << " at 0x" << addr << "), run it with the emulator instead" << endl;
+            exit(1);
+        }
+    }
+}
+
+string label(int addr) {
+    stringstream ss;
+    ss << "L_" << setw(4) << setfill('0') << hex << addr;
+    return ss.str();
+}
+
+string hex_value(int value) {
+    stringstream ss;
+    ss << "0x" << hex << value;
+    return ss.str();
+}
+
+shared_ptr<string> generate(shared_ptr<CpuArch> arch, shared_ptr<vector<uint16_t>> image, string source_name) {
+    // 基本ブロックごとにラベルを付けたC++のソースを生成する
+    //   レジスタはローカル変数、メモリは静的配列にしてコンパイラに最適化させる
+    const DecodeTable &decode_table = DecodeTable::get_instance();
+    const int pc = arch->PC_REG_NUMBER;
+    const int psw = arch->PSW_REG_NUMBER;
+    auto leaders = find_leaders(arch, image);
+    bool has_dynamic_jump = false;
+    auto reg = [&](int number) {
+        return string(arch->registers[number].name);
+    };
+
+    stringstream out;
+    out << "// generated by aot from " << source_name << endl;
+    out << "#include <cstdint>" << endl;
+    out << "#include <chrono>" << endl;
+    out << "#include <iostream>" << endl;
+    out << "#include <iomanip>" << endl << endl;
+
+    out << "static uint16_t mem[" << MEMORY_SIZE << "] = {";
+    for (int addr = 0; addr < image->size(); addr++) {
+        out << (addr % 8 == 0 ? "\n        " : " ") << hex_value(image->at(addr)) << ",";
+    }
+    out << endl << "};" << endl << endl;
+
+    out << "int main() {" << endl;
+    out << "    uint16_t";
+    for (int i = 0; i < arch->registers.size(); i++) {
+        out << (i == 0 ? " " : ", ") << reg(i) << " = 0";
+    }
+    out << ";" << endl;
+    out << "    uint64_t clock_counter = 1;" << endl;
+    out << "    uint64_t instruction_counter = 0;" << endl;
+    out << "    auto start = std::chrono::steady_clock::now();" << endl << endl;
+
+    for (int block_start = 0; block_start < image->size();) {
+        // ブロックの終わりを探してクロック数と命令数をまとめて加算する
+        int block_end = block_start;
+        uint64_t cycles = 0;
+        while (block_end < image->size()) {
+            const DecodedInst &inst = decode_table.decode(image->at(block_end));
+            cycles += inst.cycles;
+            block_end++;
+            if (!inst.is_valid || inst.type == InstructionType::HLT || inst.type == InstructionType::JE
+                || inst.type == InstructionType::JMP || writes_pc(inst, pc) || leaders->count(block_end)) {
+                break;
+            }
+        }
+
+        out << label(block_start) << ":" << endl;
+        out << "    clock_counter += " << dec << cycles << ";" << endl;
+        out << "    instruction_counter += " << block_end - block_start << ";" << endl;
+
+        for (int addr = block_start; addr < block_end; addr++) {
+            const DecodedInst &inst = decode_table.decode(image->at(addr));
+            string first = reg(inst.first_operand);
+            string source = reg((inst.second_operand >> 5) & 0x7);
+            string imm = hex_value(inst.second_operand);
+            if (!inst.is_valid) {
+                out << "    std::cerr << \"invalid opcode " << dec << static_cast<int>(inst.opcode) << "\" << std::endl;" << endl;
+                out << "    return 1;" << endl;
+                continue;
+            }
+            // 実行中のPCは次の命令を指している
+            if (reads_pc(inst, pc)) {
+                out << "    " << reg(pc) << " = " << hex_value(addr + 1) << ";" << endl;
+            }
+            switch (inst.type) {
+                case InstructionType::MOV:
+                    out << "    " << first << " = " << source << ";" << endl;
+                    break;
+                case InstructionType::ADD:
+                    out << "    " << first << " = " << first << " + " << source << ";" << endl;
+                    break;
+                case InstructionType::SUB:
+                    out << "    " << first << " = " << first << " - " << source << ";" << endl;
+                    break;
+                case InstructionType::AND:
+                    out << "    " << first << " = " << first << " & " << source << ";" << endl;
+                    break;
+                case InstructionType::OR:
+                    out << "    " << first << " = " << first << " | " << source << ";" << endl;
+                    break;
+                case InstructionType::SL:
+                    out << "    " << first << " = " << first << " << 1;" << endl;
+                    break;
+                case InstructionType::SR:
+                    out << "    " << first << " = " << first << " >> 1;" << endl;
+                    break;
+                case InstructionType::LDL:
+                    out << "    " << first << " |= " << imm << ";" << endl;
+                    break;
+                case InstructionType::LDH:
+                    out << "    " << first << " |= " << hex_value(inst.second_operand << 8) << ";" << endl;
+                    break;
+                case InstructionType::CMP:
+                    // Alu::calcのCMPと同じくNは0になる方向にだけ更新する
+                    out << "    if (static_cast<uint16_t>(" << first << " - " << source << ") == 0) { "
+                        << reg(psw) << " |= 0x4000; } else { " << reg(psw) << " &= 0x3fff; }" << endl;
+                    break;
+                case InstructionType::JE:
+                    out << "    if (" << reg(psw) << " & 0x4000) { " << reg(pc) << " = " << imm << "; ";
+                    if (inst.second_operand < image->size()) {
+                        out << "goto " << label(inst.second_operand) << "; }" << endl;
+                    } else {
+                        out << "goto out_of_code; }" << endl;
+                    }
+                    break;
+                case InstructionType::JMP:
+                    out << "    " << reg(pc) << " = " << imm << ";" << endl;
+                    if (inst.second_operand < image->size()) {
+                        out << "    goto " << label(inst.second_operand) << ";" << endl;
+                    } else {
+                        out << "    goto out_of_code;" << endl;
+                    }
+                    break;
+                case InstructionType::LD:
+                    out << "    " << first << " = mem[" << imm << "];" << endl;
+                    break;
+                case InstructionType::ST:
+                    out << "    mem[" << imm << "] = " << first << ";" << endl;
+                    break;
+                case InstructionType::HLT:
+                    out << "    " << reg(pc) << " = " << hex_value(addr + 1) << ";" << endl;
+                    out << "    goto halt;" << endl;
+                    break;
+            }
+            if (writes_pc(inst, pc)) {
+                has_dynamic_jump = true;
+                out << "    goto dispatch;" << endl;
+            }
+        }
+        block_start = block_end;
+    }
+    // 末尾まで実行が落ちてきた場合
+    out << "    " << reg(pc) << " = " << hex_value(image->size()) << ";" << endl;
+    out << "    goto out_of_code;" << endl << endl;
+
+    if (has_dynamic_jump) {
+        // PCへの直接の書き込みは実行時にラベルへ振り分ける
+        out << "dispatch:" << endl;
+        out << "    switch (" << reg(pc) << ") {" << endl;
+        for (int addr: *leaders) {
+            if (addr < image->size()) {
+                out << "        case " << hex_value(addr) << ": goto " << label(addr) << ";" << endl;
+            }
+        }
+        out << "        default: goto out_of_code;" << endl;
+        out << "    }" << endl << endl;
+    }
+
+    out << "out_of_code:" << endl;
+    out << "    std::cerr << \"pc 0x\" << std::hex << " << reg(pc)
+        << " << \" is outside of the translated code, run it with the emulator instead\" << std::endl;" << endl;
+    out << "    return 1;" << endl << endl;
+
+    out << "halt:" << endl;
+    out << "    auto end = std::chrono::steady_clock::now();" << endl;
+    out << "    double seconds = std::chrono::duration<double>(end - start).count();" << endl;
+    out << "    // 0x64のアドレスは結果表示用とする" << endl;
+    out << "    std::cout << \"RESULT is [\" << mem[0x64] << \"]\" << std::endl;" << endl;
+    out << "    std::cout << \"STATS cycles=\" << clock_counter - 1 << \" instructions=\" << instruction_counter" << endl;
+    out << "              << \" time=\" << std::fixed << std::setprecision(6) << seconds << \"s\"" << endl;
+    out << "              << \" MIPS=\" << std::setprecision(3) << (seconds > 0 ? instruction_counter / seconds / 1000000.0 : 0)" << endl;
+    out << "              << \" halt=hlt\" << std::endl;" << endl;
+    out << "    return 0;" << endl;
+    out << "}" << endl;
+
+    return shared_ptr<string>(new string(out.str()));
+}
+
+void write_source(char *file_path, shared_ptr<string> source) {
+    ofstream ofs(file_path);
+    ofs << *source;
+    ofs.close();
+}
+
+void exit_with_help() {
+    cerr << "[USAGE] aot INPUT_FILE OUTPUT_FILE" << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        exit_with_help();
+    }
+    char *input_file = argv[1];
+    char *output_file = argv[2];
+
+    shared_ptr<CpuArch> arch(new CpuArch());
+    auto image = read_binary(input_file);
+
+    // 自己書き換えするプログラムはエミュレータで実行する
+    check_self_modifying(image);
+    // 基本ブロックに分けてC++のソースを生成する
+    auto source = generate(arch, image, string(input_file));
+
+    write_source(output_file, source);
+
+    cout << "output source in " << output_file << endl;
+
+    return 0;
+}
@@ -5,6 +5,8 @@
 #include <map>
 #include <bitset>
 #include "arch.hpp"
+#include "symbols.hpp"
+#include "program_image.hpp"
 
 using namespace std;
 
@@ -20,6 +22,7 @@ enum class TokenType {
 struct Token {
     string str;
     TokenType type;
+    int line;  // ソースの行番号 (1から)
 };
 
 shared_ptr<vector<uint16_t>> generate(shared_ptr<vector<Program>> programs) {
@@ -30,7 +33,7 @@ shared_ptr<vector<uint16_t>> generate(shared_ptr<vector<Program>> programs) {
         code = Program::assemble(program);
         output_code->push_back(code);
         string debug_asm = "[" + to_string(output_code->size()) + "] ";
-        debug_asm += program.inst.mnemonic + " ";
+        debug_asm += string(program.inst.mnemonic) + " ";
         if (program.inst.operand_type == OperandType::SINGLE_OPERAND) {
             debug_asm += to_string(program.first_operand);
         } else if (program.inst.operand_type == OperandType::DOUBLE_OPERAND) {
@@ -58,7 +61,8 @@ uint16_t resolve_operand(shared_ptr<CpuArch> arch, Token operand_token, shared_p
     return NULL;
 }
 
-shared_ptr<vector<Program>> parse(shared_ptr<CpuArch> arch, shared_ptr<vector<Token>> tokens) {
+// symbolsにはラベルの範囲と、命令ごとのソースの行番号を入れる
+shared_ptr<vector<Program>> parse(shared_ptr<CpuArch> arch, shared_ptr<vector<Token>> tokens, shared_ptr<SymbolTable> symbols) {
     shared_ptr<map<string, int>> label_table(new map<string, int>());  // ラベル文字列と行番号のマップ
     // トークンをシークしてラベル名と行数のマップを構築しておく
     //   ラベルは事前に行番号に解決しておく必要がある
@@ -125,6 +129,7 @@ shared_ptr<vector<Program>> parse(shared_ptr<CpuArch> arch, shared_ptr<vector<To
 
             }
             programs->push_back(Program(inst.value(), first_operand, second_operand));
+            symbols->lines.push_back(first_token->line);
         } else {
             // 識別子ならラベル名なのでトークンを読み取りスキップする
             if (first_token->type == TokenType::IDENT) {
@@ -132,6 +137,7 @@ shared_ptr<vector<Program>> parse(shared_ptr<CpuArch> arch, shared_ptr<vector<To
             }
         }
     }
+    symbols->set_labels(*label_table, programs->size());
     return programs;
 }
 
@@ -139,6 +145,7 @@ shared_ptr<vector<Token>> tokenize(shared_ptr<CpuArch> arch, shared_ptr<string>
     shared_ptr<vector<Token>> tokens(new vector<Token>());
     string current_token_str;
     bool is_among_comment = false;
+    int line = 1;
     // 1文字ずつシークしてトークンを追加していく
     for (int current_pos = 0; current_pos < code_str->length(); current_pos++) {
         // 現在の文字
@@ -178,8 +185,12 @@ shared_ptr<vector<Token>> tokenize(shared_ptr<CpuArch> arch, shared_ptr<string>
             Token token;
             token.str = current_token_str;
             token.type = token_type;
+            token.line = line;
             tokens->push_back(token);
             current_token_str.clear();
+            if (current_char == '\n') {
+                line++;
+            }
         } else if (next_char == ' ' || next_char == '\t' || next_char == ',' || next_char == '\n' || next_char == ':') {
             // 次の文字がトークンの区切り文字なら現在までのトークン文字列をトークンとして追加する
             TokenType token_type = TokenType::IDENT;
@@ -199,6 +210,7 @@ shared_ptr<vector<Token>> tokenize(shared_ptr<CpuArch> arch, shared_ptr<string>
             Token token;
             token.str = current_token_str;
             token.type = token_type;
+            token.line = line;
             tokens->push_back(token);
             current_token_str.clear();
         }
@@ -219,11 +231,15 @@ shared_ptr<string> read_file(char* file_path) {
 }
 
 void write_code(char* file_path, shared_ptr<vector<uint16_t>> code) {
-    // バイナリを書き込む
-    //   書き込むバイト数はu16_t(2byte)のコード数
-    ofstream ofs(file_path, ios::binary);
-    ofs.write((char*)&code->at(0), code->size() * sizeof(uint16_t));
-    ofs.close();
+    // イメージを書き込む
+    //   コードは0番地から置く1つのセクションで、0番地から実行する
+    if (code->size() > PROGRAM_IMAGE_ADDRESS_SPACE) {
+        cerr << "program is larger than the address space (" << code->size() << " words)" << endl;
+        exit(1);
+    }
+    vector<ProgramSection> sections;
+    sections.push_back({ProgramSectionType::CODE, 0, code->data(), static_cast<uint32_t>(code->size()), 0});
+    write_program_image(file_path, 0, sections);
 }
 
 void exit_with_help() {
@@ -244,13 +260,21 @@ int main(int argc, char *argv[]) {
     // 文字列をシークしてトークン列化していく
     auto tokens = tokenize(arch, program_text);
     // トークン列をプログラムの構造にパースする
-    auto programs = parse(arch, tokens);
+    shared_ptr<SymbolTable> symbols(new SymbolTable());
+    string input_path = input_file;
+    symbols->source_name = input_path.substr(input_path.find_last_of('/') + 1);
+    auto programs = parse(arch, tokens, symbols);
     // トークン列からコード(bianry)を生成する
     auto code = generate(programs);
 
     write_code(output_file, code);
 
+    // プロファイルやデバッグ表示でアドレスをラベルと行番号で表すためのシンボルファイル
+    string symbol_file = string(output_file) + ".sym";
+    symbols->save(symbol_file);
+
     cout << "output binary in " << output_file << endl;
+    cout << "output symbols in " << symbol_file << endl;
 
     return 0;
 }
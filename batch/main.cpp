@@ -0,0 +1,95 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <iomanip>
+#include "arch.hpp"
+#include "engine.hpp"
+#include "batch.hpp"
+
+using namespace std;
+
+void print_results(const vector<BatchResult> &results) {
+    for (auto &r: results) {
+        cout << "JOB " << dec << r.job_id
+             << " result=" << r.result
+             << " cycles=" << r.cycles
+             << " instructions=" << r.instructions
+             << " halt=" << halt_reason_name(static_cast<HaltReason>(r.halt_reason))
+             << " regs=";
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            cout << (i == 0 ? "" : ",") << hex << r.registers[i];
+        }
+        cout << dec << endl;
+    }
+}
+
+void exit_with_help() {
+    cerr << "[USAGE] batch [--threads N] [--engine clock|fast|threaded|jit] [--text] MANIFEST_FILE OUTPUT_FILE" << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    vector<string> files;
+    int thread_count = thread::hardware_concurrency();
+    EngineType engine_type = EngineType::FAST;
+    bool is_text = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            try {
+                thread_count = stoi(argv[++i]);
+            } catch (const logic_error &) {
+                exit_with_help();
+            }
+            if (thread_count < 1) {
+                exit_with_help();
+            }
+        } else if (arg == "--engine" && i + 1 < argc) {
+            auto type = get_engine_type_by_name(argv[++i]);
+            if (!type) {
+                exit_with_help();
+            }
+            engine_type = type.value();
+        } else if (arg == "--text") {
+            is_text = true;
+        } else if (arg.substr(0, 2) == "--") {
+            exit_with_help();
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.size() < 2) {
+        exit_with_help();
+    }
+
+    shared_ptr<CpuArch> arch(new CpuArch());
+    auto jobs = parse_manifest(files[0], arch);
+
+    auto start = chrono::steady_clock::now();
+    BatchRunner runner(arch, engine_type, thread_count);
+    auto results = runner.run(jobs);
+    auto end = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(end - start).count();
+
+    write_results(files[1], results);
+    if (is_text) {
+        print_results(results);
+    }
+
+    uint64_t instructions = 0;
+    for (auto &r: results) {
+        instructions += r.instructions;
+    }
+    cout << "BATCH jobs=" << jobs.size()
+         << " threads=" << runner.thread_count
+         << " steals=" << runner.steal_count
+         << " instructions=" << instructions
+         << " time=" << fixed << setprecision(6) << seconds << "s"
+         << " MIPS=" << setprecision(3) << (seconds > 0 ? instructions / seconds / 1000000.0 : 0) << endl;
+    cout << "output results in " << files[1] << endl;
+
+    return 0;
+}
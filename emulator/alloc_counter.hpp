@@ -0,0 +1,68 @@
+#ifndef EMULATOR_ALLOC_COUNTER_HPP
+#define EMULATOR_ALLOC_COUNTER_HPP
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+// プロセス全体のヒープ確保の回数とバイト数
+//   operator newを置き換えて数えるので、このヘッダはmain.cppからだけincludeする
+//   is_enabledの間だけ数える (他のスレッドの確保も数える)
+struct AllocationCounter {
+    atomic<bool> is_enabled{false};
+    atomic<uint64_t> count{0};
+    atomic<uint64_t> bytes{0};
+};
+inline AllocationCounter allocation_counter;
+
+// 作ってから壊すまでの間の確保を数える
+class AllocationScope {
+private:
+    bool was_enabled;
+    uint64_t start_count;
+    uint64_t start_bytes;
+
+public:
+    AllocationScope() {
+        start_count = allocation_counter.count.load();
+        start_bytes = allocation_counter.bytes.load();
+        was_enabled = allocation_counter.is_enabled.exchange(true);
+    }
+
+    ~AllocationScope() {
+        allocation_counter.is_enabled = was_enabled;
+    }
+
+    uint64_t get_count() const {
+        return allocation_counter.count.load() - start_count;
+    }
+
+    uint64_t get_bytes() const {
+        return allocation_counter.bytes.load() - start_bytes;
+    }
+};
+
+// 配列版とnothrow版は標準ライブラリの既定の実装がこれを呼ぶ
+void *operator new(size_t size) {
+    if (allocation_counter.is_enabled.load(memory_order_relaxed)) {
+        allocation_counter.count.fetch_add(1, memory_order_relaxed);
+        allocation_counter.bytes.fetch_add(size, memory_order_relaxed);
+    }
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+#endif //EMULATOR_ALLOC_COUNTER_HPP
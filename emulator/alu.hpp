@@ -25,11 +25,11 @@ enum class AluMode {
 class Alu {
 public:
     AluMode mode;
-    shared_ptr<Psw> psw;
+    Psw *psw;
     Alu() {
 
     }
-    Alu(shared_ptr<Psw> psw) {
+    Alu(Psw *psw) {
         this->psw = psw;
         this->mode = AluMode::NOP;
     }
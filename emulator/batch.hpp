@@ -0,0 +1,302 @@
+#ifndef EMULATOR_BATCH_HPP
+#define EMULATOR_BATCH_HPP
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstring>
+#include "cpu.hpp"
+#include "engine.hpp"
+#include "engine_factory.hpp"
+#include "loader.hpp"
+#include "memory.hpp"
+#include "arch.hpp"
+
+using namespace std;
+
+// バッチで実行する1つのジョブ
+struct BatchJob {
+    string image_path;
+    vector<pair<int, uint16_t>> register_overrides;  // 実行前に書き込むレジスタ (番号, 値)
+    vector<pair<uint16_t, uint16_t>> memory_overrides;  // 実行前に書き込むメモリ (アドレス, 値)
+    RunLimit limit;
+};
+
+// ジョブの実行結果 (出力ファイルにはこの構造をそのまま並べる)
+struct BatchResult {
+    uint64_t cycles;
+    uint64_t instructions;
+    uint32_t job_id;
+    uint16_t result;  // 0x64番地の値
+    uint16_t registers[CpuArch::REGISTER_COUNT];
+    uint8_t halt_reason;
+    uint8_t reserved;
+};
+static_assert(sizeof(BatchResult) == 40, "BatchResult must be packed to 40 bytes");
+
+// 出力ファイルのヘッダ
+struct BatchResultHeader {
+    char magic[4];  // "TCBR"
+    uint32_t version;
+    uint64_t count;
+};
+
+// ワークスティーリングするスレッドプール
+//   タスクは最初に各ワーカーのキューへ均等に配り、自分のキューは後ろから取り出す
+//   自分のキューが空になったら他のワーカーのキューの前から盗む
+class WorkStealingPool {
+private:
+    struct WorkerQueue {
+        mutex lock;
+        deque<uint32_t> tasks;
+    };
+    vector<unique_ptr<WorkerQueue>> queues;
+
+    bool pop_own(int worker, uint32_t &task) {
+        WorkerQueue &q = *queues[worker];
+        lock_guard<mutex> guard(q.lock);
+        if (q.tasks.empty()) {
+            return false;
+        }
+        task = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int worker, uint32_t &task) {
+        for (int i = 1; i < queues.size(); i++) {
+            WorkerQueue &q = *queues[(worker + i) % queues.size()];
+            lock_guard<mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    int thread_count;
+    atomic<uint64_t> steal_count;
+
+    WorkStealingPool(int thread_count) {
+        this->thread_count = thread_count > 0 ? thread_count : 1;
+        this->steal_count = 0;
+        for (int i = 0; i < this->thread_count; i++) {
+            queues.push_back(unique_ptr<WorkerQueue>(new WorkerQueue()));
+        }
+    }
+
+    // task_count個のタスクを全て実行し終えるまで待つ
+    //   タスクは実行中に増えないので、全てのキューが空なら終わってよい
+    void run(uint32_t task_count, function<void(int, uint32_t)> task_func) {
+        for (uint32_t i = 0; i < task_count; i++) {
+            queues[i % thread_count]->tasks.push_back(i);
+        }
+        vector<thread> workers;
+        for (int worker = 0; worker < thread_count; worker++) {
+            workers.push_back(thread([this, worker, &task_func]() {
+                uint32_t task;
+                while (true) {
+                    if (pop_own(worker, task)) {
+                        task_func(worker, task);
+                    } else if (steal(worker, task)) {
+                        steal_count++;
+                        task_func(worker, task);
+                    } else {
+                        break;
+                    }
+                }
+            }));
+        }
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+};
+
+// マニフェストのジョブをスレッドプールで並列に実行する
+//   各ジョブは自分専用のMemoryとCpuを持ち、共有するのは読み込み済みのイメージ(読み取り専用)だけ
+class BatchRunner {
+private:
+    map<string, shared_ptr<Memory>> images;
+    map<string, uint16_t> entries;  // イメージのエントリポイント (ジョブのPCの初期値)
+
+    shared_ptr<Memory> get_image(string path) {
+        auto it = images.find(path);
+        if (it != images.end()) {
+            return it->second;
+        }
+        shared_ptr<Memory> image(new Memory());
+        entries[path] = load_program(image, path).entry;
+        images[path] = image;
+        return image;
+    }
+
+public:
+    shared_ptr<CpuArch> arch;
+    EngineType engine_type;
+    int thread_count;
+    uint64_t steal_count = 0;
+
+    BatchRunner(shared_ptr<CpuArch> arch, EngineType engine_type, int thread_count) {
+        this->arch = arch;
+        this->engine_type = engine_type;
+        this->thread_count = thread_count;
+    }
+
+    BatchResult run_job(const BatchJob &job, shared_ptr<Memory> image, uint16_t entry, uint32_t job_id) {
+        shared_ptr<Memory> memory(new Memory(*image));
+        for (auto &m: job.memory_overrides) {
+            memory->memory[m.first] = m.second;
+        }
+        shared_ptr<Cpu> cpu(new Cpu(memory, arch));
+        cpu->is_headless = true;
+        cpu->registers[arch->PC_REG_NUMBER] = entry;
+        for (auto &r: job.register_overrides) {
+            cpu->registers[r.first] = r.second;
+        }
+        auto engine = create_engine(engine_type, cpu);
+        RunStats stats = engine->run(job.limit);
+
+        BatchResult result;
+        memset(&result, 0, sizeof(result));
+        result.job_id = job_id;
+        result.cycles = stats.cycles;
+        result.instructions = stats.instructions;
+        result.halt_reason = static_cast<uint8_t>(stats.halt_reason);
+        result.result = memory->memory[0x64];
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            result.registers[i] = cpu->registers[i];
+        }
+        return result;
+    }
+
+    vector<BatchResult> run(const vector<BatchJob> &jobs) {
+        // イメージは実行前に読み込んでおき、ワーカーからは読むだけにする
+        vector<shared_ptr<Memory>> job_images;
+        vector<uint16_t> job_entries;
+        for (auto &job: jobs) {
+            job_images.push_back(get_image(job.image_path));
+            job_entries.push_back(entries[job.image_path]);
+        }
+
+        // 結果はジョブ番号の位置に書くのでワーカー間で共有する可変状態はキューだけ
+        vector<BatchResult> results(jobs.size());
+        WorkStealingPool pool(thread_count);
+        pool.run(jobs.size(), [&](int, uint32_t task) {
+            results[task] = run_job(jobs[task], job_images[task], job_entries[task], task);
+        });
+        steal_count = pool.steal_count;
+        return results;
+    }
+};
+
+// 数値は0x付きなら16進数、それ以外は10進数として読む
+inline uint64_t parse_number(string str) {
+    return stoull(str, 0, 0);
+}
+
+// マニフェストを読み込む
+//   1行1ジョブで `IMAGE [r0..r7=V] [mem:ADDR=V] [max-cycles=N] [max-insts=N]`
+//   レジスタの値は `r3=0x0..0xff` のように範囲で書くと値ごとにジョブを展開する
+//   #から行末まではコメント
+inline vector<BatchJob> parse_manifest(string file_path, shared_ptr<CpuArch> arch) {
+    ifstream ifs(file_path);
+    if (!ifs) {
+        cerr << "can not open " << file_path << endl;
+        exit(1);
+    }
+    vector<BatchJob> jobs;
+    string line;
+    int line_number = 0;
+    while (getline(ifs, line)) {
+        line_number++;
+        auto comment = line.find('#');
+        if (comment != string::npos) {
+            line = line.substr(0, comment);
+        }
+        stringstream ss(line);
+        BatchJob job;
+        if (!(ss >> job.image_path)) {
+            continue;
+        }
+        // 範囲指定されたレジスタ (番号, 開始, 終了)
+        int range_register = -1;
+        uint64_t range_begin = 0;
+        uint64_t range_end = 0;
+
+        string field;
+        while (ss >> field) {
+            auto eq = field.find('=');
+            if (eq == string::npos) {
+                cerr << file_path << ":" << line_number << ": invalid field " << field << endl;
+                exit(1);
+            }
+            string key = field.substr(0, eq);
+            string value = field.substr(eq + 1);
+            try {
+                if (key == "max-cycles") {
+                    job.limit.max_cycles = parse_number(value);
+                } else if (key == "max-insts") {
+                    job.limit.max_instructions = parse_number(value);
+                } else if (key.substr(0, 4) == "mem:") {
+                    job.memory_overrides.push_back(make_pair(parse_number(key.substr(4)) % MEMORY_SIZE, parse_number(value)));
+                } else if (arch->get_register_by_name(key)) {
+                    int reg = arch->get_register_by_name(key)->code;
+                    auto range = value.find("..");
+                    if (range != string::npos) {
+                        range_register = reg;
+                        range_begin = parse_number(value.substr(0, range));
+                        range_end = parse_number(value.substr(range + 2));
+                    } else {
+                        job.register_overrides.push_back(make_pair(reg, parse_number(value)));
+                    }
+                } else {
+                    cerr << file_path << ":" << line_number << ": unknown key " << key << endl;
+                    exit(1);
+                }
+            } catch (const logic_error &) {
+                // stoullが数値でない値 (invalid_argument) や大きすぎる値 (out_of_range) を投げる
+                cerr << file_path << ":" << line_number << ": invalid number in " << field << endl;
+                exit(1);
+            }
+        }
+
+        if (range_register < 0) {
+            jobs.push_back(job);
+            continue;
+        }
+        for (uint64_t v = range_begin; v <= range_end; v++) {
+            BatchJob expanded = job;
+            expanded.register_overrides.push_back(make_pair(range_register, v));
+            jobs.push_back(expanded);
+        }
+    }
+    return jobs;
+}
+
+inline void write_results(string file_path, const vector<BatchResult> &results) {
+    ofstream ofs(file_path, ios::binary);
+    BatchResultHeader header;
+    memcpy(header.magic, "TCBR", 4);
+    header.version = 1;
+    header.count = results.size();
+    ofs.write((char *) &header, sizeof(header));
+    if (!results.empty()) {
+        ofs.write((char *) results.data(), results.size() * sizeof(BatchResult));
+    }
+    ofs.close();
+}
+
+#endif //EMULATOR_BATCH_HPP
@@ -0,0 +1,206 @@
+#ifndef EMULATOR_BRANCH_PREDICTOR_HPP
+#define EMULATOR_BRANCH_PREDICTOR_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include "memory.hpp"
+#include "arch.hpp"
+#include "symbols.hpp"
+
+using namespace std;
+
+// jeが分岐するかの予測方式
+enum class PredictorType {
+    NOT_TAKEN,  // 常に分岐しないと予測する (静的)
+    BIMODAL,  // PCで引く2bitの飽和カウンタ
+    GSHARE  // PCと直近の分岐結果の履歴のXORで引く2bitの飽和カウンタ
+};
+
+inline string get_predictor_type_name(PredictorType type) {
+    switch (type) {
+        case PredictorType::NOT_TAKEN:
+            return "not-taken";
+        case PredictorType::BIMODAL:
+            return "bimodal";
+        case PredictorType::GSHARE:
+            return "gshare";
+    }
+    return "unknown";
+}
+
+inline optional<PredictorType> get_predictor_type_by_name(string name) {
+    if (name == "not-taken") {
+        return PredictorType::NOT_TAKEN;
+    }
+    if (name == "bimodal") {
+        return PredictorType::BIMODAL;
+    }
+    if (name == "gshare") {
+        return PredictorType::GSHARE;
+    }
+    return nullopt;
+}
+
+// 分岐命令1つ(アドレスごと)の統計
+struct BranchCounters {
+    InstructionType type = InstructionType::JE;
+    uint64_t executions = 0;
+    uint64_t taken = 0;
+    uint64_t mispredicts = 0;  // 分岐するかどうかの予測を外した回数
+    uint64_t btb_misses = 0;  // 分岐したのにBTBに分岐先がなかった回数
+    uint64_t penalty_cycles = 0;  // パイプラインでこの分岐の後ろを捨てたクロック数
+};
+
+// 1つの分岐を予測して答え合わせした結果
+struct BranchOutcome {
+    bool is_predicted_taken;
+    bool is_mispredicted;  // 分岐するかどうかを外した
+    bool is_target_known;  // 分岐先をフェッチの時点でBTBから引けた
+};
+
+// je, jmpの分岐予測器とBTB、分岐ごとの統計
+//   フェッチの時点でPCだけから「分岐するか」と「分岐先」を予測し、実行した結果で表を更新する
+//   jmpは常に分岐するので向きは予測せず、BTBで分岐先が分かるかだけを見る
+//   パイプラインは結果を見てクロック数を足す (予測を外したらEXまで、分岐先が分からなければIDまで捨てる)
+class BranchUnit {
+private:
+    vector<uint8_t> counters;  // 2bitの飽和カウンタ (2以上なら分岐すると予測)
+    uint32_t history = 0;  // gshareの直近の分岐結果 (新しいものが下位bit)
+    uint32_t index_mask = 0;
+    struct BtbEntry {
+        bool is_valid = false;
+        uint16_t pc = 0;
+        uint16_t target = 0;
+    };
+    vector<BtbEntry> btb;
+
+    uint32_t get_index(uint16_t pc) const {
+        if (type == PredictorType::GSHARE) {
+            return (pc ^ history) & index_mask;
+        }
+        return pc & index_mask;
+    }
+
+public:
+    PredictorType type;
+    int index_bits;  // カウンタの表の大きさ (2のindex_bits乗)
+    int btb_entries;  // 0ならBTBなし
+    BranchCounters branches[ADDRESS_SPACE_SIZE];  // 分岐命令のアドレスごと (PCは16bitなのでアドレス空間全体)
+
+    BranchUnit(PredictorType type, int index_bits, int btb_entries) {
+        this->type = type;
+        this->index_bits = index_bits;
+        this->btb_entries = btb_entries;
+        this->index_mask = (1u << index_bits) - 1;
+        // 最初は「弱く分岐しない」にしておく
+        this->counters.assign(1u << index_bits, 1);
+        this->btb.resize(btb_entries);
+    }
+
+    // pcの分岐命令の結果 (is_taken, 分岐先target) で予測を答え合わせして表を更新する
+    BranchOutcome resolve(uint16_t pc, InstructionType inst_type, bool is_taken, uint16_t target) {
+        BranchOutcome outcome;
+        BranchCounters &branch = branches[pc];
+        branch.type = inst_type;
+        branch.executions++;
+
+        if (inst_type == InstructionType::JMP) {
+            outcome.is_predicted_taken = true;
+        } else if (type == PredictorType::NOT_TAKEN) {
+            outcome.is_predicted_taken = false;
+        } else {
+            uint8_t &counter = counters[get_index(pc)];
+            outcome.is_predicted_taken = counter >= 2;
+            if (is_taken && counter < 3) {
+                counter++;
+            } else if (!is_taken && counter > 0) {
+                counter--;
+            }
+            history = ((history << 1) | (is_taken ? 1 : 0)) & index_mask;
+        }
+        outcome.is_mispredicted = outcome.is_predicted_taken != is_taken;
+
+        outcome.is_target_known = false;
+        if (btb_entries > 0) {
+            BtbEntry &entry = btb[pc % btb_entries];
+            outcome.is_target_known = entry.is_valid && entry.pc == pc && entry.target == target;
+            if (is_taken) {
+                entry.is_valid = true;
+                entry.pc = pc;
+                entry.target = target;
+            }
+        }
+
+        if (is_taken) {
+            branch.taken++;
+            if (!outcome.is_target_known) {
+                branch.btb_misses++;
+            }
+        }
+        if (outcome.is_mispredicted) {
+            branch.mispredicts++;
+        }
+        return outcome;
+    }
+};
+
+// 予測の精度と、分岐ごとの表を予測を外した回数の多い順に表示する
+inline void print_branch_report(ostream &os, const BranchUnit &unit, int count = 10, const SymbolTable *symbols = nullptr) {
+    uint64_t executions = 0;
+    uint64_t mispredicts = 0;
+    uint64_t btb_misses = 0;
+    uint64_t penalty_cycles = 0;
+    vector<int> addrs;
+    for (int addr = 0; addr < ADDRESS_SPACE_SIZE; addr++) {
+        const BranchCounters &branch = unit.branches[addr];
+        if (branch.executions == 0) {
+            continue;
+        }
+        executions += branch.executions;
+        mispredicts += branch.mispredicts;
+        btb_misses += branch.btb_misses;
+        penalty_cycles += branch.penalty_cycles;
+        addrs.push_back(addr);
+    }
+    auto accuracy = [](uint64_t total, uint64_t misses) {
+        return total > 0 ? 100.0 * (total - misses) / total : 100.0;
+    };
+    os << "BRANCH predictor=" << get_predictor_type_name(unit.type)
+       << " entries=" << (1 << unit.index_bits)
+       << " btb=" << unit.btb_entries
+       << " branches=" << executions
+       << " mispredicts=" << mispredicts
+       << " accuracy=" << fixed << setprecision(2) << accuracy(executions, mispredicts) << "%" << defaultfloat
+       << " btb-misses=" << btb_misses
+       << " penalty=" << penalty_cycles << endl;
+
+    stable_sort(addrs.begin(), addrs.end(), [&](int a, int b) {
+        return unit.branches[a].mispredicts + unit.branches[a].btb_misses
+               > unit.branches[b].mispredicts + unit.branches[b].btb_misses;
+    });
+    if (addrs.size() > count) {
+        addrs.resize(count);
+    }
+    for (int addr: addrs) {
+        const BranchCounters &branch = unit.branches[addr];
+        os << "BRANCH pc=0x" << hex << setw(2) << setfill('0') << addr << dec << setfill(' ');
+        if (symbols) {
+            os << " " << symbols->describe(addr);
+        }
+        os << " " << (branch.type == InstructionType::JMP ? "jmp" : "je")
+           << " executions=" << branch.executions
+           << " taken=" << branch.taken
+           << " mispredicts=" << branch.mispredicts
+           << " accuracy=" << fixed << setprecision(2) << accuracy(branch.executions, branch.mispredicts) << "%"
+           << defaultfloat
+           << " btb-misses=" << branch.btb_misses
+           << " penalty=" << branch.penalty_cycles << endl;
+    }
+}
+
+#endif //EMULATOR_BRANCH_PREDICTOR_HPP
@@ -0,0 +1,283 @@
+#ifndef EMULATOR_CACHE_HPP
+#define EMULATOR_CACHE_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+
+using namespace std;
+
+// キャッシュのラインを追い出すときの選び方
+enum class CacheReplacement {
+    LRU,  // 最後に使ったのが一番古いライン
+    FIFO,  // 入れたのが一番古いライン
+    RANDOM
+};
+
+// 書き込みの扱い
+enum class CacheWritePolicy {
+    WRITE_BACK,  // キャッシュにだけ書いて追い出すときに下の階層へ書く (ミスしたらラインを読み込んでから書く)
+    WRITE_THROUGH  // 常に下の階層へも書く (ミスしてもラインは読み込まない)
+};
+
+// キャッシュ1段の設定 (大きさはワード単位)
+struct CacheConfig {
+    int size = 32;  // 全体のワード数
+    int line = 4;  // 1ラインのワード数
+    int ways = 2;  // 連想度
+    CacheReplacement replacement = CacheReplacement::LRU;
+    CacheWritePolicy write_policy = CacheWritePolicy::WRITE_BACK;
+    int latency = 0;  // ヒットしたときに余分にかかるクロック数
+};
+
+// "size=64,line=4,ways=2,repl=lru,write=back,latency=1" の形式の設定を読む (書いていない項目はbaseのまま)
+inline CacheConfig parse_cache_config(string spec, CacheConfig base) {
+    CacheConfig config = base;
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t pos = item.find('=');
+        string key = item.substr(0, pos);
+        string value = pos == string::npos ? "" : item.substr(pos + 1);
+        bool is_valid = !value.empty() && value.find_first_not_of("0123456789") == string::npos;
+        if (key == "size") {
+            config.size = is_valid ? stoi(value) : 0;
+        } else if (key == "line") {
+            config.line = is_valid ? stoi(value) : 0;
+        } else if (key == "ways") {
+            config.ways = is_valid ? stoi(value) : 0;
+        } else if (key == "latency") {
+            config.latency = is_valid ? stoi(value) : 0;
+        } else if (key == "repl") {
+            is_valid = true;
+            if (value == "lru") {
+                config.replacement = CacheReplacement::LRU;
+            } else if (value == "fifo") {
+                config.replacement = CacheReplacement::FIFO;
+            } else if (value == "random") {
+                config.replacement = CacheReplacement::RANDOM;
+            } else {
+                is_valid = false;
+            }
+        } else if (key == "write") {
+            is_valid = true;
+            if (value == "back") {
+                config.write_policy = CacheWritePolicy::WRITE_BACK;
+            } else if (value == "through") {
+                config.write_policy = CacheWritePolicy::WRITE_THROUGH;
+            } else {
+                is_valid = false;
+            }
+        } else {
+            is_valid = false;
+        }
+        if (!is_valid) {
+            cerr << "invalid cache option " << item << endl;
+            exit(1);
+        }
+    }
+    // セット数とライン数は2のべき乗にしてアドレスをシフトとマスクで分けられるようにする
+    auto is_power_of_two = [](int value) {
+        return value > 0 && (value & (value - 1)) == 0;
+    };
+    if (!is_power_of_two(config.line) || config.ways <= 0 || config.latency < 0
+        || config.size % (config.line * config.ways) != 0 || !is_power_of_two(config.size / (config.line * config.ways))) {
+        cerr << "invalid cache geometry " << spec << endl;
+        exit(1);
+    }
+    return config;
+}
+
+// キャッシュ1段の統計
+struct CacheCounters {
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t read_misses = 0;
+    uint64_t write_misses = 0;
+    uint64_t evictions = 0;  // 有効なラインを追い出した回数
+    uint64_t writebacks = 0;  // 追い出したラインが書き換わっていて下の階層へ書いた回数
+};
+
+// キャッシュ1段のタグだけを持つモデル (データはMemoryにあり、ヒットかミスかとかかるクロック数だけを求める)
+//   nextがnullptrなら下はメインメモリ
+class CacheLevel {
+private:
+    struct Line {
+        uint16_t tag = 0;
+        bool is_valid = false;
+        bool is_dirty = false;
+        uint64_t stamp = 0;  // LRUなら最後に使った時刻、FIFOなら入れた時刻
+    };
+
+    vector<Line> lines;  // セットごとにways個ずつ並べる
+    int line_shift = 0;
+    int set_mask = 0;
+    uint64_t time = 0;
+    uint32_t random_state = 2463534242u;
+
+    // 下の階層に読み書きしたときにかかるクロック数
+    uint64_t access_next(uint16_t addr, bool is_write, uint64_t memory_latency) {
+        if (next) {
+            return next->access(addr, is_write, memory_latency);
+        }
+        return memory_latency;
+    }
+
+    Line &choose_victim(Line *set) {
+        for (int way = 0; way < config.ways; way++) {
+            if (!set[way].is_valid) {
+                return set[way];
+            }
+        }
+        if (config.replacement == CacheReplacement::RANDOM) {
+            // xorshift32 (再現できるように固定のシードから始める)
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 17;
+            random_state ^= random_state << 5;
+            return set[random_state % config.ways];
+        }
+        Line *victim = &set[0];
+        for (int way = 1; way < config.ways; way++) {
+            if (set[way].stamp < victim->stamp) {
+                victim = &set[way];
+            }
+        }
+        return *victim;
+    }
+
+public:
+    string name;
+    CacheConfig config;
+    CacheLevel *next = nullptr;
+    CacheCounters counters;
+
+    CacheLevel() {
+
+    }
+    CacheLevel(string name, CacheConfig config) {
+        this->name = name;
+        this->config = config;
+        this->lines.resize(config.size / config.line);
+        while ((1 << line_shift) < config.line) {
+            line_shift++;
+        }
+        this->set_mask = config.size / (config.line * config.ways) - 1;
+    }
+
+    // addrのワードを読み書きし、1クロックのメモリアクセスより余分にかかるクロック数を返す
+    uint64_t access(uint16_t addr, bool is_write, uint64_t memory_latency) {
+        int line_number = addr >> line_shift;
+        uint16_t tag = line_number / (set_mask + 1);
+        Line *set = &lines[(line_number & set_mask) * config.ways];
+        time++;
+        (is_write ? counters.writes : counters.reads)++;
+
+        uint64_t cycles = config.latency;
+        for (int way = 0; way < config.ways; way++) {
+            Line &line = set[way];
+            if (line.is_valid && line.tag == tag) {
+                if (config.replacement == CacheReplacement::LRU) {
+                    line.stamp = time;
+                }
+                if (is_write) {
+                    if (config.write_policy == CacheWritePolicy::WRITE_BACK) {
+                        line.is_dirty = true;
+                    } else {
+                        cycles += access_next(addr, true, memory_latency);
+                    }
+                }
+                return cycles;
+            }
+        }
+
+        (is_write ? counters.write_misses : counters.read_misses)++;
+        if (is_write && config.write_policy == CacheWritePolicy::WRITE_THROUGH) {
+            return cycles + access_next(addr, true, memory_latency);
+        }
+        Line &victim = choose_victim(set);
+        if (victim.is_valid) {
+            counters.evictions++;
+            if (victim.is_dirty) {
+                counters.writebacks++;
+                int victim_line = victim.tag * (set_mask + 1) + (line_number & set_mask);
+                cycles += access_next(victim_line << line_shift, true, memory_latency);
+            }
+        }
+        cycles += access_next(addr, false, memory_latency);
+        victim.tag = tag;
+        victim.is_valid = true;
+        victim.is_dirty = is_write;
+        victim.stamp = time;
+        return cycles;
+    }
+};
+
+// 命令用とデータ用に分けたL1と、両方で共有するL2(省略可)からなるキャッシュの階層
+//   CpuとPipelineCpuがメモリにアクセスするたびに呼び、返したクロック数をclock_counterに足す
+//   他のエンジンはキャッシュを見ないので、使わないときのオーバーヘッドはない
+class CacheHierarchy {
+public:
+    CacheLevel l1i;
+    CacheLevel l1d;
+    unique_ptr<CacheLevel> l2;
+    uint64_t memory_latency = 20;  // 最後の階層でミスしたときにメインメモリからかかるクロック数
+    uint64_t penalty_cycles = 0;  // 余分にかかったクロック数の合計
+
+    CacheHierarchy(CacheConfig l1i_config, CacheConfig l1d_config, optional<CacheConfig> l2_config,
+                   uint64_t memory_latency) : l1i("L1I", l1i_config), l1d("L1D", l1d_config) {
+        this->memory_latency = memory_latency;
+        if (l2_config) {
+            l2 = unique_ptr<CacheLevel>(new CacheLevel("L2", l2_config.value()));
+            l1i.next = l2.get();
+            l1d.next = l2.get();
+        }
+    }
+
+    uint64_t fetch(uint16_t addr) {
+        uint64_t cycles = l1i.access(addr, false, memory_latency);
+        penalty_cycles += cycles;
+        return cycles;
+    }
+
+    uint64_t load(uint16_t addr) {
+        uint64_t cycles = l1d.access(addr, false, memory_latency);
+        penalty_cycles += cycles;
+        return cycles;
+    }
+
+    uint64_t store(uint16_t addr) {
+        uint64_t cycles = l1d.access(addr, true, memory_latency);
+        penalty_cycles += cycles;
+        return cycles;
+    }
+};
+
+inline void print_cache_report(ostream &os, const CacheHierarchy &cache) {
+    auto print_level = [&](const CacheLevel &level) {
+        const CacheCounters &c = level.counters;
+        uint64_t accesses = c.reads + c.writes;
+        uint64_t misses = c.read_misses + c.write_misses;
+        os << "CACHE " << setw(3) << left << level.name << right
+           << " size=" << level.config.size << " line=" << level.config.line << " ways=" << level.config.ways
+           << " accesses=" << accesses
+           << " hits=" << accesses - misses
+           << " misses=" << misses
+           << " (read=" << c.read_misses << " write=" << c.write_misses << ")"
+           << " miss-rate=" << fixed << setprecision(2) << (accesses > 0 ? 100.0 * misses / accesses : 0.0) << "%"
+           << defaultfloat
+           << " evictions=" << c.evictions
+           << " writebacks=" << c.writebacks << endl;
+    };
+    print_level(cache.l1i);
+    print_level(cache.l1d);
+    if (cache.l2) {
+        print_level(*cache.l2);
+    }
+    os << "CACHE penalty cycles=" << cache.penalty_cycles << " memory-latency=" << cache.memory_latency << endl;
+}
+
+#endif //EMULATOR_CACHE_HPP
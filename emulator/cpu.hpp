@@ -3,15 +3,24 @@
 
 #include <iostream>
 #include <vector>
-#include <bitset>
 #include <map>
 #include <memory>
-#include <unistd.h>
 #include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <type_traits>
+#include <atomic>
+#include <cstring>
 #include "alu.hpp"
 #include "psw.hpp"
 #include "memory.hpp"
 #include "arch.hpp"
+#include "decode.hpp"
+#include "engine.hpp"
+#include "perf_counters.hpp"
+#include "cache.hpp"
+#include "branch_predictor.hpp"
+#include "device_bus.hpp"
 
 using namespace std;
 
@@ -24,263 +33,376 @@ enum class CpuStatus {
     WRITE_BACK,  // WriteBack (レジスタ、メモリへの下記戻しなど)
 };
 
-class Cpu {
+// Cpuのアーキテクチャ上の状態 (レジスタ、バス、ステータス、カウンタ)
+//   ポインタを持たないのでmemcpyでそのまま保存・復元できる
+struct CpuState {
+    uint16_t registers[CpuArch::REGISTER_COUNT] = {0};
+    uint16_t mar = 0;
+    uint16_t mdr = 0;
+    uint16_t reg_b = 0;
+    uint16_t ir = 0;
+
+    uint16_t s_bus = 0;
+    uint16_t a_bus = 0;
+    uint16_t b_bus = 0;
+    uint64_t clock_counter = 1;
+    uint64_t instruction_counter = 0;  // リタイアした命令数
+    CpuStatus current_status = CpuStatus::FETCH_INST_0;
+    DecodedInst current_inst = {};
+};
+static_assert(static_cast<int>(CpuStatus::WRITE_BACK) + 1 == PERF_PHASE_COUNT, "PERF_PHASE_NAMES must follow CpuStatus");
+static_assert(is_trivially_copyable<CpuState>::value, "CpuState must be trivially copyable");
+
+// 描画用に写したCpuの状態とメモリ
+struct CpuFrame {
+    CpuState state;
+    uint16_t memory[MEMORY_SIZE];
+};
+
+// Cpuのスレッドが状態を書き、描画のスレッドが読むダブルバッファ
+//   描画のスレッドがrequestしたときだけCpuは裏のバッファに書いて表と入れ替えるので、
+//   クロックごとのコストはフラグを1回読むだけで、描画のスレッドが読んでいるバッファには書かない
+class FrameExchange {
 private:
+    CpuFrame frames[2];
+    atomic<bool> is_requested{true};
+    atomic<int> front{-1};  // 最後に書き終わったバッファ (-1ならまだない)
+    atomic<uint64_t> published{0};
 
-    void print_info() {
-        int index = 0;
-        cout << "\033[2J" <<"\033[0;0H";  // clear screen
-        cout << endl << "----------CLOCK------------" << endl;
-        cout << " " << "CLOCK [" << dec << clock_counter << "]" << endl;
-        cout << endl << "-------INSTRUCTION---------" << endl;
-        if (current_program != nullptr) {
-            cout << " " << "IR [ " << current_program->inst.mnemonic << " ";
-            if (current_program->inst.operand_type == OperandType::SINGLE_OPERAND ||
-                current_program->inst.operand_type == OperandType::DOUBLE_OPERAND) {
-                cout << bitset<3>(current_program->first_operand) << " ";
-                if (current_program->inst.operand_type == OperandType::DOUBLE_OPERAND) {
-                    cout << bitset<8>(current_program->second_operand) << " ";
-                }
-            }
-            cout << "]" << endl;
+public:
+    // Cpuのスレッドから毎クロック呼ぶ
+    void sample(const CpuState &state, const uint16_t *memory) {
+        if (!is_requested.load(memory_order_acquire)) {
+            return;
         }
-        cout << endl << "------STATUS COUNTER--------" << endl;
-        for (int i = 0; i < statuses.size(); i++) {
-            cout << " " << statuses[static_cast<CpuStatus>(i)] << " ";
-            if (current_status == static_cast<CpuStatus>(i)) {
-                cout << " <";
+        int back = front.load(memory_order_relaxed) == 0 ? 1 : 0;
+        frames[back].state = state;
+        memcpy(frames[back].memory, memory, sizeof(frames[back].memory));
+        front.store(back, memory_order_release);
+        published.fetch_add(1, memory_order_release);
+        is_requested.store(false, memory_order_relaxed);
+    }
+
+    // 描画のスレッドから呼ぶ: 最新のフレーム (なければnullptr)
+    //   次にrequestするまでは書き換えられない
+    const CpuFrame *get_front() const {
+        int index = front.load(memory_order_acquire);
+        return index >= 0 ? &frames[index] : nullptr;
+    }
+
+    uint64_t get_published() const {
+        return published.load(memory_order_acquire);
+    }
+
+    // 描画のスレッドから呼ぶ: 読み終わったので次のフレームを書いてもらう
+    void request() {
+        is_requested.store(true, memory_order_release);
+    }
+};
+
+class Cpu : public Engine, public CpuState {
+private:
+
+    // Memory::accessを呼び、パフォーマンスカウンタがあれば読み書きを数える
+    //   キャッシュがあれば、ミスで余分にかかったクロック数をclock_counter (とカウンタ) に足す
+    void access_memory(MemoryMode mode) {
+        // デバイスに割り当てたアドレスへのld, stはデバイスに渡す (キャッシュは通さない)
+        bool is_device = devices && current_status != CpuStatus::FETCH_INST_1 && devices->is_mapped(mar);
+        if (is_device) {
+            if (mode == MemoryMode::READ) {
+                mdr = devices->read(mar);
+            } else {
+                devices->write(mar, mdr);
             }
-            cout << endl;
+        } else {
+            memory->mode = mode;
+            memory->access(&mar, &mdr);
         }
-        cout << endl << "---------REGISTER-----------" << endl;
-        for(uint16_t reg: registers) {
-            stringstream hex_str;
-            cout << " " <<  "R" << index << " [" << bitset<16>(reg) << "] (0x" << hex << reg << ") ";
-            if (index == arch->PC_REG_NUMBER) {
-                cout << " (PC) ";
+        if (PERF_COUNTERS_AVAILABLE && perf) {
+            if (mode == MemoryMode::READ) {
+                perf->memory_reads++;
+            } else {
+                perf->memory_writes++;
             }
-            if (index == arch->SP_REG_NUMBER) {
-                cout << " (SP) ";
+        }
+        if (cache && !is_device) {
+            uint64_t penalty;
+            if (mode == MemoryMode::WRITE) {
+                penalty = cache->store(mar);
+            } else if (current_status == CpuStatus::FETCH_INST_1) {
+                penalty = cache->fetch(mar);
+            } else {
+                penalty = cache->load(mar);
             }
-            if (index == arch->PSW_REG_NUMBER) {
-                cout << "N = "<< psw->get_negative_flag() << " ";
-                cout << "Z = "<< psw->get_zero_flag() << " ";
-                cout << " (PSW) ";
+            clock_counter += penalty;
+            if (PERF_COUNTERS_AVAILABLE && perf) {
+                perf->phase_cycles[static_cast<int>(current_status)] += penalty;
+                perf->pc_cycles[perf->current_pc] += penalty;
             }
-            cout << endl;
-            index++;
         }
-        cout << endl << "----------MEMORY------------" << endl;
-        int min_memory_index = (registers[arch->PC_REG_NUMBER] - 2) >= 0 ? registers[arch->PC_REG_NUMBER] - 2 : 0;
-        for (int i = min_memory_index; i < (min_memory_index + 5); i++) {
-            cout << " " << "[0x" << hex << i << "] [" << bitset<16>(memory->memory[i]) << "] ";
-            if (i == registers[arch->PC_REG_NUMBER]) {
-                cout << "(PC)";
-            }
-            cout << endl;
+    }
+
+    void retire() {
+        instruction_counter++;
+        if (PERF_COUNTERS_AVAILABLE && perf) {
+            perf->retired[static_cast<int>(current_inst.type)]++;
         }
-        cout << endl;
-        cout << " " << "[0x64] [" << bitset<16>(memory->memory[0x64]) << "] (" << dec << memory->memory[0x64] << ") " << endl;
-        cout << "--------------------------" << endl;
     }
 
 
 public:
-    shared_ptr<Alu> alu;
-    shared_ptr<Psw> psw;
+    // AluとPswは自分のregistersを指すだけなので値で持つ (状態はCpuStateにある)
+    Psw psw;
+    Alu alu;
     shared_ptr<Memory> memory;
     shared_ptr<CpuArch> arch;
 
-    uint16_t mar = 0;
-    uint16_t mdr = 0;
-
-    map<CpuStatus, string> statuses;
-
-    vector<uint16_t> registers;
-    uint16_t reg_b = 0;
-    uint16_t ir = 0;
-
-    uint16_t s_bus = 0;
-    uint16_t a_bus = 0;
-    uint16_t b_bus = 0;
-    int clock_counter = 1;
-    CpuStatus current_status = CpuStatus::FETCH_INST_0;
-    shared_ptr<Program> current_program;
+    bool is_headless = false;  // trueならframesに状態を渡さない
+    bool is_invalid = false;  // 不正な命令をデコードしてclockが止まった
+    const DecodeTable *decode_table = nullptr;
+    PerfCounters *perf = nullptr;  // nullptrでなければクロックごとにカウンタを数える
+    shared_ptr<SymbolTable> symbols;  // 描画とレポートでアドレスをラベルと行番号で表すのに使う
+    CacheHierarchy *cache = nullptr;  // nullptrでなければメモリアクセスをキャッシュに通してミスの分だけクロックを足す
+    BranchUnit *branch_unit = nullptr;  // nullptrでなければje, jmpの予測の精度を数える (Cpuでは予測でクロックは変わらない)
+    FrameExchange *frames = nullptr;  // nullptrでなければ描画のスレッドが要求したときに状態を書く
+    DeviceBus *devices = nullptr;  // nullptrでなければ割り当てたアドレスへのld, stをデバイスに渡す
 
     Cpu() {
 
     }
     Cpu(shared_ptr<Memory> memory, shared_ptr<CpuArch> arch) {
-        clock_counter = 1;
-
-        // デバッグしやすいように文字列にしておく
-        statuses[CpuStatus::FETCH_INST_0] = "FETCH_INST_0";
-        statuses[CpuStatus::FETCH_INST_1] = "FETCH_INST_1";
-        statuses[CpuStatus::FETCH_OPERAND_0] = "FETCH_OPERAND_0";
-        statuses[CpuStatus::FETCH_OPERAND_1] = "FETCH_OPERAND_1";
-        statuses[CpuStatus::EXEC_INST] = "EXEC_INST";
-        statuses[CpuStatus::WRITE_BACK] = "WRITE_BACK";
-
         this->memory = memory;
         this->arch = arch;
-        this->registers = vector<uint16_t>();
-        for (auto r: arch->registers) {
-            this->registers.push_back(0);
-        }
-        this->psw = shared_ptr<Psw>(new Psw(&this->registers[arch->PSW_REG_NUMBER]));
-        this->alu = shared_ptr<Alu>(new Alu(this->psw));
+        this->decode_table = &DecodeTable::get_instance();
+        this->psw = Psw(&this->registers[arch->PSW_REG_NUMBER]);
+        this->alu = Alu(&this->psw);
+    }
+
+    // AluとPswがregistersを指しているのでコピーはできない (状態のコピーはCpuStateで行う)
+    Cpu(const Cpu &) = delete;
+    Cpu &operator=(const Cpu &) = delete;
+
+    CpuState &get_state() {
+        return *this;
     }
 
     // クロック時の処理
     bool clock() {
         bool is_hlt = false;
+        if (PERF_COUNTERS_AVAILABLE && perf) {
+            if (current_status == CpuStatus::FETCH_INST_0) {
+                perf->current_pc = registers[arch->PC_REG_NUMBER];
+            }
+            perf->phase_cycles[static_cast<int>(current_status)]++;
+            perf->pc_cycles[perf->current_pc]++;
+        }
         switch (current_status) {
             case CpuStatus::FETCH_INST_0:
                 a_bus = registers[arch->PC_REG_NUMBER];
-                alu->mode = AluMode::NOP;
-                s_bus = alu->calc(a_bus, b_bus);
+                alu.mode = AluMode::NOP;
+                s_bus = alu.calc(a_bus, b_bus);
                 current_status = CpuStatus::FETCH_INST_1;
                 break;
             case CpuStatus::FETCH_INST_1:
                 mar = s_bus;
-                memory->mode = MemoryMode::READ;
-                memory->access(&mar, &mdr);
-                alu->mode = AluMode::INC;
-                s_bus = alu->calc(a_bus, b_bus);
+                access_memory(MemoryMode::READ);
+                alu.mode = AluMode::INC;
+                s_bus = alu.calc(a_bus, b_bus);
                 current_status = CpuStatus::FETCH_OPERAND_0;
                 break;
             case CpuStatus::FETCH_OPERAND_0:
                 ir = mdr;
-                current_program = Program::decode(ir, arch);
+                current_inst = decode_table->decode(ir);
+                if (!current_inst.is_valid) {
+                    // FETCH_OPERAND_0のまま止まる (もう一度clockを呼んでも同じところで止まる)
+                    cerr << "invalid opcode " << static_cast<int>(current_inst.opcode) << endl;
+                    is_invalid = true;
+                    return true;
+                }
+                if (PERF_COUNTERS_AVAILABLE && perf) {
+                    perf->pc_histogram[perf->current_pc]++;
+                }
                 registers[arch->PC_REG_NUMBER] = s_bus;
-                if (current_program->inst.type == InstructionType::MOV
-                    || current_program->inst.type == InstructionType::ADD
-                    || current_program->inst.type == InstructionType::SUB
-                    || current_program->inst.type == InstructionType::AND
-                    || current_program->inst.type == InstructionType::OR
-                    || current_program->inst.type == InstructionType::CMP) {
-                    a_bus = registers[current_program->second_operand >> 5];
+                if (current_inst.type == InstructionType::MOV
+                    || current_inst.type == InstructionType::ADD
+                    || current_inst.type == InstructionType::SUB
+                    || current_inst.type == InstructionType::AND
+                    || current_inst.type == InstructionType::OR
+                    || current_inst.type == InstructionType::CMP) {
+                    a_bus = registers[current_inst.second_operand >> 5];
                     current_status = CpuStatus::EXEC_INST;
-                } else if (current_program->inst.type == InstructionType::SL || current_program->inst.type == InstructionType::SR) {
-                    a_bus = registers[current_program->first_operand];
+                } else if (current_inst.type == InstructionType::SL || current_inst.type == InstructionType::SR) {
+                    a_bus = registers[current_inst.first_operand];
                     current_status = CpuStatus::EXEC_INST;
-                }else if (current_program->inst.type == InstructionType::LD || current_program->inst.type == InstructionType::ST) {
-                        a_bus = current_program->second_operand;
+                }else if (current_inst.type == InstructionType::LD || current_inst.type == InstructionType::ST) {
+                        a_bus = current_inst.second_operand;
                         current_status = CpuStatus::FETCH_OPERAND_1;
                 } else {
                     current_status = CpuStatus::EXEC_INST;
                 }
-                alu->mode = AluMode::NOP;
-                s_bus = alu->calc(a_bus, b_bus);
+                alu.mode = AluMode::NOP;
+                s_bus = alu.calc(a_bus, b_bus);
 
                 break;
             case CpuStatus::FETCH_OPERAND_1:
                 mar = s_bus;
-                if (current_program->inst.type == InstructionType::LD) {
-                    memory->mode = MemoryMode::READ;
-                    memory->access(&mar, &mdr);
+                if (current_inst.type == InstructionType::LD) {
+                    access_memory(MemoryMode::READ);
                 }
-                alu->mode = AluMode::NOP;
-                s_bus = alu->calc(a_bus, b_bus);
+                alu.mode = AluMode::NOP;
+                s_bus = alu.calc(a_bus, b_bus);
                 current_status = CpuStatus::EXEC_INST;
                 break;
             case CpuStatus::EXEC_INST:
-                switch (current_program->inst.type) {
+                switch (current_inst.type) {
                     case InstructionType::HLT:
                         is_hlt = true;
+                        retire();
                         break;
                     case InstructionType::ADD:
                         reg_b = s_bus;
                         b_bus = reg_b;
-                        a_bus = registers[current_program->first_operand];
-                        alu->mode = AluMode::ADD;
+                        a_bus = registers[current_inst.first_operand];
+                        alu.mode = AluMode::ADD;
                         break;
                     case InstructionType::SUB:
                         reg_b = s_bus;
                         b_bus = reg_b;
-                        a_bus = registers[current_program->first_operand];
-                        alu->mode = AluMode::SUB;
+                        a_bus = registers[current_inst.first_operand];
+                        alu.mode = AluMode::SUB;
                         break;
                     case InstructionType::AND:
                         reg_b = s_bus;
                         b_bus = reg_b;
-                        a_bus = registers[current_program->first_operand];
-                        alu->mode = AluMode::AND;
+                        a_bus = registers[current_inst.first_operand];
+                        alu.mode = AluMode::AND;
                         break;
                     case InstructionType::OR:
                         reg_b = s_bus;
                         b_bus = reg_b;
-                        a_bus = registers[current_program->first_operand];
-                        alu->mode = AluMode::OR;
+                        a_bus = registers[current_inst.first_operand];
+                        alu.mode = AluMode::OR;
                         break;
                     case InstructionType::SL:
-                        alu->mode = AluMode::SHIFT_L;
+                        alu.mode = AluMode::SHIFT_L;
                         break;
                     case InstructionType::SR:
-                        alu->mode = AluMode::SHIFT_R;
+                        alu.mode = AluMode::SHIFT_R;
                         break;
                     case InstructionType::LDL:
-                        a_bus = current_program->second_operand;
-                        alu->mode = AluMode::NOP;
+                        a_bus = current_inst.second_operand;
+                        alu.mode = AluMode::NOP;
                         break;
                     case InstructionType::LDH:
-                        a_bus = current_program->second_operand << 8;
-                        alu->mode = AluMode::NOP;
+                        a_bus = current_inst.second_operand << 8;
+                        alu.mode = AluMode::NOP;
                         break;
                     case InstructionType::CMP:
                         reg_b = s_bus;
                         b_bus = reg_b;
-                        a_bus = registers[current_program->first_operand];
-                        alu->mode = AluMode::CMP;
+                        a_bus = registers[current_inst.first_operand];
+                        alu.mode = AluMode::CMP;
                         break;
                     case InstructionType::JE:
-                        a_bus = current_program->second_operand;
-                        current_program->first_operand = arch->PC_REG_NUMBER;
-                        alu->mode = AluMode::NOP;
+                        a_bus = current_inst.second_operand;
+                        current_inst.first_operand = arch->PC_REG_NUMBER;
+                        alu.mode = AluMode::NOP;
                         break;
                     case InstructionType::JMP:
-                        a_bus = current_program->second_operand;
-                        current_program->first_operand = arch->PC_REG_NUMBER;
-                        alu->mode = AluMode::NOP;
+                        a_bus = current_inst.second_operand;
+                        current_inst.first_operand = arch->PC_REG_NUMBER;
+                        alu.mode = AluMode::NOP;
                         break;
                     case InstructionType::LD:
                         a_bus = mdr;
-                        alu->mode = AluMode::NOP;
+                        alu.mode = AluMode::NOP;
                         break;
                     case InstructionType::ST:
-                        a_bus = registers[current_program->first_operand];
-                        alu->mode = AluMode::NOP;
+                        a_bus = registers[current_inst.first_operand];
+                        alu.mode = AluMode::NOP;
                         break;
                 }
-                s_bus = alu->calc(a_bus, b_bus);
+                s_bus = alu.calc(a_bus, b_bus);
 
                 current_status = CpuStatus::WRITE_BACK;
                 break;
             case CpuStatus::WRITE_BACK:
-                if (current_program->inst.type == InstructionType::ST) {
+                if (branch_unit && (current_inst.type == InstructionType::JE || current_inst.type == InstructionType::JMP)) {
+                    // PCはまだ分岐命令の次を指している
+                    bool is_taken = current_inst.type == InstructionType::JMP || psw.get_zero_flag();
+                    branch_unit->resolve(registers[arch->PC_REG_NUMBER] - 1, current_inst.type, is_taken, s_bus);
+                }
+                if (current_inst.type == InstructionType::ST) {
                     mdr = s_bus;
-                    memory->mode = MemoryMode::WRITE;
-                    memory->access(&mar, &mdr);
-                } else if (current_program->inst.type == InstructionType::LDL || current_program->inst.type == InstructionType::LDH) {
+                    access_memory(MemoryMode::WRITE);
+                } else if (current_inst.type == InstructionType::LDL || current_inst.type == InstructionType::LDH) {
                     // 上位、下位にそれぞれbitを別命令として入れるのでOR
-                    registers[current_program->first_operand] |= s_bus;
-                } else if(current_program->inst.type == InstructionType::JE) {
-                    if (psw->get_zero_flag()) {
-                        registers[current_program->first_operand] = s_bus;
+                    registers[current_inst.first_operand] |= s_bus;
+                } else if(current_inst.type == InstructionType::JE) {
+                    bool is_taken = psw.get_zero_flag();
+                    if (is_taken) {
+                        registers[current_inst.first_operand] = s_bus;
+                    }
+                    if (PERF_COUNTERS_AVAILABLE && perf) {
+                        (is_taken ? perf->je_taken : perf->je_not_taken)++;
                     }
-                } else if (current_program->inst.type == InstructionType::CMP) {
+                } else if (current_inst.type == InstructionType::CMP) {
                     // pass
                 } else {
-                    registers[current_program->first_operand] = s_bus;
+                    registers[current_inst.first_operand] = s_bus;
                 }
                 current_status = CpuStatus::FETCH_INST_0;
+                retire();
                 break;
         }
-        print_info();
+        if (!is_headless && frames) {
+            frames->sample(*this, memory->memory);
+        }
         clock_counter++;
         return is_hlt;
     }
 
+    // 命令の境界(FETCH_INST_0)まで描画せずにクロックを回す
+    //   命令単位で実行するエンジンがマイクロステップの途中から引き継ぐときに使う
+    //   途中でhltを実行したらtrueを返す
+    bool finish_instruction() {
+        bool is_hlt = false;
+        bool is_headless = this->is_headless;
+        this->is_headless = true;
+        while (current_status != CpuStatus::FETCH_INST_0 && !is_hlt) {
+            is_hlt = clock();
+        }
+        this->is_headless = is_headless;
+        return is_hlt;
+    }
+
+    // hltか上限に達するまでsleepせずにクロックを回す
+    //   命令数の上限は命令の境界(FETCH_INST_0)でのみ判定する
+    RunStats run(RunLimit limit) override {
+        RunStats stats;
+        auto start = chrono::steady_clock::now();
+        while (true) {
+            if (limit.max_cycles > 0 && clock_counter - 1 >= limit.max_cycles) {
+                stats.halt_reason = HaltReason::CYCLE_LIMIT;
+                break;
+            }
+            if (limit.max_instructions > 0 && current_status == CpuStatus::FETCH_INST_0
+                && instruction_counter >= limit.max_instructions) {
+                stats.halt_reason = HaltReason::INST_LIMIT;
+                break;
+            }
+            if (clock()) {
+                stats.halt_reason = is_invalid ? HaltReason::INVALID_OPCODE : HaltReason::HLT;
+                break;
+            }
+        }
+        auto end = chrono::steady_clock::now();
+        stats.cycles = clock_counter - 1;
+        stats.instructions = instruction_counter;
+        stats.wall_seconds = chrono::duration<double>(end - start).count();
+        return stats;
+    }
+
 };
 
 
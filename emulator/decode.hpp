@@ -0,0 +1,113 @@
+#ifndef EMULATOR_DECODE_HPP
+#define EMULATOR_DECODE_HPP
+
+#include <cstdint>
+#include <memory>
+#include "arch.hpp"
+
+using namespace std;
+
+// Cpu::clockで1命令を実行するのにかかるクロック数
+//   FETCH_INST_0, FETCH_INST_1, FETCH_OPERAND_0, EXEC_INST, WRITE_BACKの5クロック
+//   ld, stはFETCH_OPERAND_1が入るので6クロック、hltはEXEC_INSTで止まるので4クロック
+constexpr uint8_t get_inst_cycles(InstructionType type) {
+    switch (type) {
+        case InstructionType::LD:
+        case InstructionType::ST:
+            return 6;
+        case InstructionType::HLT:
+            return 4;
+        default:
+            return 5;
+    }
+}
+
+// デコード済みの命令
+//   Programと違って文字列を持たないPODなのでコピーしてもアロケーションが起きない
+struct DecodedInst {
+    InstructionType type;
+    OperandType operand_type;
+    uint8_t opcode;
+    uint8_t first_operand;  // 10-8bit
+    uint8_t second_operand;  // 7-0bit
+    uint8_t cycles;
+    bool is_valid;  // 定義されていないopcodeならfalse
+    bool uses_psw;  // オペランドとしてPSW(r5)を読み書きする
+    bool needs_check;  // 不正命令かPSWを使う命令 (実行前に特別な処理が要る)
+};
+
+// 命令がオペランドのレジスタとしてPSWを使うか
+//   je, jmpの第1オペランドとld, st, ldl, ldhの第2オペランドはレジスタではないので見ない
+constexpr bool uses_psw_operand(const DecodedInst &d, int psw) {
+    if (!d.is_valid) {
+        return false;
+    }
+    switch (d.type) {
+        case InstructionType::MOV:
+        case InstructionType::ADD:
+        case InstructionType::SUB:
+        case InstructionType::AND:
+        case InstructionType::OR:
+        case InstructionType::CMP:
+            return d.first_operand == psw || (d.second_operand >> 5) == psw;
+        case InstructionType::SL:
+        case InstructionType::SR:
+        case InstructionType::LDL:
+        case InstructionType::LDH:
+        case InstructionType::LD:
+        case InstructionType::ST:
+            return d.first_operand == psw;
+        default:
+            return false;
+    }
+}
+
+// 16bitの命令コード全てについてデコード結果を持つテーブル
+//   デコードはインデックスで1回引くだけになる
+class DecodeTable {
+private:
+    // opcodeの2048通りのオペランド (と使われない15bit目) についてデコード結果を埋める
+    //   命令の種類とクロック数はOpcodeTraitsからコンパイル時に決まるので、ループにはオペランドの処理だけが残る
+    template <typename TRAITS>
+    void fill_opcode(TRAITS) {
+        constexpr InstructionType type = TRAITS::is_valid ? TRAITS::inst.type : InstructionType::HLT;
+        constexpr uint8_t cycles = get_inst_cycles(type);
+        for (int operands = 0; operands < 1 << 11; operands++) {
+            DecodedInst d;
+            d.opcode = TRAITS::opcode;
+            d.first_operand = operands >> 8;
+            d.second_operand = operands & 0xff;
+            d.is_valid = TRAITS::is_valid;
+            d.type = type;
+            d.operand_type = TRAITS::inst.operand_type;
+            d.cycles = cycles;
+            d.uses_psw = uses_psw_operand(d, CpuArch::PSW_REG_NUMBER);
+            d.needs_check = d.uses_psw || !d.is_valid;
+            uint16_t code = (TRAITS::opcode << 11) | operands;
+            entries[code] = d;
+            entries[code | 0x8000] = d;
+        }
+    }
+
+public:
+    static const int TABLE_SIZE = 1 << 16;
+    DecodedInst entries[TABLE_SIZE];
+
+    DecodeTable() {
+        for_each_opcode([&](auto traits) {
+            fill_opcode(traits);
+        });
+    }
+
+    const DecodedInst &decode(uint16_t code) const {
+        return entries[code];
+    }
+
+    // プロセスで1回だけ構築して全てのCpuで共有する
+    static const DecodeTable &get_instance() {
+        static const unique_ptr<DecodeTable> table(new DecodeTable());
+        return *table;
+    }
+};
+
+#endif //EMULATOR_DECODE_HPP
@@ -0,0 +1,540 @@
+#ifndef EMULATOR_DEVICE_BUS_HPP
+#define EMULATOR_DEVICE_BUS_HPP
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "memory.hpp"
+
+using namespace std;
+
+// 標準のデバイスを割り当てるアドレス (メモリの最後の16ワード)
+const uint16_t DEVICE_CONSOLE_ADDR = 0xf0;  // +0 DATA (st: 1文字出力), +1 STATUS (ld: 出力キューの空き)
+const uint16_t DEVICE_TIMER_ADDR = 0xf2;  // +0 LO (ld: 起動からのミリ秒の下位16bit、上位を固定する), +1 HI
+const uint16_t DEVICE_INPUT_ADDR = 0xf4;  // +0 DATA (ld: 1バイト、空なら0xffff), +1 STATUS (ld: 0 空, 1 データあり, 2 終わり)
+const uint16_t DEVICE_BLOCK_ADDR = 0xf8;  // +0 NUMBER, +1 DATA, +2 COMMAND (st: 1 読む, 2 書く), +3 STATUS (ld: 0 完了, 1 実行中, 2 エラー)
+const uint16_t DEVICE_MEMORY_ADDR = 0xfc;  // +0 ADDR, +1 DATA (ld, st: ADDRのワードを読み書きしてADDRを1進める), +2 BANK
+
+// 1つのスレッドが入れて、もう1つのスレッドが出すロックフリーのリングバッファ
+//   いっぱいならpushは、空ならpopはfalseを返して待たない
+template <typename T, size_t CAPACITY>
+class SpscQueue {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+private:
+    T items[CAPACITY];
+    alignas(64) atomic<size_t> head{0};  // 次に出す位置 (出す側だけが書く)
+    alignas(64) atomic<size_t> tail{0};  // 次に入れる位置 (入れる側だけが書く)
+
+public:
+    bool push(const T &item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == CAPACITY) {
+            return false;
+        }
+        items[t % CAPACITY] = item;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) {
+            return false;
+        }
+        item = items[h % CAPACITY];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // 相手のスレッドが動いているので目安の値
+    size_t size() const {
+        return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+    }
+
+    size_t get_free() const {
+        return CAPACITY - size();
+    }
+};
+
+// アドレスに割り当てるデバイス
+//   read, writeはCpuのスレッドから呼ばれるので、ホストの入出力はせずにキューに積むだけにする
+//   serviceはデバイスのスレッドから呼ばれ、キューを見てホストの入出力をする
+class Device {
+public:
+    virtual ~Device() {
+
+    }
+    // offsetは割り当てた範囲の先頭からのワード数
+    virtual uint16_t read(uint16_t offset) = 0;
+    virtual void write(uint16_t offset, uint16_t value) = 0;
+    // 何か仕事をしたらtrueを返す
+    virtual bool service() {
+        return false;
+    }
+    // デバイスのスレッドを止めた後に、キューに残った仕事を片付ける
+    virtual void finish() {
+
+    }
+    virtual void print_report(ostream &os) const = 0;
+};
+
+// 1文字ずつ標準出力に書くコンソール
+//   キューがいっぱいのときに書いた文字は捨てて数える (STATUSで空きを見てから書けば捨てられない)
+class ConsoleDevice : public Device {
+private:
+    SpscQueue<uint8_t, 4096> output;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+
+    bool flush_output() {
+        uint8_t buffer[4096];
+        size_t size = 0;
+        while (size < sizeof(buffer) && output.pop(buffer[size])) {
+            size++;
+        }
+        if (size == 0) {
+            return false;
+        }
+        fwrite(buffer, 1, size, stdout);
+        fflush(stdout);
+        return true;
+    }
+
+public:
+    uint16_t read(uint16_t offset) override {
+        if (offset == 1) {
+            return static_cast<uint16_t>(min<size_t>(output.get_free(), 0xffff));
+        }
+        return 0;
+    }
+
+    void write(uint16_t offset, uint16_t value) override {
+        if (offset != 0) {
+            return;
+        }
+        if (output.push(static_cast<uint8_t>(value))) {
+            written++;
+        } else {
+            dropped++;
+        }
+    }
+
+    bool service() override {
+        return flush_output();
+    }
+
+    void finish() override {
+        while (flush_output()) {
+        }
+    }
+
+    void print_report(ostream &os) const override {
+        os << "DEVICE console written=" << written << " dropped=" << dropped << endl;
+    }
+};
+
+// 起動してからのミリ秒を返すタイマ
+//   LOを読んだ時点の値のHIを覚えておくので、LO, HIの順に読めば32bitの値が揃う
+class TimerDevice : public Device {
+private:
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    uint16_t latched_high = 0;
+
+public:
+    uint16_t read(uint16_t offset) override {
+        if (offset == 1) {
+            return latched_high;
+        }
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        latched_high = static_cast<uint16_t>(elapsed >> 16);
+        return static_cast<uint16_t>(elapsed);
+    }
+
+    void write(uint16_t, uint16_t) override {
+
+    }
+
+    void print_report(ostream &os) const override {
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        os << "DEVICE timer elapsed=" << elapsed << "ms" << endl;
+    }
+};
+
+// ファイルから1バイトずつ読める入力FIFO
+//   デバイスのスレッドが先読みしてキューに入れておき、Cpuのスレッドは取り出すだけ
+class InputDevice : public Device {
+private:
+    SpscQueue<uint8_t, 4096> input;
+    int fd = -1;
+    atomic<bool> is_eof{false};  // ファイルを最後まで読んでキューに入れ終わった
+    uint64_t bytes_read = 0;
+
+public:
+    static const uint16_t STATUS_EMPTY = 0;
+    static const uint16_t STATUS_READY = 1;
+    static const uint16_t STATUS_END = 2;
+
+    // file_pathが空なら最初から終わっている入力になる ("-"なら標準入力)
+    InputDevice(string file_path) {
+        if (file_path.empty()) {
+            is_eof = true;
+        } else if (file_path == "-") {
+            fd = STDIN_FILENO;
+        } else {
+            fd = open(file_path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                cerr << "can not open " << file_path << endl;
+                exit(1);
+            }
+        }
+    }
+
+    ~InputDevice() {
+        if (fd > STDIN_FILENO) {
+            close(fd);
+        }
+    }
+
+    uint16_t read(uint16_t offset) override {
+        if (offset == 1) {
+            // 終わりの印を先に見る (印が立つ前に入れたバイトはsizeで必ず見える)
+            bool eof = is_eof.load(memory_order_acquire);
+            if (input.size() > 0) {
+                return STATUS_READY;
+            }
+            return eof ? STATUS_END : STATUS_EMPTY;
+        }
+        uint8_t value;
+        if (!input.pop(value)) {
+            return 0xffff;
+        }
+        bytes_read++;
+        return value;
+    }
+
+    void write(uint16_t, uint16_t) override {
+
+    }
+
+    bool service() override {
+        if (is_eof.load(memory_order_relaxed)) {
+            return false;
+        }
+        size_t free = input.get_free();
+        if (free == 0) {
+            return false;
+        }
+        // 標準入力で待たされないように読めるときだけ読む
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 0) <= 0) {
+            return false;
+        }
+        uint8_t buffer[4096];
+        ssize_t size = ::read(fd, buffer, min(free, sizeof(buffer)));
+        if (size <= 0) {
+            is_eof.store(true, memory_order_release);
+            return true;
+        }
+        for (ssize_t i = 0; i < size; i++) {
+            input.push(buffer[i]);
+        }
+        return true;
+    }
+
+    void print_report(ostream &os) const override {
+        os << "DEVICE input read=" << bytes_read << " pending=" << input.size() << endl;
+    }
+};
+
+// ファイルをBLOCK_WORDSワードのブロックの列として読み書きするブロックデバイス
+//   NUMBERにブロック番号を書いてCOMMANDを書くと、デバイスのスレッドがファイルを読み書きする
+//   DATAはブロック1つ分のバッファを先頭から順に読み書きするポート (COMMANDと完了で先頭に戻る)
+//   実行中はSTATUSが1になり、完了を見るのはSTATUSを読んだとき
+class BlockDevice : public Device {
+public:
+    static const int BLOCK_WORDS = 64;
+    static const uint16_t COMMAND_READ = 1;
+    static const uint16_t COMMAND_WRITE = 2;
+    static const uint16_t STATUS_DONE = 0;
+    static const uint16_t STATUS_BUSY = 1;
+    static const uint16_t STATUS_ERROR = 2;
+
+private:
+    struct BlockRequest {
+        uint16_t command;
+        uint16_t number;
+        uint16_t data[BLOCK_WORDS];
+        bool is_ok;
+    };
+    // 実行中は次のCOMMANDを受け付けないので、キューには多くても1つしか入らない
+    SpscQueue<BlockRequest, 2> requests;
+    SpscQueue<BlockRequest, 2> completions;
+    int fd = -1;
+
+    // Cpuのスレッドの状態
+    uint16_t number = 0;
+    uint16_t buffer[BLOCK_WORDS] = {0};
+    int index = 0;
+    uint16_t status = STATUS_DONE;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t errors = 0;
+
+    bool process_request() {
+        BlockRequest request;
+        if (!requests.pop(request)) {
+            return false;
+        }
+        off_t offset = static_cast<off_t>(request.number) * sizeof(request.data);
+        if (request.command == COMMAND_READ) {
+            // ファイルの終わりより後ろは0として読む
+            memset(request.data, 0, sizeof(request.data));
+            request.is_ok = pread(fd, request.data, sizeof(request.data), offset) >= 0;
+        } else {
+            request.is_ok = pwrite(fd, request.data, sizeof(request.data), offset) == sizeof(request.data);
+        }
+        completions.push(request);
+        return true;
+    }
+
+    void poll_completion() {
+        BlockRequest completion;
+        if (status != STATUS_BUSY || !completions.pop(completion)) {
+            return;
+        }
+        if (!completion.is_ok) {
+            errors++;
+            status = STATUS_ERROR;
+        } else {
+            if (completion.command == COMMAND_READ) {
+                memcpy(buffer, completion.data, sizeof(buffer));
+            }
+            status = STATUS_DONE;
+        }
+        index = 0;
+    }
+
+public:
+    BlockDevice(string file_path) {
+        fd = open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "can not open " << file_path << endl;
+            exit(1);
+        }
+    }
+
+    ~BlockDevice() {
+        close(fd);
+    }
+
+    uint16_t read(uint16_t offset) override {
+        switch (offset) {
+            case 0:
+                return number;
+            case 1:
+                return buffer[index++ % BLOCK_WORDS];
+            case 3:
+                poll_completion();
+                return status;
+            default:
+                return 0;
+        }
+    }
+
+    void write(uint16_t offset, uint16_t value) override {
+        switch (offset) {
+            case 0:
+                number = value;
+                break;
+            case 1:
+                buffer[index++ % BLOCK_WORDS] = value;
+                break;
+            case 2: {
+                if (status == STATUS_BUSY || (value != COMMAND_READ && value != COMMAND_WRITE)) {
+                    break;
+                }
+                BlockRequest request;
+                request.command = value;
+                request.number = number;
+                memcpy(request.data, buffer, sizeof(buffer));
+                requests.push(request);
+                (value == COMMAND_READ ? reads : writes)++;
+                status = STATUS_BUSY;
+                index = 0;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    bool service() override {
+        return process_request();
+    }
+
+    // 書き込みが残っていればファイルに反映する
+    void finish() override {
+        while (process_request()) {
+        }
+    }
+
+    void print_report(ostream &os) const override {
+        os << "DEVICE block reads=" << reads << " writes=" << writes << " errors=" << errors << endl;
+    }
+};
+
+// ld, stの8bitのアドレスでは届かないメモリを読み書きするポート
+//   ADDRに16bitのアドレスを書き、DATAを読み書きするたびにADDRが1つ進む
+//   BANKに書くと1ページ目より後ろのバンクを切り替える
+//   Cpuのスレッドだけで完結するのでキューは使わない
+class MemoryPortDevice : public Device {
+private:
+    Memory *memory;
+    uint16_t addr = 0;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t bank_switches = 0;
+
+public:
+    MemoryPortDevice(Memory *memory) {
+        this->memory = memory;
+    }
+
+    uint16_t read(uint16_t offset) override {
+        switch (offset) {
+            case 0:
+                return addr;
+            case 1:
+                reads++;
+                return memory->read(addr++);
+            case 2:
+                return static_cast<uint16_t>(memory->get_bank());
+            default:
+                return 0;
+        }
+    }
+
+    void write(uint16_t offset, uint16_t value) override {
+        switch (offset) {
+            case 0:
+                addr = value;
+                break;
+            case 1:
+                writes++;
+                memory->write(addr++, value);
+                break;
+            case 2:
+                bank_switches++;
+                memory->select_bank(value);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void print_report(ostream &os) const override {
+        os << "DEVICE memory reads=" << reads << " writes=" << writes << " bank-switches=" << bank_switches << endl;
+    }
+};
+
+// アドレスをデバイスに振り分けるバス
+//   ld, stのアドレスごとにデバイスを引く表を持つ (割り当てのないアドレスは普通のメモリ)
+//   デバイスのホスト側の仕事は1つのスレッドでまとめて行い、暇なときは少しだけ寝る
+class DeviceBus {
+private:
+    Device *devices[MEMORY_SIZE] = {nullptr};
+    uint16_t bases[MEMORY_SIZE] = {0};
+    vector<unique_ptr<Device>> owned;
+    thread worker;
+    atomic<bool> is_running{false};
+
+    void service_loop() {
+        while (is_running.load(memory_order_acquire)) {
+            bool is_busy = false;
+            for (auto &device: owned) {
+                is_busy |= device->service();
+            }
+            if (!is_busy) {
+                this_thread::sleep_for(chrono::microseconds(50));
+            }
+        }
+    }
+
+public:
+    ~DeviceBus() {
+        stop();
+    }
+
+    // [start, start + count)をdeviceに割り当てる
+    void map_device(uint16_t start, uint16_t count, unique_ptr<Device> device) {
+        for (int addr = start; addr < start + count; addr++) {
+            if (addr >= MEMORY_SIZE || devices[addr] != nullptr) {
+                cerr << "device range 0x" << hex << start << "-0x" << start + count - 1 << dec << " is not available" << endl;
+                exit(1);
+            }
+            devices[addr] = device.get();
+            bases[addr] = start;
+        }
+        owned.push_back(move(device));
+    }
+
+    bool is_mapped(uint16_t addr) const {
+        return addr < MEMORY_SIZE && devices[addr] != nullptr;
+    }
+
+    uint16_t read(uint16_t addr) {
+        return devices[addr]->read(addr - bases[addr]);
+    }
+
+    void write(uint16_t addr, uint16_t value) {
+        devices[addr]->write(addr - bases[addr], value);
+    }
+
+    void start() {
+        if (!is_running.exchange(true)) {
+            worker = thread([this]() { service_loop(); });
+        }
+    }
+
+    // デバイスのスレッドを止めて、残った出力と書き込みを片付ける
+    void stop() {
+        if (is_running.exchange(false)) {
+            worker.join();
+        }
+        for (auto &device: owned) {
+            device->finish();
+        }
+    }
+
+    void print_report(ostream &os) const {
+        for (auto &device: owned) {
+            device->print_report(os);
+        }
+    }
+};
+
+// 標準のデバイス (コンソール、タイマ、入力、ブロック、メモリポート) を標準のアドレスに割り当てたバスを作る
+//   block_pathが空ならブロックデバイスは割り当てない
+inline unique_ptr<DeviceBus> create_standard_devices(string input_path, string block_path, Memory *memory) {
+    unique_ptr<DeviceBus> bus(new DeviceBus());
+    bus->map_device(DEVICE_CONSOLE_ADDR, 2, unique_ptr<Device>(new ConsoleDevice()));
+    bus->map_device(DEVICE_TIMER_ADDR, 2, unique_ptr<Device>(new TimerDevice()));
+    bus->map_device(DEVICE_INPUT_ADDR, 2, unique_ptr<Device>(new InputDevice(input_path)));
+    if (!block_path.empty()) {
+        bus->map_device(DEVICE_BLOCK_ADDR, 4, unique_ptr<Device>(new BlockDevice(block_path)));
+    }
+    bus->map_device(DEVICE_MEMORY_ADDR, 3, unique_ptr<Device>(new MemoryPortDevice(memory)));
+    return bus;
+}
+
+#endif //EMULATOR_DEVICE_BUS_HPP
@@ -0,0 +1,118 @@
+#ifndef EMULATOR_ENGINE_HPP
+#define EMULATOR_ENGINE_HPP
+
+#include <cstdint>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <optional>
+
+using namespace std;
+
+// 実行を止めた理由
+enum class HaltReason {
+    HLT,  // hlt命令で停止した
+    CYCLE_LIMIT,  // クロック数の上限に達した
+    INST_LIMIT,  // 命令数の上限に達した
+    INVALID_OPCODE  // 不正な命令をデコードした (PCはその命令を指したまま止まる)
+};
+
+// 実行の上限 (0なら無制限)
+struct RunLimit {
+    uint64_t max_cycles = 0;
+    uint64_t max_instructions = 0;
+};
+
+// 実行結果の統計
+struct RunStats {
+    uint64_t cycles = 0;  // 実行したクロック数の累計
+    uint64_t instructions = 0;  // リタイアした命令数の累計
+    double wall_seconds = 0;  // runにかかった実時間
+    HaltReason halt_reason = HaltReason::HLT;
+
+    double mips() const {
+        if (wall_seconds <= 0) {
+            return 0;
+        }
+        return instructions / wall_seconds / 1000000.0;
+    }
+};
+
+inline string halt_reason_name(HaltReason reason) {
+    switch (reason) {
+        case HaltReason::HLT:
+            return "hlt";
+        case HaltReason::CYCLE_LIMIT:
+            return "cycle-limit";
+        case HaltReason::INST_LIMIT:
+            return "inst-limit";
+        case HaltReason::INVALID_OPCODE:
+            return "invalid-opcode";
+    }
+    return "unknown";
+}
+
+// 実行エンジンの種類
+enum class EngineType {
+    CLOCK,  // マイクロステップ単位のリファレンス (Cpu::clock)
+    FAST,  // 命令単位で実行する高速インタプリタ
+    THREADED,  // 翻訳済みのハンドラへ直接飛んでいくスレッデッドコード
+    JIT,  // 基本ブロックをx86-64のネイティブコードに翻訳して実行する
+    PIPELINE  // 5段パイプラインで実行した場合のクロック数を数える
+};
+
+inline string get_engine_type_name(EngineType type) {
+    switch (type) {
+        case EngineType::CLOCK:
+            return "clock";
+        case EngineType::FAST:
+            return "fast";
+        case EngineType::THREADED:
+            return "threaded";
+        case EngineType::JIT:
+            return "jit";
+        case EngineType::PIPELINE:
+            return "pipeline";
+    }
+    return "unknown";
+}
+
+inline optional<EngineType> get_engine_type_by_name(string name) {
+    if (name == "clock") {
+        return EngineType::CLOCK;
+    }
+    if (name == "fast") {
+        return EngineType::FAST;
+    }
+    if (name == "threaded") {
+        return EngineType::THREADED;
+    }
+    if (name == "jit") {
+        return EngineType::JIT;
+    }
+    if (name == "pipeline") {
+        return EngineType::PIPELINE;
+    }
+    return nullopt;
+}
+
+// 実行エンジンの共通インターフェース
+//   アーキテクチャ状態(レジスタ、メモリ、クロック数)はCpuが持ち、各エンジンはそれを進める
+class Engine {
+public:
+    virtual ~Engine() {
+
+    }
+    virtual RunStats run(RunLimit limit) = 0;
+};
+
+// 最後に1行だけ統計を出力する
+inline void print_stats(ostream &os, const RunStats &stats) {
+    os << "STATS cycles=" << dec << stats.cycles
+       << " instructions=" << stats.instructions
+       << " time=" << fixed << setprecision(6) << stats.wall_seconds << "s"
+       << " MIPS=" << setprecision(3) << stats.mips()
+       << " halt=" << halt_reason_name(stats.halt_reason) << defaultfloat << endl;
+}
+
+#endif //EMULATOR_ENGINE_HPP
@@ -0,0 +1,31 @@
+#ifndef EMULATOR_ENGINE_FACTORY_HPP
+#define EMULATOR_ENGINE_FACTORY_HPP
+
+#include <memory>
+#include "cpu.hpp"
+#include "engine.hpp"
+#include "fast_cpu.hpp"
+#include "threaded_cpu.hpp"
+#include "jit_cpu.hpp"
+#include "pipeline.hpp"
+
+using namespace std;
+
+// 起動時に選んだ種類のエンジンをCpuに対して作る
+inline shared_ptr<Engine> create_engine(EngineType engine_type, shared_ptr<Cpu> cpu) {
+    switch (engine_type) {
+        case EngineType::CLOCK:
+            return cpu;
+        case EngineType::FAST:
+            return shared_ptr<Engine>(new FastCpu(cpu));
+        case EngineType::THREADED:
+            return shared_ptr<Engine>(new ThreadedCpu(cpu));
+        case EngineType::JIT:
+            return shared_ptr<Engine>(new JitCpu(cpu));
+        case EngineType::PIPELINE:
+            return shared_ptr<Engine>(new PipelineCpu(cpu));
+    }
+    return cpu;
+}
+
+#endif //EMULATOR_ENGINE_FACTORY_HPP
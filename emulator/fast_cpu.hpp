@@ -0,0 +1,480 @@
+#ifndef EMULATOR_FAST_CPU_HPP
+#define EMULATOR_FAST_CPU_HPP
+
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "cpu.hpp"
+#include "engine.hpp"
+#include "arch.hpp"
+#include "decode.hpp"
+#include "trace.hpp"
+#include "undo_log.hpp"
+
+using namespace std;
+
+// デバイスに割り当てたアドレスへのld, st (InstructionTypeの後ろの空き)
+const uint8_t FAST_HANDLER_DEVICE = 15;
+// スーパー命令のハンドラ番号 (InstructionTypeの後ろに置く)
+//   LOAD_IMM16は同じレジスタへのldh + ldl (順番は問わない) を16bit即値のORにしたもの
+//   CMP_JEはcmp + je を比較して分岐する1命令にしたもの
+const uint8_t FAST_HANDLER_LOAD_IMM16 = 16;
+const uint8_t FAST_HANDLER_CMP_JE = 17;
+// stで書き換えられたので実行する前にデコードし直すワード
+const uint8_t FAST_HANDLER_STALE = 18;
+
+// メモリ1ワードを実行前にデコードしたもの
+//   そこから始まる2命令を融合できる場合はhandlerがスーパー命令になる
+struct FastInst {
+    uint8_t handler;  // InstructionTypeの値かFAST_HANDLER_*
+    InstructionType type;  // このワード単独の命令
+    uint8_t first_operand;
+    uint8_t second_operand;
+    uint8_t cycles;  // このワード単独のクロック数
+    uint8_t fused_cycles;  // スーパー命令として2命令分に数えるクロック数
+    uint8_t opcode;
+    bool is_valid;
+    bool needs_check;  // 不正命令かPSWを使う命令か、デコードし直すワード
+    uint16_t value;  // LOAD_IMM16なら即値、CMP_JEなら分岐先
+};
+
+// 1命令を1ディスパッチで実行する高速インタプリタ
+//   バスやALUを経由せずにCpuのレジスタとメモリを直接更新する
+//   アーキテクチャ上の結果とクロック数はCpu::clockと一致させる
+//   LAZY_FLAGSならcmpはLazyPswに結果を覚えるだけにして、r5を使う命令の直前と実行の終わりにだけN/Zを書き込む
+//   fuseなら実行前にメモリを見てldh + ldl, cmp + je の組をスーパー命令にしておき、1ディスパッチで実行する
+//   COUNTならcpu->perfに命令ごとのカウンタを数える (falseならカウンタのコードは生成されない)
+//   RECORDならtraceとundo_logに命令ごとの変更を書く (r5の値を記録するためフラグは遅延させず、スーパー命令も使わない)
+class FastCpu : public Engine {
+private:
+    vector<FastInst> code;  // メモリの大きさだけ作る (PCはメモリの大きさで折り返して引く)
+    vector<uint16_t> translated;  // codeを作ったときのメモリの内容
+    uint64_t translated_generation = 0;  // translatedを作ったときのMemory::generation
+    bool is_translated = false;
+    bool translated_fuse = false;
+    bool translated_unfused_cycles = false;
+    const DeviceBus *translated_devices = nullptr;
+
+    // addrのワードをデコードし、次のワードと融合できるか調べる
+    //   PC(r7)やPSW(r5)を使う組は1命令ずつの実行に任せる
+    void translate(int addr) {
+        if (addr < 0 || addr >= code.size()) {
+            return;
+        }
+        const Memory &memory = *cpu->memory;
+        const DecodedInst &a = cpu->decode_table->decode(memory.read(addr));
+        FastInst &t = code[addr];
+        translated[addr] = memory.read(addr);
+        t.handler = static_cast<uint8_t>(a.type);
+        t.type = a.type;
+        t.first_operand = a.first_operand;
+        t.second_operand = a.second_operand;
+        t.cycles = a.cycles;
+        t.fused_cycles = a.cycles;
+        t.opcode = a.opcode;
+        t.is_valid = a.is_valid;
+        t.needs_check = a.needs_check;
+        t.value = 0;
+
+        // ld, stのアドレスは即値なので、デバイスに渡すかどうかはデコードの時点で決まる
+        if ((a.type == InstructionType::LD || a.type == InstructionType::ST)
+            && cpu->devices && cpu->devices->is_mapped(a.second_operand)) {
+            t.handler = FAST_HANDLER_DEVICE;
+            return;
+        }
+
+        const int pc = cpu->arch->PC_REG_NUMBER;
+        if (!fuse || addr + 1 >= code.size() || a.needs_check || a.first_operand == pc) {
+            return;
+        }
+        const DecodedInst &b = cpu->decode_table->decode(memory.read(addr + 1));
+        if (b.needs_check) {
+            return;
+        }
+        if ((a.type == InstructionType::LDH && b.type == InstructionType::LDL)
+            || (a.type == InstructionType::LDL && b.type == InstructionType::LDH)) {
+            if (a.first_operand != b.first_operand) {
+                return;
+            }
+            uint16_t high = a.type == InstructionType::LDH ? a.second_operand : b.second_operand;
+            uint16_t low = a.type == InstructionType::LDL ? a.second_operand : b.second_operand;
+            t.handler = FAST_HANDLER_LOAD_IMM16;
+            t.value = (high << 8) | low;
+        } else if (a.type == InstructionType::CMP && b.type == InstructionType::JE && (a.second_operand >> 5) != pc) {
+            t.handler = FAST_HANDLER_CMP_JE;
+            t.value = b.second_operand;
+        } else {
+            return;
+        }
+        t.fused_cycles = unfused_cycles ? a.cycles + b.cycles : max(a.cycles, b.cycles);
+    }
+
+    // stで書き換えたワードと、そのワードと融合しているかもしれない1つ前のワードを、次に実行するときにデコードし直す
+    //   データへのstのたびにデコードすると遅いので、ここでは印を付けるだけにする
+    void invalidate(int addr) {
+        code[addr].handler = FAST_HANDLER_STALE;
+        code[addr].needs_check = true;
+        if (addr > 0 && code[addr - 1].handler >= FAST_HANDLER_LOAD_IMM16) {
+            code[addr - 1].handler = FAST_HANDLER_STALE;
+            code[addr - 1].needs_check = true;
+        }
+    }
+
+    // 前回の実行から書き換わったワードだけデコードし直す (設定が変わっていたら全部)
+    //   書き換わったワードの1つ前もそのワードと融合しているかもしれないのでやり直す
+    //   0ページは直接書き換えられる (バッチの上書きや巻き戻し) ので毎回比べ、
+    //   1ページ目より後ろはMemory::writeかバンクの切り替えがあったときだけ比べる
+    void update_code() {
+        const Memory &memory = *cpu->memory;
+        if (!is_translated || code.size() != memory.size || translated_fuse != fuse
+            || translated_unfused_cycles != unfused_cycles || translated_devices != cpu->devices) {
+            code.resize(memory.size);
+            translated.resize(memory.size);
+            // 1ページ目より後ろは大きいので、初めて実行するときにデコードする
+            for (int addr = 0; addr < memory.size; addr++) {
+                if (addr < MEMORY_SIZE) {
+                    translate(addr);
+                } else {
+                    code[addr].handler = FAST_HANDLER_STALE;
+                    code[addr].needs_check = true;
+                    translated[addr] = memory.read(addr);
+                }
+            }
+            is_translated = true;
+            translated_fuse = fuse;
+            translated_unfused_cycles = unfused_cycles;
+            translated_devices = cpu->devices;
+            translated_generation = memory.generation;
+            return;
+        }
+        int end = memory.generation != translated_generation ? memory.size : MEMORY_SIZE;
+        for (int addr = 0; addr < end; addr++) {
+            if (translated[addr] != memory.read(addr)) {
+                translate(addr - 1);
+                translate(addr);
+            }
+        }
+        translated_generation = memory.generation;
+    }
+
+    // デバイスがメモリに書き込むかバンクを切り替えたので、変わったワードをデコードし直す
+    void sync_memory() {
+        const Memory &memory = *cpu->memory;
+        if (memory.generation == translated_generation + 1 && memory.last_write >= 0) {
+            invalidate(memory.last_write);
+            translated_generation = memory.generation;
+        } else {
+            update_code();
+        }
+    }
+
+    // 実行し終わった1命令の変更を書く
+    //   je, jmpのPCへの書き込みは次の命令のPC (UndoEntryならpc) で分かるので書かない
+    //   トレースには値をPC、レジスタ、メモリの順に書く (TraceReaderが読む順番)
+    void record(InstructionType type, uint16_t inst_pc, uint64_t clock_counter, uint16_t first_operand,
+                uint16_t second_operand, uint16_t old_first, uint16_t old_psw, uint16_t old_memory) {
+        const uint16_t *regs = cpu->registers;
+        const uint16_t *mem = cpu->memory->memory;
+        const int psw = cpu->arch->PSW_REG_NUMBER;
+        int reg = UNDO_NO_REGISTER;
+        uint16_t old_reg = 0;
+        switch (type) {
+            case InstructionType::CMP:
+                reg = psw;
+                old_reg = old_psw;
+                break;
+            case InstructionType::JE:
+            case InstructionType::JMP:
+            case InstructionType::HLT:
+            case InstructionType::ST:
+                break;
+            default:
+                reg = first_operand;
+                old_reg = old_first;
+                break;
+        }
+        bool is_store = type == InstructionType::ST;
+        if (trace) {
+            trace->begin_record(inst_pc);
+            if (reg != UNDO_NO_REGISTER) {
+                trace->add_register_write(reg, old_reg, regs[reg]);
+            }
+            if (type == InstructionType::LD) {
+                trace->add_memory_read(second_operand);
+            }
+            if (is_store) {
+                trace->add_memory_write(second_operand, old_memory, mem[second_operand]);
+            }
+        }
+        if (undo_log) {
+            undo_log->push({clock_counter, inst_pc, old_reg, second_operand, old_memory,
+                            static_cast<uint8_t>(reg), is_store});
+        }
+    }
+
+    template <bool LAZY_FLAGS, bool COUNT, bool RECORD>
+    RunStats run_with(RunLimit limit) {
+        RunStats stats;
+        auto start = chrono::steady_clock::now();
+
+        // マイクロステップの途中から呼ばれた場合は命令の境界までリファレンスで進める
+        bool is_hlt = cpu->finish_instruction();
+        update_code();
+
+        uint16_t *regs = cpu->registers;
+        uint16_t *mem = cpu->memory->memory;
+        const uint16_t code_mask = code.size() - 1;
+        const int pc = cpu->arch->PC_REG_NUMBER;
+        const int psw = cpu->arch->PSW_REG_NUMBER;
+        uint64_t clock_counter = cpu->clock_counter;
+        uint64_t instruction_counter = cpu->instruction_counter;
+        uint64_t dispatches = 0;
+        uint64_t fused_pairs = 0;
+        LazyPsw lazy_psw;
+        PerfCounters *perf = cpu->perf;
+        uint64_t retired_before[INSTRUCTION_TYPE_COUNT];
+        if (COUNT) {
+            memcpy(retired_before, perf->retired, sizeof(retired_before));
+        }
+        if (RECORD && trace && !trace->is_started) {
+            trace->begin(regs, mem, clock_counter, instruction_counter, pc);
+        }
+
+        // 上限の判定は命令の境界で行う (0なら無制限)
+        //   クロック数の上限は命令の途中で止まらないので最大で1命令分超えることがある
+        //   スーパー命令は2命令目の前で上限に達する場合は1命令目だけを実行する
+        const uint64_t cycle_end = limit.max_cycles > 0 ? limit.max_cycles + 1 : numeric_limits<uint64_t>::max();
+        const uint64_t inst_end = limit.max_instructions > 0 ? limit.max_instructions : numeric_limits<uint64_t>::max();
+        while (!is_hlt) {
+            if (clock_counter >= cycle_end) {
+                stats.halt_reason = HaltReason::CYCLE_LIMIT;
+                break;
+            }
+            if (instruction_counter >= inst_end) {
+                stats.halt_reason = HaltReason::INST_LIMIT;
+                break;
+            }
+
+            const FastInst &inst = code[regs[pc] & code_mask];
+            // 不正命令とr5を使う命令とデコードし直すワードは1回の分岐でまとめて拾う
+            if (inst.needs_check) {
+                if (inst.handler == FAST_HANDLER_STALE) {
+                    translate(regs[pc] & code_mask);
+                    continue;
+                }
+                if (!inst.is_valid) {
+                    cerr << "invalid opcode " << static_cast<int>(inst.opcode) << endl;
+                    stats.halt_reason = HaltReason::INVALID_OPCODE;
+                    break;
+                }
+                if (LAZY_FLAGS) {
+                    lazy_psw.materialize(regs[psw]);
+                }
+            }
+            uint8_t handler = inst.handler;
+            if (handler >= FAST_HANDLER_LOAD_IMM16) {
+                if (RECORD || instruction_counter + 1 >= inst_end || clock_counter + inst.cycles >= cycle_end) {
+                    handler = static_cast<uint8_t>(inst.type);
+                } else {
+                    // 2命令目の分を先に足しておく
+                    clock_counter += inst.fused_cycles - inst.cycles;
+                    instruction_counter++;
+                    fused_pairs++;
+                }
+            }
+            // stが自分自身を書き換えるとinstも変わるので、使う値は先に取り出しておく
+            uint16_t first_operand = inst.first_operand;
+            uint16_t second_operand = inst.second_operand;
+            uint8_t cycles = inst.cycles;
+            uint8_t fused_cycles = inst.fused_cycles;
+            InstructionType type = inst.type;
+            uint16_t inst_pc = regs[pc];
+            regs[pc]++;
+            // 書き込む前の値 (トレースとUndoEntryのため、PCは進めた後の値にする)
+            uint16_t old_first = 0;
+            uint16_t old_psw = 0;
+            uint16_t old_memory = 0;
+            if (RECORD) {
+                old_first = regs[first_operand];
+                old_psw = regs[psw];
+                old_memory = mem[second_operand];
+            }
+            dispatches++;
+
+            switch (handler) {
+                case static_cast<uint8_t>(InstructionType::MOV):
+                    regs[first_operand] = regs[second_operand >> 5];
+                    break;
+                case static_cast<uint8_t>(InstructionType::ADD):
+                    regs[first_operand] = regs[first_operand] + regs[second_operand >> 5];
+                    break;
+                case static_cast<uint8_t>(InstructionType::SUB):
+                    regs[first_operand] = regs[first_operand] - regs[second_operand >> 5];
+                    break;
+                case static_cast<uint8_t>(InstructionType::AND):
+                    regs[first_operand] = regs[first_operand] & regs[second_operand >> 5];
+                    break;
+                case static_cast<uint8_t>(InstructionType::OR):
+                    regs[first_operand] = regs[first_operand] | regs[second_operand >> 5];
+                    break;
+                case static_cast<uint8_t>(InstructionType::SL):
+                    regs[first_operand] = regs[first_operand] << 1;
+                    break;
+                case static_cast<uint8_t>(InstructionType::SR):
+                    regs[first_operand] = regs[first_operand] >> 1;
+                    break;
+                case static_cast<uint8_t>(InstructionType::LDL):
+                    regs[first_operand] |= second_operand;
+                    break;
+                case static_cast<uint8_t>(InstructionType::LDH):
+                    regs[first_operand] |= second_operand << 8;
+                    break;
+                case static_cast<uint8_t>(InstructionType::CMP): {
+                    uint16_t result = regs[first_operand] - regs[second_operand >> 5];
+                    if (LAZY_FLAGS) {
+                        lazy_psw.record_cmp(result);
+                        break;
+                    }
+                    // Alu::calcのCMPと同じくNは0になる方向にだけ更新する
+                    if (result == 0) {
+                        regs[psw] |= 0b0100000000000000;
+                    } else {
+                        regs[psw] &= 0b0011111111111111;
+                    }
+                    break;
+                }
+                case static_cast<uint8_t>(InstructionType::JE): {
+                    bool is_taken = LAZY_FLAGS ? lazy_psw.get_zero_flag(regs[psw]) : (regs[psw] >> 14) & 0x1;
+                    if (is_taken) {
+                        regs[pc] = second_operand;
+                    }
+                    if (COUNT) {
+                        (is_taken ? perf->je_taken : perf->je_not_taken)++;
+                    }
+                    break;
+                }
+                case static_cast<uint8_t>(InstructionType::JMP):
+                    regs[pc] = second_operand;
+                    break;
+                case static_cast<uint8_t>(InstructionType::LD):
+                    regs[first_operand] = mem[second_operand];
+                    break;
+                case static_cast<uint8_t>(InstructionType::ST):
+                    mem[second_operand] = regs[first_operand];
+                    // 書き換えたワードが命令として実行されるかもしれないのでデコードし直す
+                    invalidate(second_operand);
+                    break;
+                case static_cast<uint8_t>(InstructionType::HLT):
+                    is_hlt = true;
+                    break;
+                case FAST_HANDLER_DEVICE:
+                    if (type == InstructionType::LD) {
+                        regs[first_operand] = cpu->devices->read(second_operand);
+                    } else {
+                        cpu->devices->write(second_operand, regs[first_operand]);
+                        if (cpu->memory->generation != translated_generation) {
+                            sync_memory();
+                        }
+                    }
+                    break;
+                case FAST_HANDLER_LOAD_IMM16:
+                    regs[first_operand] |= inst.value;
+                    regs[pc]++;
+                    break;
+                case FAST_HANDLER_CMP_JE: {
+                    uint16_t result = regs[first_operand] - regs[second_operand >> 5];
+                    if (LAZY_FLAGS) {
+                        lazy_psw.record_cmp(result);
+                    } else if (result == 0) {
+                        regs[psw] |= 0b0100000000000000;
+                    } else {
+                        regs[psw] &= 0b0011111111111111;
+                    }
+                    regs[pc] = result == 0 ? inst.value : regs[pc] + 1;
+                    if (COUNT) {
+                        (result == 0 ? perf->je_taken : perf->je_not_taken)++;
+                    }
+                    break;
+                }
+            }
+            if (RECORD) {
+                record(type, inst_pc, clock_counter, first_operand, second_operand, old_first, old_psw, old_memory);
+            }
+            if (COUNT) {
+                perf->pc_histogram[inst_pc]++;
+                perf->pc_cycles[inst_pc] += cycles;
+                perf->retired[static_cast<int>(type)]++;
+                if (handler >= FAST_HANDLER_LOAD_IMM16) {
+                    // スーパー命令の2命令目には先に足しておいた分のクロック数を数える
+                    InstructionType second = InstructionType::JE;
+                    if (handler == FAST_HANDLER_LOAD_IMM16) {
+                        second = type == InstructionType::LDH ? InstructionType::LDL : InstructionType::LDH;
+                    }
+                    perf->pc_histogram[inst_pc + 1]++;
+                    perf->pc_cycles[inst_pc + 1] += fused_cycles - cycles;
+                    perf->retired[static_cast<int>(second)]++;
+                }
+            }
+            clock_counter += cycles;
+            instruction_counter++;
+        }
+        lazy_psw.materialize(regs[psw]);
+        if (COUNT) {
+            // FastCpuにはステータスがないので、この実行でリタイアした命令からCpu::clockと同じ内訳を求める
+            for (int i = 0; i < INSTRUCTION_TYPE_COUNT; i++) {
+                perf->add_phases_of(static_cast<InstructionType>(i), perf->retired[i] - retired_before[i]);
+            }
+        }
+
+        cpu->clock_counter = clock_counter;
+        cpu->instruction_counter = instruction_counter;
+        dispatch_count += dispatches;
+        fused_count += fused_pairs;
+        // hltで止まった場合はCpu::clockと同じくWRITE_BACKで止まった状態にしておく
+        cpu->current_status = is_hlt ? CpuStatus::WRITE_BACK : CpuStatus::FETCH_INST_0;
+
+        auto end = chrono::steady_clock::now();
+        stats.cycles = clock_counter - 1;
+        stats.instructions = instruction_counter;
+        stats.wall_seconds = chrono::duration<double>(end - start).count();
+        return stats;
+    }
+
+public:
+    shared_ptr<Cpu> cpu;
+    bool lazy_flags = false;  // trueならcmpの結果をLazyPswに覚えておく (比較用、--benchでは速くならない)
+    bool fuse = true;  // falseならスーパー命令を使わない
+    bool unfused_cycles = true;  // falseならスーパー命令を1命令分のクロックで数える (リファレンスとはクロック数が合わなくなる)
+    uint64_t dispatch_count = 0;  // 実行したディスパッチの数 (スーパー命令は1回)
+    uint64_t fused_count = 0;  // スーパー命令として実行した組の数
+    TraceWriter *trace = nullptr;  // nullptrでなければ実行した命令をトレースに書く
+    UndoLog *undo_log = nullptr;  // nullptrでなければ実行した命令を取り消すための値を書く
+
+    FastCpu() {
+
+    }
+    FastCpu(shared_ptr<Cpu> cpu) {
+        this->cpu = cpu;
+        // 実行中に確保しないように表は先に作っておく
+        this->code.resize(cpu->memory->size);
+        this->translated.resize(cpu->memory->size);
+    }
+
+    RunStats run(RunLimit limit) override {
+        bool count = PERF_COUNTERS_AVAILABLE && cpu->perf;
+        if (trace || undo_log) {
+            return count ? run_with<false, PERF_COUNTERS_AVAILABLE, true>(limit) : run_with<false, false, true>(limit);
+        }
+        if (count) {
+            return lazy_flags ? run_with<true, PERF_COUNTERS_AVAILABLE, false>(limit)
+                              : run_with<false, PERF_COUNTERS_AVAILABLE, false>(limit);
+        }
+        return lazy_flags ? run_with<true, false, false>(limit) : run_with<false, false, false>(limit);
+    }
+};
+
+#endif //EMULATOR_FAST_CPU_HPP
@@ -0,0 +1,748 @@
+#ifndef EMULATOR_JIT_CPU_HPP
+#define EMULATOR_JIT_CPU_HPP
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include "cpu.hpp"
+#include "fast_cpu.hpp"
+#include "engine.hpp"
+#include "decode.hpp"
+#include "memory.hpp"
+#include "arch.hpp"
+
+// x86-64のSystem V ABIでのみネイティブコードを生成する
+//   それ以外の環境ではFastCpuでそのまま解釈実行する
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_ENABLED 1
+#include <sys/mman.h>
+#else
+#define JIT_ENABLED 0
+#endif
+
+using namespace std;
+
+// 生成したコードから参照する実行状態
+//   オフセットを生成コードに埋め込むのでstandard layoutにしておく
+struct JitContext {
+    uint16_t *memory;
+    uint16_t registers[CpuArch::REGISTER_COUNT];
+    uint64_t instruction_counter;
+    uint64_t clock_counter;
+    uint64_t inst_end;  // instruction_counter + ブロックの命令数 がこれを超えるなら実行しない
+    uint64_t cycle_end;  // ブロック最後の命令の開始時のclock_counterがこれ以上なら実行しない
+    uint8_t code_map[ADDRESS_SPACE_SIZE];  // 翻訳済みのブロックに含まれるワードなら1
+    const void *blocks[ADDRESS_SPACE_SIZE];  // ゲストのPCをキーにした翻訳キャッシュ (メモリの大きさより後ろは使わない)
+};
+
+// 生成コードから戻ってきた理由
+enum class JitExit : uint32_t {
+    MISS,  // 次のPCのブロックがまだ翻訳されていない
+    INTERPRET,  // 上限に近いので1命令ずつインタプリタで実行する
+    CODE_WRITE  // stで翻訳済みのコードを書き換えた
+};
+
+// x86-64の機械語を書き込む最小限のアセンブラ
+class X64Emitter {
+public:
+    static const int RAX = 0;
+    static const int RBX = 3;
+    static const int RBP = 5;
+    static const int RSI = 6;
+    static const int RDI = 7;
+    static const int R12 = 12;
+    static const int R13 = 13;
+    static const int R14 = 14;
+    static const int R15 = 15;
+
+    static const uint8_t CC_AE = 0x3;
+    static const uint8_t CC_Z = 0x4;
+    static const uint8_t CC_NZ = 0x5;
+    static const uint8_t CC_A = 0x7;
+
+    uint8_t *buffer = nullptr;
+    size_t capacity = 0;
+    size_t pos = 0;
+
+    bool has_room(size_t bytes) {
+        return pos + bytes <= capacity;
+    }
+
+    void byte(uint8_t b) {
+        buffer[pos++] = b;
+    }
+
+    void imm16(uint16_t v) {
+        memcpy(buffer + pos, &v, sizeof(v));
+        pos += sizeof(v);
+    }
+
+    void imm32(uint32_t v) {
+        memcpy(buffer + pos, &v, sizeof(v));
+        pos += sizeof(v);
+    }
+
+    void rex(bool w, int reg, int rm) {
+        uint8_t r = 0x40 | (w ? 0x8 : 0) | (((reg >> 3) & 1) << 2) | ((rm >> 3) & 1);
+        if (r != 0x40) {
+            byte(r);
+        }
+    }
+
+    void modrm(int mod, int reg, int rm) {
+        byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // 16bitのレジスタ間演算 (opcodeは r/m16, r16 の形式)
+    void op16_rr(uint8_t opcode, int dst, int src) {
+        byte(0x66);
+        rex(false, src, dst);
+        byte(opcode);
+        modrm(3, src, dst);
+    }
+
+    // 16bitの即値演算 (extは81 /extのサブ命令)
+    void op16_ri(int ext, int dst, uint16_t imm) {
+        byte(0x66);
+        rex(false, 0, dst);
+        byte(0x81);
+        modrm(3, ext, dst);
+        imm16(imm);
+    }
+
+    void mov16_ri(int dst, uint16_t imm) {
+        byte(0x66);
+        rex(false, 0, dst);
+        byte(0xb8 + (dst & 7));
+        imm16(imm);
+    }
+
+    // 1bitシフト (ext 4:shl, 5:shr)
+    void shift16(int ext, int dst) {
+        byte(0x66);
+        rex(false, 0, dst);
+        byte(0xd1);
+        modrm(3, ext, dst);
+    }
+
+    void test16_ri(int dst, uint16_t imm) {
+        byte(0x66);
+        rex(false, 0, dst);
+        byte(0xf7);
+        modrm(3, 0, dst);
+        imm16(imm);
+    }
+
+    void mov16_load(int dst, int base, int32_t disp) {
+        byte(0x66);
+        rex(false, dst, base);
+        byte(0x8b);
+        modrm(2, dst, base);
+        imm32(disp);
+    }
+
+    void mov16_store(int base, int32_t disp, int src) {
+        byte(0x66);
+        rex(false, src, base);
+        byte(0x89);
+        modrm(2, src, base);
+        imm32(disp);
+    }
+
+    void cmp8_mi(int base, int32_t disp, uint8_t imm) {
+        rex(false, 0, base);
+        byte(0x80);
+        modrm(2, 7, base);
+        imm32(disp);
+        byte(imm);
+    }
+
+    void lea64(int dst, int base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8d);
+        modrm(2, dst, base);
+        imm32(disp);
+    }
+
+    void cmp64_rm(int reg, int base, int32_t disp) {
+        rex(true, reg, base);
+        byte(0x3b);
+        modrm(2, reg, base);
+        imm32(disp);
+    }
+
+    // 64bitの即値演算 (ext 0:add, 5:sub)
+    void op64_ri(int ext, int dst, uint32_t imm) {
+        rex(true, 0, dst);
+        byte(0x81);
+        modrm(3, ext, dst);
+        imm32(imm);
+    }
+
+    void mov64_load(int dst, int base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8b);
+        modrm(2, dst, base);
+        imm32(disp);
+    }
+
+    void mov64_store(int base, int32_t disp, int src) {
+        rex(true, src, base);
+        byte(0x89);
+        modrm(2, src, base);
+        imm32(disp);
+    }
+
+    void mov64_rr(int dst, int src) {
+        rex(true, src, dst);
+        byte(0x89);
+        modrm(3, src, dst);
+    }
+
+    void test64_rr(int a, int b) {
+        rex(true, b, a);
+        byte(0x85);
+        modrm(3, b, a);
+    }
+
+    void mov32_ri(int dst, uint32_t imm) {
+        rex(false, 0, dst);
+        byte(0xb8 + (dst & 7));
+        imm32(imm);
+    }
+
+    void jmp_r(int reg) {
+        rex(false, 0, reg);
+        byte(0xff);
+        modrm(3, 4, reg);
+    }
+
+    void push(int reg) {
+        rex(false, 0, reg);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(int reg) {
+        rex(false, 0, reg);
+        byte(0x58 + (reg & 7));
+    }
+
+    void ret() {
+        byte(0xc3);
+    }
+
+    // 飛び先は後からpatchで埋める
+    size_t jcc32(uint8_t cc) {
+        byte(0x0f);
+        byte(0x80 + cc);
+        imm32(0);
+        return pos - 4;
+    }
+
+    size_t jmp32() {
+        byte(0xe9);
+        imm32(0);
+        return pos - 4;
+    }
+
+    void patch(size_t at, size_t target) {
+        int32_t rel = static_cast<int32_t>(target - (at + 4));
+        memcpy(buffer + at, &rel, sizeof(rel));
+    }
+};
+
+// 基本ブロック単位でx86-64のネイティブコードに翻訳して実行するエンジン
+//   ブロックはje, jmp, hltの手前、PCへの書き込み、翻訳済みコードへのstで区切る
+//   ゲストのr0-r7はブロック内ではホストのr8-r15に置き、ブロック間はキャッシュを引いて直接飛ぶ
+//   hltと不正命令、デバイスへのld, st、上限付近の実行、メモリの大きさより後ろ (鏡像) のPCはFastCpuにフォールバックする
+class JitCpu : public Engine {
+private:
+    static const size_t CODE_BUFFER_SIZE = 1 << 20;
+    static const int MAX_BLOCK_INSTS = 64;
+
+    uint32_t translated_end = 0;  // 翻訳したワードの最後の次 (flushはここまで消す)
+    uint64_t translated_generation = 0;  // 翻訳したときのMemory::generation
+
+#if JIT_ENABLED
+    typedef uint32_t (*EnterFunc)(JitContext *, const void *);
+
+    X64Emitter emitter;
+    EnterFunc enter = nullptr;
+    size_t common_exit = 0;
+    size_t blocks_begin = 0;  // これより後ろがブロックの領域
+
+    // stで翻訳済みコードを書き換えたときの出口 (stの位置と残りの命令数、クロック数)
+    struct CodeWriteExit {
+        size_t at;
+        uint16_t next_pc;
+        uint64_t remaining_insts;
+        uint64_t remaining_cycles;
+    };
+
+    // translateの作業領域 (実行中にヒープを確保しないように最大サイズで確保しておく)
+    vector<DecodedInst> insts;
+    vector<size_t> budget_exits;
+    vector<CodeWriteExit> code_write_exits;
+
+    static int host_reg(int guest_reg) {
+        return 8 + guest_reg;
+    }
+
+    // 入口と共通の出口を生成する
+    //   入口: ゲストのレジスタとカウンタをホストのレジスタに載せてブロックへ飛ぶ
+    //   出口: eaxに理由を入れて飛んでくると、ホストのレジスタをJitContextに書き戻して戻る
+    void emit_trampoline() {
+        X64Emitter &e = emitter;
+        int saved[] = {X64Emitter::RBX, X64Emitter::RBP, X64Emitter::R12, X64Emitter::R13, X64Emitter::R14, X64Emitter::R15};
+        enter = reinterpret_cast<EnterFunc>(e.buffer + e.pos);
+        for (int reg: saved) {
+            e.push(reg);
+        }
+        // rdi = JitContext, rsi = ブロックの入口
+        e.mov64_rr(X64Emitter::RAX, X64Emitter::RSI);
+        e.mov64_load(X64Emitter::RSI, X64Emitter::RDI, offsetof(JitContext, memory));
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            e.mov16_load(host_reg(i), X64Emitter::RDI, offsetof(JitContext, registers) + i * 2);
+        }
+        e.mov64_load(X64Emitter::RBX, X64Emitter::RDI, offsetof(JitContext, instruction_counter));
+        e.mov64_load(X64Emitter::RBP, X64Emitter::RDI, offsetof(JitContext, clock_counter));
+        e.jmp_r(X64Emitter::RAX);
+
+        common_exit = e.pos;
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            e.mov16_store(X64Emitter::RDI, offsetof(JitContext, registers) + i * 2, host_reg(i));
+        }
+        e.mov64_store(X64Emitter::RDI, offsetof(JitContext, instruction_counter), X64Emitter::RBX);
+        e.mov64_store(X64Emitter::RDI, offsetof(JitContext, clock_counter), X64Emitter::RBP);
+        for (int i = 5; i >= 0; i--) {
+            e.pop(saved[i]);
+        }
+        e.ret();
+        blocks_begin = e.pos;
+    }
+
+    void emit_exit(JitExit reason) {
+        emitter.mov32_ri(X64Emitter::RAX, static_cast<uint32_t>(reason));
+        size_t at = emitter.jmp32();
+        emitter.patch(at, common_exit);
+    }
+
+    // PCをtargetにして、翻訳済みならそのブロックへ直接飛ぶ
+    void emit_chain(uint16_t target) {
+        X64Emitter &e = emitter;
+        e.mov16_ri(host_reg(cpu->arch->PC_REG_NUMBER), target);
+        if (target >= cpu->memory->size) {
+            emit_exit(JitExit::MISS);
+            return;
+        }
+        e.mov64_load(X64Emitter::RAX, X64Emitter::RDI, offsetof(JitContext, blocks) + target * sizeof(void *));
+        e.test64_rr(X64Emitter::RAX, X64Emitter::RAX);
+        size_t miss = e.jcc32(X64Emitter::CC_Z);
+        e.jmp_r(X64Emitter::RAX);
+        e.patch(miss, e.pos);
+        emit_exit(JitExit::MISS);
+    }
+
+    // 命令がレジスタを読むか (PCを読むなら事前にPCを確定させる)
+    static bool reads_register(const DecodedInst &inst, int reg) {
+        int source = inst.second_operand >> 5;
+        switch (inst.type) {
+            case InstructionType::MOV:
+                return source == reg;
+            case InstructionType::ADD:
+            case InstructionType::SUB:
+            case InstructionType::AND:
+            case InstructionType::OR:
+            case InstructionType::CMP:
+                return source == reg || inst.first_operand == reg;
+            case InstructionType::SL:
+            case InstructionType::SR:
+            case InstructionType::LDL:
+            case InstructionType::LDH:
+            case InstructionType::ST:
+                return inst.first_operand == reg;
+            default:
+                return false;
+        }
+    }
+
+    // 命令がレジスタに書き込むか (PCに書き込むならブロックを終える)
+    static bool writes_register(const DecodedInst &inst, int reg) {
+        switch (inst.type) {
+            case InstructionType::MOV:
+            case InstructionType::ADD:
+            case InstructionType::SUB:
+            case InstructionType::AND:
+            case InstructionType::OR:
+            case InstructionType::SL:
+            case InstructionType::SR:
+            case InstructionType::LDL:
+            case InstructionType::LDH:
+            case InstructionType::LD:
+                return inst.first_operand == reg;
+            default:
+                return false;
+        }
+    }
+
+    // startから始まる基本ブロックを翻訳する
+    //   先頭の命令が翻訳できない(hlt, 不正命令)ならnullptrを返す
+    const void *translate(uint16_t start) {
+        const Memory &memory = *cpu->memory;
+        const DecodedInst *decode_table = cpu->decode_table->entries;
+        const int pc = cpu->arch->PC_REG_NUMBER;
+        const int psw = cpu->arch->PSW_REG_NUMBER;
+
+        // ブロックの範囲を決める
+        insts.clear();
+        bool has_terminator = false;
+        for (uint32_t addr = start; addr < memory.size && insts.size() < MAX_BLOCK_INSTS; addr++) {
+            const DecodedInst &inst = decode_table[memory.read(addr)];
+            if (!inst.is_valid || inst.type == InstructionType::HLT) {
+                break;
+            }
+            // デバイスへのld, stはインタプリタに任せる
+            if ((inst.type == InstructionType::LD || inst.type == InstructionType::ST)
+                && cpu->devices && cpu->devices->is_mapped(inst.second_operand)) {
+                break;
+            }
+            insts.push_back(inst);
+            if (inst.type == InstructionType::JE || inst.type == InstructionType::JMP || writes_register(inst, pc)) {
+                has_terminator = true;
+                break;
+            }
+            // 翻訳済みのコードへのstは実行時に無効化されるのでその後ろは翻訳しない
+            if (inst.type == InstructionType::ST
+                && (ctx.code_map[inst.second_operand]
+                    || (inst.second_operand >= start && inst.second_operand <= addr))) {
+                break;
+            }
+        }
+        if (insts.empty()) {
+            return nullptr;
+        }
+
+        // 1ブロックの最大サイズに余裕を持たせて、足りなければ全て捨てて作り直す
+        if (!emitter.has_room(insts.size() * 64 + 256)) {
+            flush();
+        }
+
+        X64Emitter &e = emitter;
+        size_t entry = e.pos;
+        uint64_t total_cycles = 0;
+        uint64_t cycles_before_last = 0;
+        for (int i = 0; i < insts.size(); i++) {
+            if (i == insts.size() - 1) {
+                cycles_before_last = total_cycles;
+            }
+            total_cycles += insts[i].cycles;
+        }
+
+        // 上限を超えそうならこのブロックは実行せずにインタプリタに任せる
+        budget_exits.clear();
+        e.lea64(X64Emitter::RAX, X64Emitter::RBX, static_cast<int32_t>(insts.size()));
+        e.cmp64_rm(X64Emitter::RAX, X64Emitter::RDI, offsetof(JitContext, inst_end));
+        budget_exits.push_back(e.jcc32(X64Emitter::CC_A));
+        e.lea64(X64Emitter::RAX, X64Emitter::RBP, static_cast<int32_t>(cycles_before_last));
+        e.cmp64_rm(X64Emitter::RAX, X64Emitter::RDI, offsetof(JitContext, cycle_end));
+        budget_exits.push_back(e.jcc32(X64Emitter::CC_AE));
+        e.op64_ri(0, X64Emitter::RBX, static_cast<uint32_t>(insts.size()));
+        e.op64_ri(0, X64Emitter::RBP, static_cast<uint32_t>(total_cycles));
+
+        code_write_exits.clear();
+
+        uint64_t executed_cycles = 0;
+        int pc_host = host_reg(pc);
+        for (int i = 0; i < insts.size(); i++) {
+            const DecodedInst &inst = insts[i];
+            uint16_t addr = start + i;
+            int first = host_reg(inst.first_operand);
+            int source = host_reg((inst.second_operand >> 5) & 0x7);
+            executed_cycles += inst.cycles;
+
+            // Cpu::clockと同じく実行中のPCは次の命令を指している
+            if (reads_register(inst, pc)) {
+                e.mov16_ri(pc_host, addr + 1);
+            }
+
+            switch (inst.type) {
+                case InstructionType::MOV:
+                    e.op16_rr(0x89, first, source);
+                    break;
+                case InstructionType::ADD:
+                    e.op16_rr(0x01, first, source);
+                    break;
+                case InstructionType::SUB:
+                    e.op16_rr(0x29, first, source);
+                    break;
+                case InstructionType::AND:
+                    e.op16_rr(0x21, first, source);
+                    break;
+                case InstructionType::OR:
+                    e.op16_rr(0x09, first, source);
+                    break;
+                case InstructionType::SL:
+                    e.shift16(4, first);
+                    break;
+                case InstructionType::SR:
+                    e.shift16(5, first);
+                    break;
+                case InstructionType::LDL:
+                    e.op16_ri(1, first, inst.second_operand);
+                    break;
+                case InstructionType::LDH:
+                    e.op16_ri(1, first, inst.second_operand << 8);
+                    break;
+                case InstructionType::CMP: {
+                    // ホストのZFからPSWのZを作る (Nは0になる方向にだけ更新する)
+                    e.op16_rr(0x39, first, source);
+                    size_t not_zero = e.jcc32(X64Emitter::CC_NZ);
+                    e.op16_ri(1, host_reg(psw), 0b0100000000000000);
+                    size_t done = e.jmp32();
+                    e.patch(not_zero, e.pos);
+                    e.op16_ri(4, host_reg(psw), 0b0011111111111111);
+                    e.patch(done, e.pos);
+                    break;
+                }
+                case InstructionType::JE: {
+                    e.test16_ri(host_reg(psw), 0b0100000000000000);
+                    size_t not_taken = e.jcc32(X64Emitter::CC_Z);
+                    emit_chain(inst.second_operand);
+                    e.patch(not_taken, e.pos);
+                    emit_chain(addr + 1);
+                    break;
+                }
+                case InstructionType::JMP:
+                    emit_chain(inst.second_operand);
+                    break;
+                case InstructionType::LD:
+                    e.mov16_load(first, X64Emitter::RSI, inst.second_operand * 2);
+                    break;
+                case InstructionType::ST: {
+                    e.mov16_store(X64Emitter::RSI, inst.second_operand * 2, first);
+                    e.cmp8_mi(X64Emitter::RDI, offsetof(JitContext, code_map) + inst.second_operand, 0);
+                    CodeWriteExit exit;
+                    exit.at = e.jcc32(X64Emitter::CC_NZ);
+                    exit.next_pc = addr + 1;
+                    exit.remaining_insts = insts.size() - (i + 1);
+                    exit.remaining_cycles = total_cycles - executed_cycles;
+                    code_write_exits.push_back(exit);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        // 分岐で終わらなかったブロックの終わり
+        if (!has_terminator) {
+            emit_chain(start + insts.size());
+        } else if (writes_register(insts.back(), pc)) {
+            // PCへの書き込みは飛び先が実行時にしか分からない
+            emit_exit(JitExit::MISS);
+        }
+
+        for (size_t at: budget_exits) {
+            e.patch(at, e.pos);
+        }
+        e.mov16_ri(pc_host, start);
+        emit_exit(JitExit::INTERPRET);
+
+        for (auto &exit: code_write_exits) {
+            e.patch(exit.at, e.pos);
+            e.mov16_ri(pc_host, exit.next_pc);
+            if (exit.remaining_insts > 0) {
+                e.op64_ri(5, X64Emitter::RBX, static_cast<uint32_t>(exit.remaining_insts));
+                e.op64_ri(5, X64Emitter::RBP, static_cast<uint32_t>(exit.remaining_cycles));
+            }
+            emit_exit(JitExit::CODE_WRITE);
+        }
+
+        for (int i = 0; i < insts.size(); i++) {
+            ctx.code_map[start + i] = 1;
+        }
+        translated_end = max<uint32_t>(translated_end, start + insts.size());
+        const void *block = e.buffer + entry;
+        ctx.blocks[start] = block;
+        translated_blocks++;
+        return block;
+    }
+#endif
+
+    // 翻訳キャッシュを全て捨てる
+    void flush() {
+        for (int i = 0; i < translated_end; i++) {
+            ctx.blocks[i] = nullptr;
+            ctx.code_map[i] = 0;
+        }
+        translated_end = 0;
+#if JIT_ENABLED
+        emitter.pos = blocks_begin;
+#endif
+        flush_count++;
+    }
+
+    void store_context() {
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            cpu->registers[i] = ctx.registers[i];
+        }
+        cpu->clock_counter = ctx.clock_counter;
+        cpu->instruction_counter = ctx.instruction_counter;
+    }
+
+    void load_context() {
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            ctx.registers[i] = cpu->registers[i];
+        }
+        ctx.clock_counter = cpu->clock_counter;
+        ctx.instruction_counter = cpu->instruction_counter;
+    }
+
+public:
+    shared_ptr<Cpu> cpu;
+    shared_ptr<FastCpu> interpreter;
+    JitContext ctx;
+
+    uint64_t translated_blocks = 0;
+    uint64_t flush_count = 0;
+
+    JitCpu(shared_ptr<Cpu> cpu) {
+        this->cpu = cpu;
+        this->interpreter = shared_ptr<FastCpu>(new FastCpu(cpu));
+        memset(&ctx, 0, sizeof(ctx));
+#if JIT_ENABLED
+        void *buffer = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            cerr << "failed to allocate jit code buffer" << endl;
+            exit(1);
+        }
+        emitter.buffer = static_cast<uint8_t *>(buffer);
+        emitter.capacity = CODE_BUFFER_SIZE;
+        emit_trampoline();
+        insts.reserve(MAX_BLOCK_INSTS);
+        budget_exits.reserve(2);
+        code_write_exits.reserve(MAX_BLOCK_INSTS);
+#endif
+    }
+
+    ~JitCpu() {
+#if JIT_ENABLED
+        munmap(emitter.buffer, emitter.capacity);
+#endif
+    }
+
+    RunStats run(RunLimit limit) override {
+        RunStats stats;
+        auto start = chrono::steady_clock::now();
+
+        bool is_hlt = cpu->finish_instruction();
+        const int pc = cpu->arch->PC_REG_NUMBER;
+        const Memory &memory = *cpu->memory;
+        const DecodedInst *decode_table = cpu->decode_table->entries;
+
+        // 前回の実行の後にMemory::writeかバンクの切り替えで書き換わっていたら翻訳をやり直す
+        if (memory.generation != translated_generation) {
+            flush();
+            translated_generation = memory.generation;
+        }
+        ctx.memory = cpu->memory->memory;
+        ctx.inst_end = limit.max_instructions > 0 ? limit.max_instructions : numeric_limits<uint64_t>::max();
+        ctx.cycle_end = limit.max_cycles > 0 ? limit.max_cycles + 1 : numeric_limits<uint64_t>::max();
+        load_context();
+
+        bool interpret_next = false;
+        while (!is_hlt) {
+            if (limit.max_cycles > 0 && ctx.clock_counter - 1 >= limit.max_cycles) {
+                stats.halt_reason = HaltReason::CYCLE_LIMIT;
+                break;
+            }
+            if (limit.max_instructions > 0 && ctx.instruction_counter >= limit.max_instructions) {
+                stats.halt_reason = HaltReason::INST_LIMIT;
+                break;
+            }
+
+            uint16_t current_pc = ctx.registers[pc];
+#if JIT_ENABLED
+            if (!interpret_next && current_pc < memory.size) {
+                const void *block = ctx.blocks[current_pc];
+                if (block == nullptr) {
+                    block = translate(current_pc);
+                }
+                if (block != nullptr) {
+                    JitExit reason = static_cast<JitExit>(enter(&ctx, block));
+                    if (reason == JitExit::CODE_WRITE) {
+                        flush();
+                    } else if (reason == JitExit::INTERPRET) {
+                        // 上限をもう一度判定してから1命令だけインタプリタで実行する
+                        interpret_next = true;
+                    }
+                    continue;
+                }
+            }
+#endif
+            interpret_next = false;
+
+            // 翻訳できない命令と上限付近の命令はインタプリタで1命令だけ実行する
+            current_pc = ctx.registers[pc];
+            const DecodedInst &inst = decode_table[memory.read(current_pc)];
+            // デバイスへのld, stは頻繁に来るので、インタプリタを呼ばずにここで実行する (上限は判定済み)
+            if ((inst.type == InstructionType::LD || inst.type == InstructionType::ST)
+                && cpu->devices && cpu->devices->is_mapped(inst.second_operand)) {
+                ctx.registers[pc]++;
+                if (inst.type == InstructionType::LD) {
+                    ctx.registers[inst.first_operand] = cpu->devices->read(inst.second_operand);
+                } else {
+                    cpu->devices->write(inst.second_operand, ctx.registers[inst.first_operand]);
+                    // メモリポートで翻訳済みのワードを書き換えたかバンクを切り替えたら翻訳を捨てる
+                    if (memory.generation != translated_generation) {
+                        if (memory.generation != translated_generation + 1 || memory.last_write < 0
+                            || ctx.code_map[memory.last_write]) {
+                            flush();
+                        }
+                        translated_generation = memory.generation;
+                    }
+                }
+                ctx.clock_counter += inst.cycles;
+                ctx.instruction_counter++;
+                continue;
+            }
+            bool writes_code = inst.type == InstructionType::ST && ctx.code_map[inst.second_operand];
+            RunLimit step;
+            step.max_cycles = limit.max_cycles;
+            step.max_instructions = ctx.instruction_counter + 1;
+            store_context();
+            RunStats step_stats = interpreter->run(step);
+            load_context();
+            if (step_stats.halt_reason == HaltReason::HLT) {
+                is_hlt = true;
+            } else if (step_stats.halt_reason == HaltReason::CYCLE_LIMIT
+                       || step_stats.halt_reason == HaltReason::INVALID_OPCODE) {
+                stats.halt_reason = step_stats.halt_reason;
+                break;
+            }
+            if (writes_code) {
+                flush();
+            }
+        }
+
+        store_context();
+        cpu->current_status = is_hlt ? CpuStatus::WRITE_BACK : CpuStatus::FETCH_INST_0;
+        if (is_hlt) {
+            stats.halt_reason = HaltReason::HLT;
+        }
+
+        auto end = chrono::steady_clock::now();
+        stats.cycles = cpu->clock_counter - 1;
+        stats.instructions = cpu->instruction_counter;
+        stats.wall_seconds = chrono::duration<double>(end - start).count();
+        return stats;
+    }
+};
+
+#endif //EMULATOR_JIT_CPU_HPP
@@ -0,0 +1,122 @@
+#ifndef EMULATOR_LOADER_HPP
+#define EMULATOR_LOADER_HPP
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "memory.hpp"
+#include "program_image.hpp"
+
+using namespace std;
+
+// mmapしたプログラムのファイル
+//   ページをMemoryに貸すので、最後のMemoryがなくなるまで解放しない
+struct MappedProgram {
+    uint8_t *data = nullptr;
+    size_t bytes = 0;
+
+    ~MappedProgram() {
+        if (data) {
+            munmap(data, bytes);
+        }
+    }
+};
+
+// 読み込んだプログラムの実行を始めるアドレスと、セクションを置いた範囲の終わり
+struct LoadedProgram {
+    uint16_t entry = 0;
+    uint32_t end = 0;
+};
+
+// プログラムのイメージ (program_image.hpp) をmmapしてメモリに読み込む
+//   ページの先頭に置くセクションは、ファイルのページをそのままメモリのページにする (MAP_PRIVATEなので書き込みはファイルに残らない)
+//   それ以外のセクションと、ファイルの終わりにかかるページはMemory::writeでコピーする
+//   --memory-imageのファイルを実体にしているメモリには全てコピーする (ファイルに残すため)
+inline LoadedProgram load_program(shared_ptr<Memory> memory, string file_path) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "can not open " << file_path << endl;
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        cerr << "can not open " << file_path << endl;
+        exit(1);
+    }
+    shared_ptr<MappedProgram> mapped(new MappedProgram());
+    if (st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            cerr << "can not map " << file_path << endl;
+            exit(1);
+        }
+        mapped->data = static_cast<uint8_t *>(data);
+        mapped->bytes = st.st_size;
+    }
+    close(fd);
+
+    LoadedProgram program;
+    vector<ProgramSection> sections;
+    if (is_program_image(mapped->data, mapped->bytes)) {
+        string error;
+        if (!parse_program_image(mapped->data, mapped->bytes, program.entry, sections, error)) {
+            cerr << file_path << " " << error << endl;
+            exit(1);
+        }
+    } else {
+        // マジックがなければ古い形式 (ファイル全体が0番地からのコード)
+        sections.push_back({ProgramSectionType::CODE, 0, reinterpret_cast<const uint16_t *>(mapped->data),
+                            static_cast<uint32_t>(mapped->bytes / sizeof(uint16_t)), 0});
+    }
+    for (auto &section: sections) {
+        if (section.load_address + static_cast<size_t>(section.word_count) > memory->size) {
+            cerr << file_path << " does not fit in " << memory->size << " words of memory" << endl;
+            exit(1);
+        }
+        program.end = max<uint32_t>(program.end, section.load_address + section.word_count);
+    }
+
+    // 先にページごと貸してから、残りをコピーする (コピーが貸したページで上書きされないように)
+    //   貸すのはセクションがページ全体を覆うときだけ (途中で終わるページの残りはファイルの埋め草で、中身を確かめていない)
+    const size_t page_bytes = PAGE_SIZE * sizeof(uint16_t);
+    auto can_share = [&](const ProgramSection &section, uint32_t i) {
+        return !memory->is_mapped() && section.load_address % PAGE_SIZE == 0 && section.offset % page_bytes == 0
+               && i + PAGE_SIZE <= section.word_count
+               && section.offset + (i + PAGE_SIZE) * sizeof(uint16_t) <= mapped->bytes;
+    };
+    // コピーするページのうちセクションより後ろは0にしておく (他のセクションのコピーで消さないように最初に行う)
+    if (!memory->is_mapped()) {
+        for (auto &section: sections) {
+            uint32_t end = section.load_address + section.word_count;
+            uint32_t page_end = min<uint32_t>((end + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE, memory->size);
+            for (uint32_t addr = end; addr < page_end; addr++) {
+                memory->write(addr, 0);
+            }
+        }
+    }
+    for (auto &section: sections) {
+        for (uint32_t i = 0; i < section.word_count; i += PAGE_SIZE) {
+            if (can_share(section, i)) {
+                memory->share_page(section.load_address + i, reinterpret_cast<uint16_t *>(mapped->data + section.offset) + i, mapped);
+            }
+        }
+    }
+    for (auto &section: sections) {
+        for (uint32_t i = 0; i < section.word_count; i += PAGE_SIZE) {
+            if (!can_share(section, i)) {
+                for (uint32_t j = i; j < min<uint32_t>(i + PAGE_SIZE, section.word_count); j++) {
+                    memory->write(section.load_address + j, section.words[j]);
+                }
+            }
+        }
+    }
+    return program;
+}
+
+#endif //EMULATOR_LOADER_HPP
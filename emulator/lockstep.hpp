@@ -0,0 +1,384 @@
+#ifndef EMULATOR_LOCKSTEP_HPP
+#define EMULATOR_LOCKSTEP_HPP
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <cstring>
+#include "alu.hpp"
+#include "decode.hpp"
+#include "engine.hpp"
+#include "memory.hpp"
+#include "arch.hpp"
+
+using namespace std;
+
+// レーンごとの16bit値をまとめたベクタ (GCC/Clangのベクタ拡張)
+//   AVX2が使えるなら256bitで16レーン、そうでなければSSE2の128bitで8レーンを1命令で扱う
+#ifdef __AVX2__
+#define LOCKSTEP_LANES_PER_VECTOR 16
+#else
+#define LOCKSTEP_LANES_PER_VECTOR 8
+#endif
+const int LANES_PER_VECTOR = LOCKSTEP_LANES_PER_VECTOR;
+typedef uint16_t LaneVector __attribute__((vector_size(LOCKSTEP_LANES_PER_VECTOR * 2)));
+typedef int16_t LaneMask __attribute__((vector_size(LOCKSTEP_LANES_PER_VECTOR * 2)));
+typedef uint64_t LaneCounter __attribute__((vector_size(LOCKSTEP_LANES_PER_VECTOR * 8)));
+typedef int64_t LaneCounterMask __attribute__((vector_size(LOCKSTEP_LANES_PER_VECTOR * 8)));
+
+inline LaneVector lane_select(LaneMask mask, LaneVector if_true, LaneVector if_false) {
+    LaneVector m = (LaneVector) mask;
+    return (if_true & m) | (if_false & ~m);
+}
+
+// マスクのどれか1レーンでも立っているか
+inline bool lane_any(LaneMask mask) {
+    uint64_t words[sizeof(LaneMask) / sizeof(uint64_t)];
+    memcpy(words, &mask, sizeof(mask));
+    uint64_t any = 0;
+    for (auto word: words) {
+        any |= word;
+    }
+    return any != 0;
+}
+
+// Alu::calcのレーン並列版
+//   CMPはAluと同じくPSWのNは0になる方向にだけ、Zは結果が0かどうかで更新する (maskのレーンだけ)
+class VectorAlu {
+public:
+    AluMode mode;
+    LaneVector *psw;
+    VectorAlu() {
+
+    }
+    VectorAlu(LaneVector *psw) {
+        this->psw = psw;
+        this->mode = AluMode::NOP;
+    }
+
+    LaneVector calc(LaneVector a_bus, LaneVector b_bus, LaneMask mask) {
+        LaneVector result = a_bus;
+        switch (this->mode) {
+            case AluMode::ADD:
+                result = a_bus + b_bus;
+                break;
+            case AluMode::SUB:
+                result = a_bus - b_bus;
+                break;
+            case AluMode::AND:
+                result = a_bus & b_bus;
+                break;
+            case AluMode::OR:
+                result = a_bus | b_bus;
+                break;
+            case AluMode::SHIFT_L:
+                result = a_bus << 1;
+                break;
+            case AluMode::SHIFT_R:
+                result = a_bus >> 1;
+                break;
+            case AluMode::CMP: {
+                result = a_bus - b_bus;
+                LaneMask is_zero = (result == 0);
+                LaneVector flagged = lane_select(is_zero, *psw | 0b0100000000000000, *psw & 0b0011111111111111);
+                *psw = lane_select(mask, flagged, *psw);
+                break;
+            }
+            case AluMode::INC:
+                result = a_bus + 1;
+                break;
+            case AluMode::DEC:
+                result = a_bus - 1;
+                break;
+            default:
+                break;
+        }
+        return result;
+    }
+
+    static AluMode get_mode(InstructionType type) {
+        switch (type) {
+            case InstructionType::ADD:
+                return AluMode::ADD;
+            case InstructionType::SUB:
+                return AluMode::SUB;
+            case InstructionType::AND:
+                return AluMode::AND;
+            case InstructionType::OR:
+                return AluMode::OR;
+            case InstructionType::SL:
+                return AluMode::SHIFT_L;
+            case InstructionType::SR:
+                return AluMode::SHIFT_R;
+            case InstructionType::CMP:
+                return AluMode::CMP;
+            default:
+                return AluMode::NOP;
+        }
+    }
+};
+
+// 同じプログラムを違うデータで動かすN個のマシンをレーンとしてまとめて実行するエンジン
+//   レジスタとメモリはstructure-of-arraysで持ち、1命令をベクタ演算で全レーンに適用する
+//   毎回アクティブなレーンの中で一番小さいPCの命令を選び、PCが一致するレーンだけをマスクして実行する
+//   (je で分岐が分かれたレーンやhltしたレーンはマスクから外れる)
+class LockstepCpu {
+private:
+    int vector_count;
+
+    LaneVector &reg(int number, int v) {
+        return registers[number * vector_count + v];
+    }
+
+    LaneVector &mem(int addr, int v) {
+        return memory[addr * vector_count + v];
+    }
+
+public:
+    shared_ptr<CpuArch> arch;
+    const DecodeTable *decode_table;
+    int lane_count;
+
+    vector<LaneVector> registers;  // [レジスタ番号][ベクタ]
+    vector<LaneVector> memory;  // [アドレス][ベクタ]
+    vector<LaneCounter> clock_counter;  // レーンごとのクロック数
+    vector<LaneCounter> instruction_counter;  // レーンごとの命令数
+    vector<LaneMask> halted;  // hltしたレーンなら全bitが1
+    uint64_t dispatch_count = 0;  // 実行した (命令, マスク) の組の数
+
+    // ベクタの数はLANES_PER_VECTORの倍数に切り上げ、余ったレーンはhltした状態から始める
+    LockstepCpu(shared_ptr<CpuArch> arch, int lane_count) {
+        this->arch = arch;
+        this->decode_table = &DecodeTable::get_instance();
+        this->vector_count = (lane_count + LANES_PER_VECTOR - 1) / LANES_PER_VECTOR;
+        this->lane_count = lane_count;
+        LaneVector zero = {};
+        LaneCounter one = {};
+        one += 1;
+        LaneMask running = {};
+        registers.assign(CpuArch::REGISTER_COUNT * vector_count, zero);
+        memory.assign(MEMORY_SIZE * vector_count, zero);
+        clock_counter.assign(vector_count, one);
+        instruction_counter.assign(vector_count, LaneCounter{});
+        halted.assign(vector_count, running);
+        for (int lane = lane_count; lane < vector_count * LANES_PER_VECTOR; lane++) {
+            halted[lane / LANES_PER_VECTOR][lane % LANES_PER_VECTOR] = -1;
+        }
+    }
+
+    // 全レーンに同じイメージを読み込む
+    void load_image(const uint16_t *image) {
+        for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+            for (int v = 0; v < vector_count; v++) {
+                LaneVector column = {};
+                column += image[addr];
+                mem(addr, v) = column;
+            }
+        }
+    }
+
+    uint16_t get_register(int lane, int number) {
+        return reg(number, lane / LANES_PER_VECTOR)[lane % LANES_PER_VECTOR];
+    }
+
+    void set_register(int lane, int number, uint16_t value) {
+        reg(number, lane / LANES_PER_VECTOR)[lane % LANES_PER_VECTOR] = value;
+    }
+
+    uint16_t get_memory(int lane, int addr) {
+        return mem(addr, lane / LANES_PER_VECTOR)[lane % LANES_PER_VECTOR];
+    }
+
+    void set_memory(int lane, int addr, uint16_t value) {
+        mem(addr, lane / LANES_PER_VECTOR)[lane % LANES_PER_VECTOR] = value;
+    }
+
+    uint64_t get_cycles(int lane) {
+        return clock_counter[lane / LANES_PER_VECTOR][lane % LANES_PER_VECTOR] - 1;
+    }
+
+    uint64_t get_instructions(int lane) {
+        return instruction_counter[lane / LANES_PER_VECTOR][lane % LANES_PER_VECTOR];
+    }
+
+    bool is_halted(int lane) {
+        return halted[lane / LANES_PER_VECTOR][lane % LANES_PER_VECTOR] != 0;
+    }
+
+    // 全てのレーンがhltするか上限に達するまで実行する
+    //   上限はレーンごとに判定し、達したレーンはそこで止まる
+    //   返すRunStatsのcycles, instructionsは全レーンの合計
+    RunStats run(RunLimit limit) {
+        RunStats stats;
+        auto start = chrono::steady_clock::now();
+        const int pc = arch->PC_REG_NUMBER;
+        const int psw = arch->PSW_REG_NUMBER;
+        const bool has_limit = limit.max_cycles > 0 || limit.max_instructions > 0;
+        const uint64_t cycle_end = limit.max_cycles > 0 ? limit.max_cycles + 1 : numeric_limits<uint64_t>::max();
+        const uint64_t inst_end = limit.max_instructions > 0 ? limit.max_instructions : numeric_limits<uint64_t>::max();
+        const LaneVector no_pc = LaneVector{} + 0xffff;
+
+        // 実行できるレーン (hltしておらず上限にも達していない)
+        vector<LaneMask> active(vector_count);
+        auto update_active = [&](int v) {
+            active[v] = ~halted[v];
+            if (has_limit) {
+                LaneCounterMask within = (clock_counter[v] < cycle_end) & (instruction_counter[v] < inst_end);
+                active[v] &= __builtin_convertvector(within, LaneMask);
+            }
+        };
+        for (int v = 0; v < vector_count; v++) {
+            update_active(v);
+        }
+
+        // PCがnext_pcで、そこの命令がcodeのレーンだけに命令を適用する
+        //   Cpu::clockと同じく命令を実行する前にPCを進めておく
+        uint16_t next_pc = 0;
+        uint16_t code = 0;
+        LaneCounter cycles = {};
+        auto execute = [&](auto body) {
+            for (int v = 0; v < vector_count; v++) {
+                LaneMask mask = active[v] & (reg(pc, v) == next_pc) & (mem(next_pc % MEMORY_SIZE, v) == code);
+                if (!lane_any(mask)) {
+                    continue;
+                }
+                LaneCounter mask64 = (LaneCounter) __builtin_convertvector(mask, LaneCounterMask);
+                clock_counter[v] += cycles & mask64;
+                instruction_counter[v] -= mask64;  // マスクは-1なので引くと1増える
+                reg(pc, v) = lane_select(mask, reg(pc, v) + 1, reg(pc, v));
+                body(v, mask);
+                update_active(v);
+            }
+        };
+
+        while (true) {
+            // アクティブなレーンの中で一番小さいPCを求める
+            LaneVector min_pc = no_pc;
+            LaneMask any_active = {};
+            for (int v = 0; v < vector_count; v++) {
+                LaneVector candidate = lane_select(active[v], reg(pc, v), no_pc);
+                min_pc = candidate < min_pc ? candidate : min_pc;
+                any_active |= active[v];
+            }
+            if (!lane_any(any_active)) {
+                break;
+            }
+            next_pc = min_pc[0];
+            for (int i = 1; i < LANES_PER_VECTOR; i++) {
+                if (min_pc[i] < next_pc) {
+                    next_pc = min_pc[i];
+                }
+            }
+
+            // 命令はnext_pcにいる最初のレーンのメモリから取る
+            //   同じPCでも(自己書き換えで)命令が違うレーンは今回はマスクから外れ、後で実行される
+            for (int v = 0; v < vector_count; v++) {
+                LaneMask here = active[v] & (reg(pc, v) == next_pc);
+                if (lane_any(here)) {
+                    for (int i = 0; i < LANES_PER_VECTOR; i++) {
+                        if (here[i]) {
+                            code = mem(next_pc % MEMORY_SIZE, v)[i];
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+            const DecodedInst &inst = decode_table->decode(code);
+            if (!inst.is_valid) {
+                cerr << "invalid opcode " << static_cast<int>(inst.opcode) << endl;
+                exit(1);
+            }
+            dispatch_count++;
+            cycles = LaneCounter{} + inst.cycles;
+
+            const int first = inst.first_operand;
+            const int source = inst.second_operand >> 5;
+            const uint16_t addr = inst.second_operand;
+            const LaneVector imm = LaneVector{} + inst.second_operand;
+            switch (inst.type) {
+                case InstructionType::MOV:
+                    execute([&](int v, LaneMask mask) {
+                        reg(first, v) = lane_select(mask, reg(source, v), reg(first, v));
+                    });
+                    break;
+                case InstructionType::ADD:
+                case InstructionType::SUB:
+                case InstructionType::AND:
+                case InstructionType::OR:
+                case InstructionType::SL:
+                case InstructionType::SR: {
+                    // sl, srは第2オペランドを使わない
+                    const int b = inst.operand_type == OperandType::DOUBLE_OPERAND ? source : first;
+                    const AluMode mode = VectorAlu::get_mode(inst.type);
+                    execute([&](int v, LaneMask mask) {
+                        VectorAlu alu(&reg(psw, v));
+                        alu.mode = mode;
+                        reg(first, v) = lane_select(mask, alu.calc(reg(first, v), reg(b, v), mask), reg(first, v));
+                    });
+                    break;
+                }
+                case InstructionType::LDL:
+                    execute([&](int v, LaneMask mask) {
+                        reg(first, v) = lane_select(mask, reg(first, v) | imm, reg(first, v));
+                    });
+                    break;
+                case InstructionType::LDH:
+                    execute([&](int v, LaneMask mask) {
+                        reg(first, v) = lane_select(mask, reg(first, v) | (imm << 8), reg(first, v));
+                    });
+                    break;
+                case InstructionType::CMP:
+                    execute([&](int v, LaneMask mask) {
+                        VectorAlu alu(&reg(psw, v));
+                        alu.mode = AluMode::CMP;
+                        alu.calc(reg(first, v), reg(source, v), mask);
+                    });
+                    break;
+                case InstructionType::JE:
+                    execute([&](int v, LaneMask mask) {
+                        LaneMask taken = mask & ((reg(psw, v) & 0b0100000000000000) != 0);
+                        reg(pc, v) = lane_select(taken, imm, reg(pc, v));
+                    });
+                    break;
+                case InstructionType::JMP:
+                    execute([&](int v, LaneMask mask) {
+                        reg(pc, v) = lane_select(mask, imm, reg(pc, v));
+                    });
+                    break;
+                case InstructionType::LD:
+                    execute([&](int v, LaneMask mask) {
+                        reg(first, v) = lane_select(mask, mem(addr, v), reg(first, v));
+                    });
+                    break;
+                case InstructionType::ST:
+                    execute([&](int v, LaneMask mask) {
+                        mem(addr, v) = lane_select(mask, reg(first, v), mem(addr, v));
+                    });
+                    break;
+                case InstructionType::HLT:
+                    execute([&](int v, LaneMask mask) {
+                        halted[v] |= mask;
+                    });
+                    break;
+            }
+        }
+
+        stats.halt_reason = HaltReason::HLT;
+        for (int lane = 0; lane < lane_count; lane++) {
+            stats.cycles += get_cycles(lane);
+            stats.instructions += get_instructions(lane);
+            if (!is_halted(lane)) {
+                stats.halt_reason = limit.max_cycles > 0 && get_cycles(lane) >= limit.max_cycles
+                                    ? HaltReason::CYCLE_LIMIT : HaltReason::INST_LIMIT;
+            }
+        }
+        auto end = chrono::steady_clock::now();
+        stats.wall_seconds = chrono::duration<double>(end - start).count();
+        return stats;
+    }
+};
+
+#endif //EMULATOR_LOCKSTEP_HPP
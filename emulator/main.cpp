@@ -3,54 +3,828 @@
 #include <vector>
 #include <bitset>
 #include <memory>
-#include <unistd.h>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
 #include "memory.hpp"
 #include "cpu.hpp"
+#include "engine.hpp"
+#include "engine_factory.hpp"
+#include "fast_cpu.hpp"
+#include "pipeline.hpp"
+#include "cache.hpp"
+#include "branch_predictor.hpp"
+#include "loader.hpp"
+#include "lockstep.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+#include "time_travel.hpp"
+#include "visualizer.hpp"
+#include "pacer.hpp"
+#include "device_bus.hpp"
+#include "alloc_counter.hpp"
 
 using namespace std;
 
-void load_program(shared_ptr<Memory>memory, string file_path) {
-    ifstream ifs(file_path, ios::in | ios::binary);
-    uint16_t buff;
-    vector<uint16_t> program;
-    while(!ifs.eof()) {
-        ifs.read((char*)&buff, sizeof(uint16_t));
-        program.push_back(buff);
+// --check-allocsでヒープ確保を数え始める前に実行する命令数 (遅延して作る表や翻訳を済ませておく)
+const uint64_t ALLOCATION_WARMUP_INSTRUCTIONS = 1000;
+
+// 一定時間くり返し実行したときの合計
+struct BenchTotal {
+    uint64_t runs = 0;
+    uint64_t instructions = 0;
+    double seconds = 0;
+};
+
+// make_engineで作ったエンジンでイメージを0.5秒以上くり返し実行する
+BenchTotal measure_engine(shared_ptr<CpuArch> arch, shared_ptr<Memory> image, RunLimit limit,
+                          function<shared_ptr<Engine>(shared_ptr<Cpu>)> make_engine) {
+    const double min_seconds = 0.5;
+    BenchTotal total;
+    while (total.seconds < min_seconds) {
+        shared_ptr<Memory> memory(new Memory(*image));
+        shared_ptr<Cpu> cpu(new Cpu(memory, arch));
+        cpu->is_headless = true;
+        auto engine = make_engine(cpu);
+        RunStats stats = engine->run(limit);
+        total.runs++;
+        total.instructions += stats.instructions;
+        total.seconds += stats.wall_seconds;
+    }
+    return total;
+}
+
+void print_bench(string label, BenchTotal total, double base_ips) {
+    double ips = total.instructions / total.seconds;
+    cout << "BENCH " << setw(15) << left << label << right
+         << " runs=" << total.runs
+         << " instructions=" << total.instructions
+         << " inst/s=" << fixed << setprecision(0) << ips
+         << " speedup=" << setprecision(2) << ips / base_ips << "x" << defaultfloat << endl;
+}
+
+// 各エンジンで同じプログラムを一定時間くり返し実行して1秒あたりの命令数を比べる
+void run_benchmark(shared_ptr<CpuArch> arch, shared_ptr<Memory> image, RunLimit limit) {
+    vector<EngineType> engine_types = {EngineType::CLOCK, EngineType::FAST, EngineType::THREADED, EngineType::JIT};
+    double base_ips = 0;
+    for (auto engine_type: engine_types) {
+        BenchTotal total = measure_engine(arch, image, limit, [&](shared_ptr<Cpu> cpu) {
+            return create_engine(engine_type, cpu);
+        });
+        if (base_ips == 0) {
+            base_ips = total.instructions / total.seconds;
+        }
+        print_bench("engine=" + get_engine_type_name(engine_type), total, base_ips);
+    }
+}
+
+// FastCpuの最適化を1つずつ有効にして比べる
+//   cmpのたびにr5を書き換える場合 (既定)、r5が読まれるまで遅らせる場合、スーパー命令を使う場合
+//   sample/cmp_loop.sのようにcmpとjeが多いプログラムで差が出る (速くなるのはスーパー命令だけ)
+//   最後にパフォーマンスカウンタを数えながら実行した場合の遅さも測る
+void run_fast_benchmark(shared_ptr<CpuArch> arch, shared_ptr<Memory> image, RunLimit limit) {
+    struct Variant {
+        string label;
+        bool lazy_flags;
+        bool fuse;
+        bool count;
+    };
+    vector<Variant> variants = {
+            {"fast=eager", false, false, false},
+            {"fast=lazy", true, false, false},
+            {"fast=fuse", false, true, false},
+            {"fast=+perf", false, true, true},
+    };
+    unique_ptr<PerfCounters> perf(new PerfCounters());
+    double base_ips = 0;
+    for (auto &variant: variants) {
+        BenchTotal total = measure_engine(arch, image, limit, [&](shared_ptr<Cpu> cpu) {
+            shared_ptr<FastCpu> engine(new FastCpu(cpu));
+            engine->lazy_flags = variant.lazy_flags;
+            engine->fuse = variant.fuse;
+            if (variant.count) {
+                cpu->perf = perf.get();
+            }
+            return engine;
+        });
+        if (base_ips == 0) {
+            base_ips = total.instructions / total.seconds;
+        }
+        print_bench(variant.label, total, base_ips);
+    }
+}
+
+// FastCpuが実行したディスパッチの数と、スーパー命令で減らせた数を表示する
+void print_dispatch_report(ostream &os, shared_ptr<FastCpu> engine, RunStats stats) {
+    uint64_t eliminated = stats.instructions - engine->dispatch_count;
+    os << "DISPATCH instructions=" << stats.instructions
+       << " dispatches=" << engine->dispatch_count
+       << " fused=" << engine->fused_count
+       << " eliminated=" << eliminated
+       << " (" << fixed << setprecision(1)
+       << (stats.instructions > 0 ? 100.0 * eliminated / stats.instructions : 0.0) << "%)"
+       << defaultfloat << endl;
+}
+
+// イメージを読み込んだLockstepCpuを作り、sweep_registerが指定されていればレーン番号を書き込む
+shared_ptr<LockstepCpu> create_lockstep(shared_ptr<CpuArch> arch, shared_ptr<Memory> image, int lanes, int sweep_register) {
+    shared_ptr<LockstepCpu> lockstep(new LockstepCpu(arch, lanes));
+    lockstep->load_image(image->memory);
+    if (sweep_register >= 0) {
+        for (int lane = 0; lane < lockstep->lane_count; lane++) {
+            lockstep->set_register(lane, sweep_register, lane);
+        }
+    }
+    return lockstep;
+}
+
+// 同じN個のマシンをLockstepCpuでまとめて実行した場合と、CpuやFastCpuで1つずつ実行した場合の1秒あたりのレーン数を比べる
+void run_lockstep_benchmark(shared_ptr<CpuArch> arch, shared_ptr<Memory> image, RunLimit limit, int lanes, int sweep_register) {
+    const double min_seconds = 0.5;
+    double base_lps = 0;
+    auto report = [&](string name, uint64_t lane_runs, uint64_t instructions, double seconds) {
+        double lps = lane_runs / seconds;
+        if (base_lps == 0) {
+            base_lps = lps;
+        }
+        cout << "BENCH engine=" << setw(8) << left << name << right
+             << " lanes=" << lane_runs
+             << " instructions=" << instructions
+             << " lanes/s=" << fixed << setprecision(0) << lps
+             << " inst/s=" << instructions / seconds
+             << " speedup=" << setprecision(2) << lps / base_lps << "x" << defaultfloat << endl;
+    };
+
+    for (auto engine_type: {EngineType::CLOCK, EngineType::FAST}) {
+        uint64_t lane_runs = 0;
+        uint64_t instructions = 0;
+        double seconds = 0;
+        while (seconds < min_seconds) {
+            for (int lane = 0; lane < lanes; lane++) {
+                shared_ptr<Memory> memory(new Memory(*image));
+                shared_ptr<Cpu> cpu(new Cpu(memory, arch));
+                cpu->is_headless = true;
+                if (sweep_register >= 0) {
+                    cpu->registers[sweep_register] = lane;
+                }
+                auto engine = create_engine(engine_type, cpu);
+                RunStats stats = engine->run(limit);
+                instructions += stats.instructions;
+                seconds += stats.wall_seconds;
+            }
+            lane_runs += lanes;
+        }
+        report(get_engine_type_name(engine_type), lane_runs, instructions, seconds);
+    }
+
+    uint64_t lane_runs = 0;
+    uint64_t instructions = 0;
+    double seconds = 0;
+    while (seconds < min_seconds) {
+        auto lockstep = create_lockstep(arch, image, lanes, sweep_register);
+        RunStats stats = lockstep->run(limit);
+        lane_runs += lockstep->lane_count;
+        instructions += stats.instructions;
+        seconds += stats.wall_seconds;
     }
-    for (int i = 0; i< program.size(); i++) {
-        memory->memory[i] = program.at(i);
+    report("lockstep", lane_runs, instructions, seconds);
+}
+
+// スナップショットの保存、復元、フォークにかかる時間を測る
+void run_snapshot_benchmark(shared_ptr<CpuArch> arch, shared_ptr<Memory> image) {
+    const int iterations = 100000;
+    shared_ptr<Memory> memory(new Memory(*image));
+    shared_ptr<Cpu> cpu(new Cpu(memory, arch));
+    cpu->is_headless = true;
+    MachineSnapshot snapshot;
+
+    auto measure = [&](function<void()> func) {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            func();
+        }
+        auto end = chrono::steady_clock::now();
+        return chrono::duration<double, nano>(end - start).count() / iterations;
+    };
+    double take_ns = measure([&]() { take_snapshot(*cpu, snapshot); });
+    double restore_ns = measure([&]() { restore_snapshot(*cpu, snapshot); });
+    double fork_ns = measure([&]() { fork_machine(cpu); });
+    cout << "BENCH snapshot size=" << sizeof(MachineSnapshot) << "B"
+         << " take=" << fixed << setprecision(1) << take_ns << "ns"
+         << " restore=" << restore_ns << "ns"
+         << " fork=" << fork_ns << "ns" << defaultfloat << endl;
+}
+
+// 記録しながら最後まで実行してから、ランダムな位置へのシークにかかる時間を測る
+void run_time_travel_benchmark(shared_ptr<CpuArch> arch, shared_ptr<Memory> image, RunLimit limit, size_t budget) {
+    const int seeks = 200;
+    shared_ptr<Memory> memory(new Memory(*image));
+    shared_ptr<Cpu> cpu(new Cpu(memory, arch));
+    cpu->is_headless = true;
+    TimeTravel time_travel(cpu, budget);
+    RunStats stats = time_travel.run(limit);
+    uint64_t total_cycles = stats.cycles;
+
+    mt19937_64 rng(1);
+    double total_ms = 0;
+    double max_ms = 0;
+    for (int i = 0; i < seeks; i++) {
+        uint64_t target = total_cycles > 0 ? rng() % total_cycles : 0;
+        auto start = chrono::steady_clock::now();
+        time_travel.seek_cycle(target);
+        auto end = chrono::steady_clock::now();
+        double ms = chrono::duration<double, milli>(end - start).count();
+        total_ms += ms;
+        max_ms = max(max_ms, ms);
     }
+    cout << "BENCH time-travel cycles=" << total_cycles
+         << " record=" << fixed << setprecision(3) << stats.wall_seconds << "s"
+         << " checkpoints=" << time_travel.get_checkpoint_count()
+         << " interval=" << time_travel.get_interval()
+         << " memory=" << time_travel.get_memory_usage() << "B"
+         << " seek-avg=" << total_ms / seeks << "ms"
+         << " seek-max=" << max_ms << "ms" << defaultfloat << endl;
+}
+
+// 今の位置を1行で表示する
+void print_position(shared_ptr<Cpu> cpu, shared_ptr<SymbolTable> symbols) {
+    uint16_t pc = cpu->registers[cpu->arch->PC_REG_NUMBER];
+    cout << "AT inst=" << cpu->instruction_counter << " cycles=" << cpu->clock_counter - 1 << " pc=";
+    if (symbols) {
+        cout << symbols->describe(pc);
+    } else {
+        cout << "0x" << hex << setw(2) << setfill('0') << pc << setfill(' ') << dec;
+    }
+    if (cpu->current_status == CpuStatus::WRITE_BACK) {
+        cout << " (halted)";
+    }
+    cout << endl;
+}
+
+// 標準入力からコマンドを読んで、前にも後ろにも実行できるデバッガ
+//   s [N] / rs [N]: N命令進む / 戻る、c / rc: ブレークポイントまで進む / 戻る
+//   b ADDR / d ADDR: ブレークポイントを置く / 消す (ADDRは16進数かラベル名)
+//   goto N: N命令目の前に移る、seek N: Nクロック目以前で最後の命令の境界に移る
+//   r: レジスタ、x ADDR [N]: メモリ、info: 記録の状態、q: 終了
+void run_debugger(shared_ptr<Cpu> cpu, shared_ptr<SymbolTable> symbols, RunLimit limit, size_t budget) {
+    // チェックポイントは0ページしか持たないが、デバッガではデバイスを使えないので1ページ目より後ろは実行中に変わらない
+    TimeTravel time_travel(cpu, budget);
+    const Memory &memory = *cpu->memory;
+    vector<bool> breakpoints(memory.size, false);
+    auto parse_addr = [&](string str) -> int {
+        if (symbols) {
+            for (auto &symbol: symbols->symbols) {
+                if (symbol.name == str) {
+                    return symbol.start;
+                }
+            }
+        }
+        int addr = stoi(str, 0, 16);
+        return addr >= 0 && addr < memory.size ? addr : -1;
+    };
+
+    print_position(cpu, symbols);
+    string line;
+    while (cout << "(tt) " << flush, getline(cin, line)) {
+        stringstream ss(line);
+        string command;
+        string arg;
+        if (!(ss >> command)) {
+            continue;
+        }
+        ss >> arg;
+        auto start = chrono::steady_clock::now();
+        try {
+            if (command == "q") {
+                break;
+            } else if (command == "s") {
+                RunLimit step = limit;
+                step.max_instructions = cpu->instruction_counter + (arg.empty() ? 1 : stoull(arg));
+                if (limit.max_instructions > 0) {
+                    step.max_instructions = min(step.max_instructions, limit.max_instructions);
+                }
+                time_travel.run(step);
+            } else if (command == "rs") {
+                uint64_t count = arg.empty() ? 1 : stoull(arg);
+                uint64_t first = time_travel.get_first_instruction();
+                time_travel.seek_instruction(cpu->instruction_counter - min(count, cpu->instruction_counter - first));
+            } else if (command == "c") {
+                if (!time_travel.continue_to(breakpoints, limit)) {
+                    cout << "no breakpoint hit" << endl;
+                }
+            } else if (command == "rc") {
+                if (!time_travel.reverse_continue(breakpoints)) {
+                    cout << "no breakpoint hit" << endl;
+                }
+            } else if ((command == "b" || command == "d") && !arg.empty()) {
+                int addr = parse_addr(arg);
+                if (addr < 0) {
+                    cout << "invalid address " << arg << endl;
+                    continue;
+                }
+                breakpoints[addr] = command == "b";
+                continue;
+            } else if (command == "goto" && !arg.empty()) {
+                time_travel.seek_instruction(stoull(arg));
+            } else if (command == "seek" && !arg.empty()) {
+                time_travel.seek_cycle(stoull(arg));
+            } else if (command == "r") {
+                for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+                    cout << "R" << i << " 0x" << hex << cpu->registers[i] << dec << endl;
+                }
+                continue;
+            } else if (command == "x" && !arg.empty()) {
+                int addr = parse_addr(arg);
+                string count_str;
+                int count = ss >> count_str ? stoi(count_str) : 1;
+                for (int i = addr; i >= 0 && i < addr + count && i < memory.size; i++) {
+                    cout << "[0x" << hex << i << "] 0x" << memory.read(i) << dec
+                         << " (" << memory.read(i) << ")" << endl;
+                }
+                continue;
+            } else if (command == "info") {
+                cout << "INFO first=" << time_travel.get_first_instruction()
+                     << " checkpoints=" << time_travel.get_checkpoint_count()
+                     << " interval=" << time_travel.get_interval()
+                     << " undo=" << time_travel.get_undo_count()
+                     << " memory=" << time_travel.get_memory_usage() << "B" << endl;
+                continue;
+            } else {
+                cout << "commands: s [N], rs [N], c, rc, b ADDR, d ADDR, goto N, seek N, r, x ADDR [N], info, q" << endl;
+                continue;
+            }
+        } catch (const logic_error &) {
+            cout << "invalid argument " << arg << endl;
+            continue;
+        }
+        auto end = chrono::steady_clock::now();
+        print_position(cpu, symbols);
+        cout << "TOOK " << fixed << setprecision(3) << chrono::duration<double, milli>(end - start).count() << "ms"
+             << defaultfloat << endl;
+    }
+    cout << "RESULT is [" << cpu->memory->memory[0x64] << "]" << endl;
 }
 
 void exit_with_help() {
-    cerr << "[USAGE] emulator INPUT_FILE" << endl;
+    cerr << "[USAGE] emulator [--headless] [--fps N] [--hz N] [--engine clock|fast|threaded|jit|pipeline] [--bench] [--lanes N [--sweep REG]] [--max-cycles N] [--max-insts N]"
+         << " [--no-fuse] [--fused-cycles] [--dispatch-report] [--perf] [--symbols FILE] [--trace FILE]"
+         << " [--debug] [--tt-budget MB] [--no-forwarding]"
+         << " [--cache] [--l1i SPEC] [--l1d SPEC] [--l2 SPEC] [--mem-latency N]"
+         << " [--predictor not-taken|bimodal|gshare] [--bp-bits N] [--btb N] [--check-allocs]"
+         << " [--devices] [--input FILE] [--block FILE] [--memory-size WORDS] [--banks N] [--memory-image FILE]"
+         << " [--save-snapshot FILE] (INPUT_FILE | --load-snapshot FILE | --memory-image FILE)" << endl;
     exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    char *program_file = argv[1];
+    char *program_file = NULL;
+    char *load_snapshot_file = NULL;
+    char *save_snapshot_file = NULL;
+    char *symbol_file = NULL;
+    char *trace_file = NULL;
+    bool is_debug = false;
+    size_t tt_budget = 64 << 20;
+    bool is_headless = false;
+    int fps = 30;
+    double hz = 0;  // 0ならペースを合わせない
+    bool is_devices = false;
+    string input_file;
+    string block_file;
+    uint32_t memory_size = MEMORY_SIZE;
+    uint32_t memory_banks = 1;
+    char *memory_image_file = NULL;
+    bool is_bench = false;
+    bool is_fuse = true;
+    bool is_fused_cycles = false;
+    bool is_dispatch_report = false;
+    bool is_perf = false;
+    bool is_forwarding = true;
+    bool is_check_allocs = false;
+    bool is_cache = false;
+    CacheConfig l1i_config;
+    CacheConfig l1d_config;
+    optional<CacheConfig> l2_config;
+    uint64_t memory_latency = 20;
+    optional<PredictorType> predictor_type;
+    int predictor_bits = 8;
+    int btb_entries = 0;
+    int lanes = 0;
+    int sweep_register = -1;
+    EngineType engine_type = EngineType::CLOCK;
+    RunLimit limit;
 
-    if (argc < 2) {
+    // 数値の引数が数値でなければ (stoi, stodが投げる) 使い方を表示して終わる
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--headless") {
+                is_headless = true;
+            } else if (arg == "--bench") {
+                is_bench = true;
+            } else if (arg == "--no-fuse") {
+                is_fuse = false;
+            } else if (arg == "--fused-cycles") {
+                is_fused_cycles = true;
+            } else if (arg == "--dispatch-report") {
+                is_dispatch_report = true;
+            } else if (arg == "--perf") {
+                is_perf = true;
+            } else if (arg == "--check-allocs") {
+                is_check_allocs = true;
+            } else if (arg == "--no-forwarding") {
+                is_forwarding = false;
+            } else if (arg == "--cache") {
+                is_cache = true;
+            } else if (arg == "--l1i" && i + 1 < argc) {
+                is_cache = true;
+                l1i_config = parse_cache_config(argv[++i], l1i_config);
+            } else if (arg == "--l1d" && i + 1 < argc) {
+                is_cache = true;
+                l1d_config = parse_cache_config(argv[++i], l1d_config);
+            } else if (arg == "--l2" && i + 1 < argc) {
+                is_cache = true;
+                CacheConfig base;
+                base.size = 128;
+                base.ways = 4;
+                base.latency = 4;
+                l2_config = parse_cache_config(argv[++i], base);
+            } else if (arg == "--predictor" && i + 1 < argc) {
+                predictor_type = get_predictor_type_by_name(argv[++i]);
+                if (!predictor_type) {
+                    exit_with_help();
+                }
+            } else if (arg == "--bp-bits" && i + 1 < argc) {
+                predictor_bits = stoi(argv[++i]);
+                if (predictor_bits < 0 || predictor_bits > 16) {
+                    exit_with_help();
+                }
+                predictor_type = predictor_type.value_or(PredictorType::BIMODAL);
+            } else if (arg == "--btb" && i + 1 < argc) {
+                btb_entries = stoi(argv[++i]);
+                if (btb_entries < 0) {
+                    exit_with_help();
+                }
+                predictor_type = predictor_type.value_or(PredictorType::NOT_TAKEN);
+            } else if (arg == "--mem-latency" && i + 1 < argc) {
+                is_cache = true;
+                memory_latency = stoull(argv[++i]);
+            } else if (arg == "--engine" && i + 1 < argc) {
+                auto type = get_engine_type_by_name(argv[++i]);
+                if (!type) {
+                    exit_with_help();
+                }
+                engine_type = type.value();
+            } else if (arg == "--lanes" && i + 1 < argc) {
+                lanes = stoi(argv[++i]);
+                if (lanes <= 0) {
+                    exit_with_help();
+                }
+            } else if (arg == "--sweep" && i + 1 < argc) {
+                auto reg = CpuArch().get_register_by_name(argv[++i]);
+                if (!reg) {
+                    exit_with_help();
+                }
+                sweep_register = reg->code;
+            } else if (arg == "--max-cycles" && i + 1 < argc) {
+                limit.max_cycles = stoull(argv[++i]);
+            } else if (arg == "--max-insts" && i + 1 < argc) {
+                limit.max_instructions = stoull(argv[++i]);
+            } else if (arg == "--load-snapshot" && i + 1 < argc) {
+                load_snapshot_file = argv[++i];
+            } else if (arg == "--save-snapshot" && i + 1 < argc) {
+                save_snapshot_file = argv[++i];
+            } else if (arg == "--debug") {
+                is_debug = true;
+            } else if (arg == "--fps" && i + 1 < argc) {
+                fps = stoi(argv[++i]);
+                if (fps <= 0) {
+                    cerr << "--fps must be positive" << endl;
+                    exit(1);
+                }
+            } else if (arg == "--hz" && i + 1 < argc) {
+                hz = stod(argv[++i]);
+                if (hz <= 0) {
+                    cerr << "--hz must be positive" << endl;
+                    exit(1);
+                }
+            } else if (arg == "--devices") {
+                is_devices = true;
+            } else if (arg == "--input" && i + 1 < argc) {
+                is_devices = true;
+                input_file = argv[++i];
+            } else if (arg == "--block" && i + 1 < argc) {
+                is_devices = true;
+                block_file = argv[++i];
+            } else if (arg == "--memory-size" && i + 1 < argc) {
+                memory_size = stoul(argv[++i], nullptr, 0);
+                if (memory_size < MEMORY_SIZE || memory_size > ADDRESS_SPACE_SIZE || (memory_size & (memory_size - 1)) != 0) {
+                    cerr << "--memory-size must be a power of two from " << MEMORY_SIZE << " to " << ADDRESS_SPACE_SIZE << endl;
+                    exit(1);
+                }
+            } else if (arg == "--banks" && i + 1 < argc) {
+                memory_banks = stoul(argv[++i]);
+                if (memory_banks < 1 || memory_banks > MAX_MEMORY_BANKS) {
+                    cerr << "--banks must be from 1 to " << MAX_MEMORY_BANKS << endl;
+                    exit(1);
+                }
+            } else if (arg == "--memory-image" && i + 1 < argc) {
+                memory_image_file = argv[++i];
+            } else if (arg == "--tt-budget" && i + 1 < argc) {
+                tt_budget = stoull(argv[++i]) << 20;
+            } else if (arg == "--trace" && i + 1 < argc) {
+                trace_file = argv[++i];
+            } else if (arg == "--symbols" && i + 1 < argc) {
+                symbol_file = argv[++i];
+            } else if (arg.substr(0, 2) == "--") {
+                exit_with_help();
+            } else {
+                program_file = argv[i];
+            }
+        }
+    } catch (const logic_error &) {
         exit_with_help();
     }
 
+    // メモリのイメージがあればプログラムは省いてよい (イメージの中身から実行する)
+    if ((program_file != NULL && load_snapshot_file != NULL)
+        || (program_file == NULL && load_snapshot_file == NULL && memory_image_file == NULL)) {
+        exit_with_help();
+    }
+    // 0ページより大きいメモリは、0ページだけを持つスナップショットとトレース、レーンでは扱えない
+    bool is_large_memory = memory_size != MEMORY_SIZE || memory_banks > 1;
+    if (is_large_memory && (load_snapshot_file != NULL || save_snapshot_file != NULL || trace_file != NULL || lanes > 0)) {
+        cerr << "--memory-size and --banks are not supported with snapshots, --trace or --lanes" << endl;
+        exit(1);
+    }
+    if (memory_banks > 1 && memory_size == MEMORY_SIZE) {
+        cerr << "--banks needs --memory-size larger than " << MEMORY_SIZE << endl;
+        exit(1);
+    }
+
     shared_ptr<CpuArch> arch(new CpuArch());
-    shared_ptr<Memory> memory(new Memory());
+    shared_ptr<Memory> memory(new Memory(memory_size, memory_banks));
+    if (memory_image_file != NULL) {
+        memory->map_image(string(memory_image_file));
+    }
     shared_ptr<Cpu> cpu(new Cpu(memory, arch));
-    // プログラムをメモリに読み込む
-    load_program(memory, string(program_file));
+    // アドレスごとのカウンタが大きいのでスタックには置かず、--perfのときだけ確保する
+    unique_ptr<PerfCounters> perf;
+    if (is_perf) {
+        if (!PERF_COUNTERS_AVAILABLE) {
+            cerr << "emulator was built without performance counters" << endl;
+            exit(1);
+        }
+        // カウンタを数えられるのはCpuとFastCpuだけ
+        if (engine_type != EngineType::CLOCK && engine_type != EngineType::FAST) {
+            cerr << "--perf is supported only by the clock and fast engines" << endl;
+            exit(1);
+        }
+        perf.reset(new PerfCounters());
+        cpu->perf = perf.get();
+    }
+    // キャッシュを通してメモリにアクセスするのはCpuとPipelineCpuだけ
+    unique_ptr<CacheHierarchy> cache;
+    if (is_cache) {
+        if ((engine_type != EngineType::CLOCK && engine_type != EngineType::PIPELINE) || is_debug || is_bench || lanes > 0) {
+            cerr << "--cache is supported only by the clock and pipeline engines" << endl;
+            exit(1);
+        }
+        cache = unique_ptr<CacheHierarchy>(new CacheHierarchy(l1i_config, l1d_config, l2_config, memory_latency));
+        cpu->cache = cache.get();
+    }
+    // 分岐を予測するのもCpuとPipelineCpuだけ (クロック数に効くのはPipelineCpuだけ)
+    unique_ptr<BranchUnit> branch_unit;
+    if (predictor_type) {
+        if ((engine_type != EngineType::CLOCK && engine_type != EngineType::PIPELINE) || is_debug || is_bench || lanes > 0) {
+            cerr << "--predictor is supported only by the clock and pipeline engines" << endl;
+            exit(1);
+        }
+        branch_unit = unique_ptr<BranchUnit>(new BranchUnit(predictor_type.value(), predictor_bits, btb_entries));
+        cpu->branch_unit = branch_unit.get();
+    }
+    // 周波数を合わせるのは1つのエンジンで普通に実行するときだけ
+    unique_ptr<Pacer> pacer;
+    if (hz > 0) {
+        if (is_debug || is_bench || lanes > 0) {
+            cerr << "--hz is not supported with --debug, --bench or --lanes" << endl;
+            exit(1);
+        }
+        pacer = unique_ptr<Pacer>(new Pacer(hz));
+    }
+    // デバイスは1つのエンジンでヘッドレスに実行するときだけ使える
+    //   (副作用があるのでやり直す実行やトレースとは合わず、コンソールは描画と端末を取り合う)
+    unique_ptr<DeviceBus> devices;
+    if (is_devices) {
+        if (is_debug || is_bench || lanes > 0 || trace_file != NULL) {
+            cerr << "--devices is not supported with --debug, --bench, --lanes or --trace" << endl;
+            exit(1);
+        }
+        if (!is_headless && engine_type == EngineType::CLOCK) {
+            cerr << "--devices needs --headless" << endl;
+            exit(1);
+        }
+        devices = create_standard_devices(input_file, block_file, memory.get());
+        cpu->devices = devices.get();
+    }
+    // トレースを書けるのはFastCpuだけ
+    if (trace_file != NULL && engine_type != EngineType::FAST) {
+        cerr << "--trace is supported only by the fast engine" << endl;
+        exit(1);
+    }
+    if (load_snapshot_file != NULL) {
+        // 保存しておいた状態から続きを実行する (上限はスナップショットからではなく通算のクロック数、命令数)
+        MachineSnapshot snapshot;
+        load_snapshot(string(load_snapshot_file), snapshot);
+        restore_snapshot(*cpu, snapshot);
+    } else if (program_file != NULL) {
+        // プログラムをメモリに読み込み、イメージのエントリポイントから実行する
+        //   --benchと--lanesはイメージから何台もマシンを作るので、0番地から始まるプログラムだけにする
+        LoadedProgram program = load_program(memory, string(program_file));
+        if (program.entry != 0 && (is_bench || lanes > 0)) {
+            cerr << "--bench and --lanes need a program whose entry point is 0" << endl;
+            exit(1);
+        }
+        cpu->registers[arch->PC_REG_NUMBER] = program.entry;
+    }
+    // アセンブラがバイナリの横に出力したシンボルファイルがあれば読む
+    shared_ptr<SymbolTable> symbols;
+    string symbol_path = symbol_file != NULL ? string(symbol_file) : "";
+    if (symbol_file == NULL && program_file != NULL && ifstream(string(program_file) + ".sym")) {
+        symbol_path = string(program_file) + ".sym";
+    }
+    if (!symbol_path.empty()) {
+        symbols = shared_ptr<SymbolTable>(new SymbolTable());
+        symbols->load(symbol_path);
+        cpu->symbols = symbols;
+    }
+    auto save_if_requested = [&]() {
+        if (save_snapshot_file != NULL) {
+            MachineSnapshot snapshot;
+            take_snapshot(*cpu, snapshot);
+            save_snapshot(string(save_snapshot_file), snapshot);
+        }
+    };
+
+    if (is_bench && lanes > 0) {
+        run_lockstep_benchmark(arch, memory, limit, lanes, sweep_register);
+        return 0;
+    }
+    if (is_bench) {
+        run_benchmark(arch, memory, limit);
+        run_fast_benchmark(arch, memory, limit);
+        run_snapshot_benchmark(arch, memory);
+        run_time_travel_benchmark(arch, memory, limit, tt_budget);
+        return 0;
+    }
 
-    // クロックを回す
-    while(true) {
-        if (cpu->clock()) {
-            break;
+    // 複数のマシンをレーンとしてまとめて実行し、レーンごとの結果を表示する
+    if (lanes > 0) {
+        auto lockstep = create_lockstep(arch, memory, lanes, sweep_register);
+        RunStats stats = lockstep->run(limit);
+        for (int lane = 0; lane < lockstep->lane_count; lane++) {
+            cout << "RESULT lane=" << lane << " is [" << lockstep->get_memory(lane, 0x64) << "]" << endl;
         }
-        // 人間にわかりやすいようにクロックは0.1秒sleepする
-        usleep(100000);
+        print_stats(cout, stats);
+        return 0;
     }
 
+    // 過去にも戻れるデバッガ (実行はFastCpuで行う)
+    if (is_debug) {
+        cpu->is_headless = true;
+        run_debugger(cpu, symbols, limit, tt_budget);
+        save_if_requested();
+        return 0;
+    }
+
+    // 描画できるのはリファレンスのCpuだけなので、それ以外のエンジンは常にヘッドレスで回す
+    if (is_headless || engine_type != EngineType::CLOCK) {
+        // 描画もsleepもせずに最後まで回す
+        cpu->is_headless = true;
+        auto engine = create_engine(engine_type, cpu);
+        auto fast = dynamic_pointer_cast<FastCpu>(engine);
+        auto pipeline = dynamic_pointer_cast<PipelineCpu>(engine);
+        if (pipeline) {
+            pipeline->config.forwarding = is_forwarding;
+        }
+        shared_ptr<TraceWriter> trace;
+        if (fast) {
+            fast->fuse = is_fuse;
+            fast->unfused_cycles = !is_fused_cycles;
+            if (trace_file != NULL) {
+                trace = shared_ptr<TraceWriter>(new TraceWriter(string(trace_file)));
+                fast->trace = trace.get();
+            }
+        }
+        auto run_engine = [&](RunLimit run_limit) {
+            return pacer ? pacer->run(*engine, *cpu, run_limit) : engine->run(run_limit);
+        };
+        if (devices) {
+            devices->start();
+        }
+        RunStats stats;
+        uint64_t warmup_allocations = 0;
+        uint64_t steady_allocations = 0;
+        uint64_t steady_bytes = 0;
+        if (is_check_allocs) {
+            // 最初の命令までを準備として実行し、その後の実行ではヒープを確保しないことを確かめる
+            RunLimit warmup = limit;
+            if (warmup.max_instructions == 0 || warmup.max_instructions > ALLOCATION_WARMUP_INSTRUCTIONS) {
+                warmup.max_instructions = ALLOCATION_WARMUP_INSTRUCTIONS;
+            }
+            double wall_seconds = 0;
+            {
+                AllocationScope scope;
+                stats = run_engine(warmup);
+                warmup_allocations = scope.get_count();
+            }
+            wall_seconds += stats.wall_seconds;
+            if (stats.halt_reason == HaltReason::INST_LIMIT && warmup.max_instructions != limit.max_instructions) {
+                AllocationScope scope;
+                stats = run_engine(limit);
+                steady_allocations = scope.get_count();
+                steady_bytes = scope.get_bytes();
+                wall_seconds += stats.wall_seconds;
+            }
+            stats.wall_seconds = wall_seconds;
+        } else {
+            stats = run_engine(limit);
+        }
+        if (trace) {
+            trace->close();
+        }
+        if (devices) {
+            // コンソールに残った出力を書き終えてから結果を表示する
+            devices->stop();
+        }
+        cout << "RESULT is [" << memory->memory[0x64] << "]" << endl;
+        print_stats(cout, stats);
+        if (pacer) {
+            print_pace_report(cout, *pacer);
+        }
+        if (trace) {
+            cout << "TRACE records=" << trace->record_count << " bytes=" << trace->byte_count
+                 << " (" << fixed << setprecision(2)
+                 << (trace->record_count > 0 ? (double) trace->byte_count / trace->record_count : 0.0)
+                 << " bytes/inst)" << defaultfloat << endl;
+        }
+        if (pipeline) {
+            print_pipeline_report(cout, *pipeline);
+        }
+        if (cache) {
+            print_cache_report(cout, *cache);
+        }
+        if (branch_unit) {
+            print_branch_report(cout, *branch_unit, 10, symbols.get());
+        }
+        if (devices) {
+            devices->print_report(cout);
+        }
+        if (is_large_memory || memory_image_file != NULL) {
+            print_memory_report(cout, *memory);
+        }
+        if (fast && is_dispatch_report) {
+            print_dispatch_report(cout, fast, stats);
+        }
+        if (is_perf) {
+            print_perf_report(cout, *perf, *arch, 10, symbols.get());
+        }
+        save_if_requested();
+        if (is_check_allocs) {
+            cout << "ALLOCS warmup=" << warmup_allocations << " steady=" << steady_allocations
+                 << " steady-bytes=" << steady_bytes << endl;
+            if (steady_allocations > 0) {
+                cerr << "heap allocations in the steady state" << endl;
+                exit(1);
+            }
+        }
+        // 不正な命令で止まったらレポートを表示してからエラーで終わる
+        return stats.halt_reason == HaltReason::INVALID_OPCODE ? 1 : 0;
+    }
+
+    // クロックは全速で回し、描画のスレッドが一定のフレームレートで状態を写して描く
+    Visualizer visualizer(symbols.get(), fps);
+    cpu->frames = visualizer.get_exchange();
+    visualizer.start(cpu->instruction_counter);
+    RunStats stats = pacer ? pacer->run(*cpu, *cpu, limit) : cpu->run(limit);
+    visualizer.stop(cpu->get_state(), memory->memory);
+    cpu->frames = nullptr;
+
     // 0x64のアドレスは結果表示用とする
     cout << "RESULT is [" << memory->memory[0x64] << "]" << endl;
+    if (pacer) {
+        print_pace_report(cout, *pacer);
+    }
+    if (is_perf) {
+        print_perf_report(cout, *perf, *arch, 10, symbols.get());
+    }
+    if (cache) {
+        print_cache_report(cout, *cache);
+    }
+    if (branch_unit) {
+        print_branch_report(cout, *branch_unit, 10, symbols.get());
+    }
+    save_if_requested();
 
-    return 0;
+    return stats.halt_reason == HaltReason::INVALID_OPCODE ? 1 : 0;
 }
@@ -1,42 +1,235 @@
 #ifndef EMULATOR_MEMORY_HPP
 #define EMULATOR_MEMORY_HPP
 
+#include <iostream>
 #include <memory>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
-const int MEMORY_SIZE = 256;
+// 1ページのワード数
+//   ld, stのアドレスとje, jmpの飛び先は8bitなので、0ページがちょうど命令から直接触れる範囲になる
+const int PAGE_BITS = 8;
+const int PAGE_SIZE = 1 << PAGE_BITS;
+const int PAGE_MASK = PAGE_SIZE - 1;
+// 16bitのアドレス空間のワード数とページ数
+const int ADDRESS_SPACE_SIZE = 1 << 16;
+const int ADDRESS_PAGE_COUNT = ADDRESS_SPACE_SIZE >> PAGE_BITS;
+// 既定のメモリのワード数 (0ページだけ)
+const int MEMORY_SIZE = PAGE_SIZE;
+// バンクの数の上限 (メモリの実体は最大でバンク数 * 65536ワード)
+const int MAX_MEMORY_BANKS = 256;
+
+// 書き込まれていないページは全てこれを指す (読むと0で、書き込むときに確保する)
+inline uint16_t memory_zero_page[PAGE_SIZE] = {0};
 
 enum class MemoryMode {
     READ,
     WRITE
 };
 
+// ページテーブルで実体を引くメモリ
+//   sizeワード (PAGE_SIZEから65536までの2の冪) を16bitのアドレス空間に繰り返し (鏡像で) 見せる
+//   読み込みはpages[アドレスの上位8bit][下位8bit]のシフトと添字だけで、仮想関数も分岐も通らない
+//   ページは初めて書き込むときに確保する (0ページはld, stが直接書くので最初から確保しておく)
+//   bank_countが2以上なら1ページ目より後ろをselect_bankで切り替える (0ページは全てのバンクで共有する)
+//   map_imageするとファイルをmmapしてそのまま実体にするので、書き込みはファイルに残る
 class Memory {
+private:
+    // バンクbankの論理ページpageの実体 (physical[バンク * ページ数 + ページ]、0ページは全てのバンクで0番)
+    vector<uint16_t *> physical;
+    vector<unique_ptr<uint16_t[]>> owned_pages;
+    vector<shared_ptr<void>> borrowed;  // share_pageで借りたページの持ち主 (mmapしたプログラムなど)
+    uint16_t *image = nullptr;  // mmapしたファイル (nullptrでなければphysicalは全てこの中を指す)
+    size_t image_bytes = 0;
+    uint32_t bank = 0;
+
+    uint32_t get_page_count() const {
+        return size >> PAGE_BITS;
+    }
+
+    size_t get_physical_index(uint32_t bank, uint32_t page) const {
+        return page == 0 ? 0 : static_cast<size_t>(bank) * get_page_count() + page;
+    }
+
+    uint16_t *allocate_page(const uint16_t *source) {
+        owned_pages.push_back(unique_ptr<uint16_t[]>(new uint16_t[PAGE_SIZE]));
+        uint16_t *page = owned_pages.back().get();
+        memcpy(page, source, PAGE_SIZE * sizeof(uint16_t));
+        return page;
+    }
+
+    // 今のバンクのページを16bitのアドレス空間全体に並べ直す
+    void update_pages() {
+        uint32_t page_mask = get_page_count() - 1;
+        for (int i = 0; i < ADDRESS_PAGE_COUNT; i++) {
+            pages[i] = physical[get_physical_index(bank, i & page_mask)];
+        }
+        memory = pages[0];
+    }
+
 public:
     MemoryMode mode;
     uint16_t mem_bus_addr;
     uint16_t mem_bus_data;
 
-    uint16_t memory[MEMORY_SIZE] = {0};
-    Memory() {
+    uint32_t size;  // ワード数
+    uint32_t bank_count;
+    uint16_t *pages[ADDRESS_PAGE_COUNT];  // アドレスの上位8bitから今のバンクのページへ
+    uint16_t *memory;  // 0ページ (ld, stで届く範囲)
+    // writeかselect_bankで中身が変わるたびに増える
+    //   命令を翻訳しておくエンジンは、これが変わっていたら翻訳し直す
+    uint64_t generation = 0;
+    int32_t last_write = -1;  // 最後にwriteで書いたアドレス (-1ならバンクの切り替えなど1ワードでない変更)
+
+    Memory(uint32_t size = MEMORY_SIZE, uint32_t bank_count = 1) {
         this->mem_bus_addr = 0;
         this->mem_bus_data = 0;
         this->mode = MemoryMode::READ;
+        this->size = size;
+        this->bank_count = bank_count;
+        this->physical.assign(static_cast<size_t>(bank_count) * get_page_count(), memory_zero_page);
+        this->physical[0] = allocate_page(memory_zero_page);
+        update_pages();
+    }
+
+    // 書き込まれたページだけ複製する (mmapしたファイルは共有せず、複製した側の書き込みはファイルに残らない)
+    Memory(const Memory &other) {
+        this->mem_bus_addr = other.mem_bus_addr;
+        this->mem_bus_data = other.mem_bus_data;
+        this->mode = other.mode;
+        this->size = other.size;
+        this->bank_count = other.bank_count;
+        this->bank = other.bank;
+        this->physical.assign(other.physical.size(), memory_zero_page);
+        for (size_t i = 0; i < physical.size(); i++) {
+            if (i == 0 || other.physical[i] != memory_zero_page) {
+                physical[i] = allocate_page(other.physical[i]);
+            }
+        }
+        update_pages();
+    }
+
+    Memory &operator=(const Memory &) = delete;
+
+    ~Memory() {
+        if (image) {
+            munmap(image, image_bytes);
+        }
+    }
+
+    uint16_t read(uint16_t addr) const {
+        return pages[addr >> PAGE_BITS][addr & PAGE_MASK];
+    }
+
+    // ページがまだなければ確保してから書く
+    void write(uint16_t addr, uint16_t value) {
+        uint16_t *&page = physical[get_physical_index(bank, (addr >> PAGE_BITS) & (get_page_count() - 1))];
+        if (page == memory_zero_page) {
+            page = allocate_page(memory_zero_page);
+            update_pages();
+        }
+        page[addr & PAGE_MASK] = value;
+        generation++;
+        last_write = addr & (size - 1);
     }
 
     void access(uint16_t* mar, uint16_t* mdr) {
         if (this->mode == MemoryMode::READ) {
             mem_bus_addr = *mar;
-            mem_bus_data = this->memory[mem_bus_addr];
+            mem_bus_data = read(mem_bus_addr);
             *mdr = mem_bus_data;
         } else {
             mem_bus_data = *mdr;
             mem_bus_addr = *mar;
-            this->memory[mem_bus_addr] = mem_bus_data;
+            write(mem_bus_addr, mem_bus_data);
         }
     }
 
+    // 他のバッファのPAGE_SIZEワードを、addrを含むページの実体としてそのまま使う (コピーしない)
+    //   ownerはそのバッファの持ち主で、このMemoryがなくなるまで持っておく
+    void share_page(uint16_t addr, uint16_t *words, shared_ptr<void> owner) {
+        physical[get_physical_index(bank, (addr >> PAGE_BITS) & (get_page_count() - 1))] = words;
+        borrowed.push_back(owner);
+        update_pages();
+        generation++;
+        last_write = -1;
+    }
+
+    uint32_t get_bank() const {
+        return bank;
+    }
+
+    // 1ページ目より後ろを別のバンクにする (範囲外はバンク数で折り返す)
+    void select_bank(uint32_t bank) {
+        this->bank = bank % bank_count;
+        update_pages();
+        generation++;
+        last_write = -1;
+    }
+
+    // 確保したか、ファイルに割り当てたページの数
+    size_t get_resident_pages() const {
+        size_t count = 0;
+        for (auto page: physical) {
+            if (page != memory_zero_page) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    bool is_mapped() const {
+        return image != nullptr;
+    }
+
+    // ファイルをmmapしてメモリの実体にする (バンク順に並べ、足りなければ0で伸ばす)
+    //   今までの中身は捨てるので、プログラムを読み込む前に呼ぶ
+    void map_image(string file_path) {
+        size_t bytes = physical.size() * PAGE_SIZE * sizeof(uint16_t);
+        int fd = open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "can not open " << file_path << endl;
+            exit(1);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (static_cast<size_t>(st.st_size) < bytes && ftruncate(fd, bytes) != 0)) {
+            cerr << "can not resize " << file_path << endl;
+            exit(1);
+        }
+        void *mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            cerr << "can not map " << file_path << endl;
+            exit(1);
+        }
+        if (image) {
+            munmap(image, image_bytes);
+        }
+        image = static_cast<uint16_t *>(mapped);
+        image_bytes = bytes;
+        for (size_t i = 0; i < physical.size(); i++) {
+            physical[i] = image + i * PAGE_SIZE;
+        }
+        owned_pages.clear();
+        borrowed.clear();
+        update_pages();
+        generation++;
+        last_write = -1;
+    }
 };
 
+// メモリの大きさと、確保したページの数を表示する
+inline void print_memory_report(ostream &os, const Memory &memory) {
+    os << "MEMORY size=" << memory.size << " banks=" << memory.bank_count << " bank=" << memory.get_bank()
+       << " resident-pages=" << memory.get_resident_pages() << "/" << memory.bank_count * (memory.size >> PAGE_BITS)
+       << " mapped=" << (memory.is_mapped() ? "yes" : "no") << endl;
+}
+
 #endif //EMULATOR_MEMORY_HPP
@@ -0,0 +1,117 @@
+#ifndef EMULATOR_PACER_HPP
+#define EMULATOR_PACER_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+#include "engine.hpp"
+#include "cpu.hpp"
+
+using namespace std;
+
+// 1回のペース合わせで進めるゲストの時間 (この分のクロックをまとめて実行してから時刻を合わせる)
+const double PACE_BATCH_SECONDS = 0.001;
+// 期限のこれより手前まではsleepし、残りはスピンで待つ (sleepの寝過ごしを吸収する)
+const double PACE_SPIN_SECONDS = 0.0002;
+
+// エンジンを指定したクロック周波数に合わせて実行する
+//   batch_cyclesずつ実行し、開始からのクロック数/hzの時刻までmonotonicな時計で待つ
+//   期限は開始時刻からの絶対時刻なので、待ちの誤差は次の期限に積み重ならない
+//   エンジンが間に合わなかったときは待たずに次を実行する (lateに数える)
+class Pacer {
+private:
+    // 期限までsleepしてからスピンで待ち、期限から実際に起きた時刻までの遅れを返す
+    static double wait_until(chrono::steady_clock::time_point deadline) {
+        auto now = chrono::steady_clock::now();
+        auto spin = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(PACE_SPIN_SECONDS));
+        if (deadline - now > spin) {
+            this_thread::sleep_until(deadline - spin);
+        }
+        while ((now = chrono::steady_clock::now()) < deadline) {
+            // spin
+        }
+        return chrono::duration<double>(now - deadline).count();
+    }
+
+public:
+    double hz;
+    uint64_t batch_cycles;
+
+    // 全てのrunの合計
+    uint64_t cycles = 0;
+    double wall_seconds = 0;
+    uint64_t batches = 0;
+    uint64_t late_batches = 0;  // エンジンの実行が期限に間に合わなかった回数
+    double error_sum = 0;  // 期限からの遅れ (秒) の合計、二乗和、最大
+    double error_square_sum = 0;
+    double error_max = 0;
+
+    Pacer(double hz) {
+        this->hz = hz;
+        this->batch_cycles = max<uint64_t>(1, static_cast<uint64_t>(hz * PACE_BATCH_SECONDS));
+    }
+
+    // limitかhltまでをhzに合わせて実行する
+    //   cpuは実行を始める時点のクロック数を知るためだけに使う
+    RunStats run(Engine &engine, const Cpu &cpu, RunLimit limit) {
+        RunStats stats;
+        const uint64_t start_cycles = cpu.clock_counter - 1;
+        const auto start = chrono::steady_clock::now();
+        uint64_t target = start_cycles;
+        while (true) {
+            target += batch_cycles;
+            RunLimit batch = limit;
+            if (limit.max_cycles == 0 || limit.max_cycles > target) {
+                batch.max_cycles = target;
+            }
+            stats = engine.run(batch);
+            // エンジンは命令の境界で止まるので、実際に進んだクロック数から期限を決める
+            target = max(target, stats.cycles);
+            auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                    chrono::duration<double>((stats.cycles - start_cycles) / hz));
+            if (chrono::steady_clock::now() > deadline) {
+                late_batches++;
+            }
+            double error = wait_until(deadline);
+            batches++;
+            error_sum += error;
+            error_square_sum += error * error;
+            error_max = max(error_max, error);
+
+            if (stats.halt_reason == HaltReason::HLT || stats.halt_reason == HaltReason::INST_LIMIT
+                || stats.halt_reason == HaltReason::INVALID_OPCODE) {
+                break;
+            }
+            if (limit.max_cycles > 0 && stats.cycles >= limit.max_cycles) {
+                break;
+            }
+        }
+        stats.wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cycles += stats.cycles - start_cycles;
+        wall_seconds += stats.wall_seconds;
+        return stats;
+    }
+
+    double get_achieved_hz() const {
+        return wall_seconds > 0 ? cycles / wall_seconds : 0;
+    }
+};
+
+// 目標と実際の周波数と、期限からの遅れ (ジッタ) を表示する
+inline void print_pace_report(ostream &os, const Pacer &pacer) {
+    double mean = pacer.batches > 0 ? pacer.error_sum / pacer.batches : 0;
+    double variance = pacer.batches > 0 ? pacer.error_square_sum / pacer.batches - mean * mean : 0;
+    os << "PACE target=" << fixed << setprecision(1) << pacer.hz << "Hz"
+       << " achieved=" << pacer.get_achieved_hz() << "Hz"
+       << " (" << setprecision(2) << (pacer.hz > 0 ? 100.0 * pacer.get_achieved_hz() / pacer.hz : 0.0) << "%)"
+       << " batch=" << pacer.batch_cycles << " batches=" << pacer.batches
+       << " late=" << pacer.late_batches << defaultfloat << endl;
+    os << "PACE jitter mean=" << fixed << setprecision(1) << mean * 1e6 << "us"
+       << " stddev=" << sqrt(max(variance, 0.0)) * 1e6 << "us"
+       << " max=" << pacer.error_max * 1e6 << "us" << defaultfloat << endl;
+}
+
+#endif //EMULATOR_PACER_HPP
@@ -0,0 +1,158 @@
+#ifndef EMULATOR_PERF_COUNTERS_HPP
+#define EMULATOR_PERF_COUNTERS_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "memory.hpp"
+#include "arch.hpp"
+#include "symbols.hpp"
+
+using namespace std;
+
+// 0にするとパフォーマンスカウンタを数えるコードを全てのエンジンから取り除く
+#ifndef EMULATOR_ENABLE_PERF_COUNTERS
+#define EMULATOR_ENABLE_PERF_COUNTERS 1
+#endif
+constexpr bool PERF_COUNTERS_AVAILABLE = EMULATOR_ENABLE_PERF_COUNTERS;
+
+// CpuStatusの数と名前 (CpuStatusと同じ並び)
+const int PERF_PHASE_COUNT = 6;
+const char *const PERF_PHASE_NAMES[PERF_PHASE_COUNT] = {
+        "FETCH_INST_0", "FETCH_INST_1", "FETCH_OPERAND_0", "FETCH_OPERAND_1", "EXEC_INST", "WRITE_BACK"
+};
+
+// ハードウェアのパフォーマンスカウンタ
+//   Cpuはクロックごとに、FastCpuは命令ごとに数える
+//   FastCpuにはステータスがないので、ステータスごとのクロック数とメモリアクセスは命令の種類から求める
+struct PerfCounters {
+    uint64_t retired[INSTRUCTION_TYPE_COUNT];  // 種類ごとのリタイアした命令数
+    uint64_t phase_cycles[PERF_PHASE_COUNT];  // ステータスごとのクロック数
+    uint64_t memory_reads;  // Memory::accessでの読み込み (命令フェッチとld)
+    uint64_t memory_writes;  // Memory::accessでの書き込み (st)
+    uint64_t je_taken;
+    uint64_t je_not_taken;
+    uint64_t pc_histogram[ADDRESS_SPACE_SIZE];  // アドレスごとの実行回数 (PCは16bitなのでアドレス空間全体)
+    uint64_t pc_cycles[ADDRESS_SPACE_SIZE];  // アドレスごとのクロック数
+    uint16_t current_pc;  // Cpuがクロックを数えている命令のアドレス
+
+    PerfCounters() {
+        reset();
+    }
+
+    void reset() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    uint64_t get_retired_total() const {
+        uint64_t total = 0;
+        for (auto count: retired) {
+            total += count;
+        }
+        return total;
+    }
+
+    // typeの命令count個をCpu::clockで実行した場合のステータスごとのクロック数とメモリアクセスを足す
+    //   FETCH_INST_0, FETCH_INST_1(フェッチ), FETCH_OPERAND_0, EXEC_INSTは全ての命令で1クロック
+    //   ld, stはFETCH_OPERAND_1が1クロック、hlt以外はWRITE_BACKが1クロック
+    void add_phases_of(InstructionType type, uint64_t count) {
+        phase_cycles[0] += count;
+        phase_cycles[1] += count;
+        phase_cycles[2] += count;
+        phase_cycles[4] += count;
+        memory_reads += count;
+        if (type == InstructionType::LD || type == InstructionType::ST) {
+            phase_cycles[3] += count;
+        }
+        if (type != InstructionType::HLT) {
+            phase_cycles[5] += count;
+        }
+        if (type == InstructionType::LD) {
+            memory_reads += count;
+        }
+        if (type == InstructionType::ST) {
+            memory_writes += count;
+        }
+    }
+};
+
+// カウンタの内容を表示する (hot_countは実行回数の多い順に表示するアドレスの数)
+//   symbolsがあればアドレスをラベルと行番号で表し、ラベルごとの命令数とクロック数も表示する
+inline void print_perf_report(ostream &os, const PerfCounters &perf, CpuArch &arch, int hot_count = 10,
+                              const SymbolTable *symbols = nullptr) {
+    uint64_t total = perf.get_retired_total();
+    os << "PERF retired total=" << total << endl;
+    os << "PERF retired";
+    for (int i = 0; i < INSTRUCTION_TYPE_COUNT; i++) {
+        if (perf.retired[i] == 0) {
+            continue;
+        }
+        os << " " << arch.get_inst_by_type(static_cast<InstructionType>(i)).mnemonic << "=" << perf.retired[i];
+    }
+    os << endl;
+    os << "PERF phase";
+    for (int i = 0; i < PERF_PHASE_COUNT; i++) {
+        os << " " << PERF_PHASE_NAMES[i] << "=" << perf.phase_cycles[i];
+    }
+    os << endl;
+    os << "PERF memory reads=" << perf.memory_reads << " writes=" << perf.memory_writes << endl;
+    os << "PERF je taken=" << perf.je_taken << " not-taken=" << perf.je_not_taken << endl;
+
+    vector<int> addrs;
+    for (int addr = 0; addr < ADDRESS_SPACE_SIZE; addr++) {
+        if (perf.pc_histogram[addr] > 0) {
+            addrs.push_back(addr);
+        }
+    }
+    stable_sort(addrs.begin(), addrs.end(), [&](int a, int b) {
+        return perf.pc_histogram[a] > perf.pc_histogram[b];
+    });
+    if (addrs.size() > hot_count) {
+        addrs.resize(hot_count);
+    }
+    for (int addr: addrs) {
+        os << "PERF hot pc=0x" << hex << setw(2) << setfill('0') << addr << dec << setfill(' ');
+        if (symbols) {
+            os << " " << symbols->describe(addr);
+        }
+        os << " count=" << perf.pc_histogram[addr]
+           << " cycles=" << perf.pc_cycles[addr]
+           << " (" << fixed << setprecision(1) << 100.0 * perf.pc_histogram[addr] / total << "%)"
+           << defaultfloat << endl;
+    }
+    if (!symbols) {
+        return;
+    }
+
+    // ラベルの範囲ごとに集計する (ラベルより前やコードの外は"-"にまとめる)
+    uint64_t total_cycles = 0;
+    for (auto cycles: perf.pc_cycles) {
+        total_cycles += cycles;
+    }
+    vector<uint64_t> symbol_insts(symbols->symbols.size() + 1, 0);
+    vector<uint64_t> symbol_cycles(symbols->symbols.size() + 1, 0);
+    for (int addr = 0; addr < ADDRESS_SPACE_SIZE; addr++) {
+        if (perf.pc_histogram[addr] == 0 && perf.pc_cycles[addr] == 0) {
+            continue;
+        }
+        const Symbol *symbol = symbols->find(addr);
+        int index = symbol ? symbol - &symbols->symbols[0] : symbols->symbols.size();
+        symbol_insts[index] += perf.pc_histogram[addr];
+        symbol_cycles[index] += perf.pc_cycles[addr];
+    }
+    for (int i = 0; i < symbol_insts.size(); i++) {
+        if (symbol_insts[i] == 0 && symbol_cycles[i] == 0) {
+            continue;
+        }
+        os << "PERF label " << (i < symbols->symbols.size() ? symbols->symbols[i].name : "-")
+           << " instructions=" << symbol_insts[i]
+           << " cycles=" << symbol_cycles[i]
+           << " (" << fixed << setprecision(1)
+           << (total_cycles > 0 ? 100.0 * symbol_cycles[i] / total_cycles : 0.0) << "%)"
+           << defaultfloat << endl;
+    }
+}
+
+#endif //EMULATOR_PERF_COUNTERS_HPP
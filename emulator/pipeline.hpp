@@ -0,0 +1,401 @@
+#ifndef EMULATOR_PIPELINE_HPP
+#define EMULATOR_PIPELINE_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include "cpu.hpp"
+#include "engine.hpp"
+#include "arch.hpp"
+#include "decode.hpp"
+#include "branch_predictor.hpp"
+
+using namespace std;
+
+// パイプラインのステージ (IF, ID, EX, MEM, WBの5段)
+const int PIPELINE_STAGE_COUNT = 5;
+
+// パイプラインのモデルの設定
+struct PipelineConfig {
+    bool forwarding = true;  // falseならEXの結果を次の命令に回さず、WBでレジスタに書くまで待つ
+};
+
+// パイプラインで余分にかかったクロック数の内訳
+//   cycles = instructions + fill + stall_* + flush_* になる (stall_*には--cacheでミスを待ったstall_fetch, stall_memoryも入る)
+struct PipelineStats {
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    uint64_t fill = 0;  // 空のパイプラインに最初の命令を流してWBまで進める分
+    uint64_t stall_load_use = 0;  // ldの結果を次の命令が使うのでMEMを待った分 (フォワーディングありのとき)
+    uint64_t stall_raw_register = 0;  // r0-r4, r6の値ができるのを待った分
+    uint64_t stall_raw_psw = 0;  // PSW(r5)の値ができるのを待った分
+    uint64_t flush_je = 0;  // 分岐したjeの後ろにフェッチした命令を捨てた分
+    uint64_t flush_jmp = 0;
+    uint64_t flush_pc_write = 0;  // je, jmp以外でPC(r7)に書いた命令の後ろを捨てた分
+    uint64_t stall_fetch = 0;  // 命令キャッシュのミスでIFに留まった分
+    uint64_t stall_memory = 0;  // データキャッシュのミスで前の命令がMEMに留まった分
+    uint64_t multi_cycle_cycles = 0;  // 同じ命令をCpu::clockの順番に実行した場合のクロック数
+
+    uint64_t get_stall_total() const {
+        return stall_load_use + stall_raw_register + stall_raw_psw + stall_fetch + stall_memory;
+    }
+
+    uint64_t get_flush_total() const {
+        return flush_je + flush_jmp + flush_pc_write;
+    }
+};
+
+// 古典的な5段パイプライン (IF, ID, EX, MEM, WB) で実行した場合のクロック数を見積もるエンジン
+//   命令は1つずつ順番に実行してアーキテクチャ上の結果はCpu::clockと一致させ、クロック数だけをパイプラインで数える
+//   各段は1クロックで、命令フェッチとldのメモリアクセスは別のポートで行う (構造ハザードはない)
+//   cpu->cacheがあれば、IFとMEMはキャッシュのミスで余分にかかるクロック数だけその段に留まる
+//   レジスタのRAWハザードはIDで止めて待つ
+//     フォワーディングありなら、演算の結果はEXの次のクロックから、ldの結果はMEMの次のクロックから使える
+//     なしならWBでレジスタに書いたクロックにIDで読める (前半で書いて後半で読む)
+//   分岐はcpu->branch_unitで予測する (なければ「分岐しない」と予測して次のアドレスをフェッチし続ける)
+//     jeの向きを外したらZを読むEXで分かるので、それまでにフェッチした命令を捨てる (2クロック)
+//     分岐すると正しく予測してもBTBに分岐先がなければ、分岐先はIDで分かる (1クロック、jmpも同じ)
+//     je, jmp以外でPCに書く命令はPCに書く値が分かる段 (演算はEX、ldはMEM) まで後ろの命令を捨てる
+//   PCを読む命令は、PCの値(次の命令のアドレス)がフェッチの時点で分かっているので待たない
+//   stで書き換えた命令がすでにフェッチされている場合も、命令は書き換えた後の値で実行する
+//   cpu->clock_counterはパイプラインのクロック数で進める (命令ごとに、その命令がWBを終えたクロック)
+class PipelineCpu : public Engine {
+private:
+    // 各段に命令が入るクロック (絶対値、clock_counterと同じ数え方)
+    //   next_fetchは次の命令をフェッチできる最初のクロック、last_exは前の命令がEXにいたクロック
+    uint64_t next_fetch = 0;
+    uint64_t last_ex = 0;
+    uint64_t last_memory_end = 0;  // 前の命令がMEMを空けるクロック
+    uint64_t ready[CpuArch::REGISTER_COUNT];  // レジスタの値を使う命令がEXに入れる最初のクロック
+    bool is_load_result[CpuArch::REGISTER_COUNT];  // レジスタに最後に書いたのがldか
+    uint64_t *pending_flush = nullptr;  // 次の命令の前に捨てた分を数えるカウンタ
+    int pending_branch = -1;  // 次の命令の前に捨てた分を数える分岐命令のアドレス
+    uint64_t expected_clock = 0;  // 前回の実行を終えたときのclock_counter
+
+    // 空のパイプラインで次の命令をclock_counterのクロックからフェッチする状態にする
+    void reset_pipeline() {
+        next_fetch = cpu->clock_counter;
+        last_ex = 0;
+        last_memory_end = 0;
+        fill(ready, ready + CpuArch::REGISTER_COUNT, 0);
+        fill(is_load_result, is_load_result + CpuArch::REGISTER_COUNT, false);
+        pending_flush = nullptr;
+        pending_branch = -1;
+    }
+
+public:
+    shared_ptr<Cpu> cpu;
+    PipelineConfig config;
+    PipelineStats stats;  // 作ってからの累計
+
+    PipelineCpu() {
+
+    }
+    PipelineCpu(shared_ptr<Cpu> cpu) {
+        this->cpu = cpu;
+    }
+
+    RunStats run(RunLimit limit) override {
+        RunStats run_stats;
+        auto start = chrono::steady_clock::now();
+
+        // マイクロステップの途中から呼ばれた場合は命令の境界までリファレンスで進める
+        bool is_hlt = cpu->finish_instruction();
+        // 他のエンジンがCpuを進めていたらパイプラインは空から始める
+        if (cpu->clock_counter != expected_clock) {
+            reset_pipeline();
+        }
+
+        uint16_t *regs = cpu->registers;
+        uint16_t *mem = cpu->memory->memory;
+        const Memory &memory = *cpu->memory;
+        const int pc = cpu->arch->PC_REG_NUMBER;
+        const int psw = cpu->arch->PSW_REG_NUMBER;
+        const DecodeTable *decode_table = cpu->decode_table;
+        CacheHierarchy *cache = cpu->cache;
+        DeviceBus *devices = cpu->devices;
+        BranchUnit *branch_unit = cpu->branch_unit;
+        uint64_t clock_counter = cpu->clock_counter;
+        uint64_t instruction_counter = cpu->instruction_counter;
+
+        // 上限の判定は命令の境界で行う (0なら無制限)
+        const uint64_t cycle_end = limit.max_cycles > 0 ? limit.max_cycles + 1 : numeric_limits<uint64_t>::max();
+        const uint64_t inst_end = limit.max_instructions > 0 ? limit.max_instructions : numeric_limits<uint64_t>::max();
+        while (!is_hlt) {
+            if (clock_counter >= cycle_end) {
+                run_stats.halt_reason = HaltReason::CYCLE_LIMIT;
+                break;
+            }
+            if (instruction_counter >= inst_end) {
+                run_stats.halt_reason = HaltReason::INST_LIMIT;
+                break;
+            }
+
+            const DecodedInst &inst = decode_table->decode(memory.read(regs[pc]));
+            if (!inst.is_valid) {
+                cerr << "invalid opcode " << static_cast<int>(inst.opcode) << endl;
+                run_stats.halt_reason = HaltReason::INVALID_OPCODE;
+                break;
+            }
+            uint16_t first_operand = inst.first_operand;
+            uint16_t second_operand = inst.second_operand;
+            uint16_t source = second_operand >> 5;
+
+            // 読むレジスタと書くレジスタ (-1ならなし)
+            int reads[3] = {-1, -1, -1};
+            int write = -1;
+            switch (inst.type) {
+                case InstructionType::MOV:
+                    reads[0] = source;
+                    write = first_operand;
+                    break;
+                case InstructionType::ADD:
+                case InstructionType::SUB:
+                case InstructionType::AND:
+                case InstructionType::OR:
+                    reads[0] = first_operand;
+                    reads[1] = source;
+                    write = first_operand;
+                    break;
+                case InstructionType::SL:
+                case InstructionType::SR:
+                case InstructionType::LDL:
+                case InstructionType::LDH:
+                    // ldl, ldhは今の値にORするので読む
+                    reads[0] = first_operand;
+                    write = first_operand;
+                    break;
+                case InstructionType::CMP:
+                    // N, Z以外のbitは残すのでPSWも読む
+                    reads[0] = first_operand;
+                    reads[1] = source;
+                    reads[2] = psw;
+                    write = psw;
+                    break;
+                case InstructionType::JE:
+                    reads[0] = psw;
+                    break;
+                case InstructionType::LD:
+                    write = first_operand;
+                    break;
+                case InstructionType::ST:
+                    reads[0] = first_operand;
+                    break;
+                default:
+                    break;
+            }
+
+            // 各段に入るクロックを決める
+            uint64_t fetch_cycle = next_fetch;
+            if (last_ex == 0) {
+                stats.fill += PIPELINE_STAGE_COUNT - 1;
+            }
+            uint64_t fetch_penalty = cache ? cache->fetch(regs[pc]) : 0;
+            uint64_t decode_cycle = max(fetch_cycle + 1, last_ex);  // 前の命令がIDを空けるまでIFで待つ
+            if (last_ex != 0 && decode_cycle > last_ex && pending_flush) {
+                *pending_flush += decode_cycle - last_ex;
+                if (pending_branch >= 0) {
+                    branch_unit->branches[pending_branch].penalty_cycles += decode_cycle - last_ex;
+                }
+            }
+            pending_flush = nullptr;
+            pending_branch = -1;
+            if (fetch_penalty > 0) {
+                uint64_t delayed = max(fetch_cycle + 1 + fetch_penalty, last_ex);
+                stats.stall_fetch += delayed - decode_cycle;
+                decode_cycle = delayed;
+            }
+            uint64_t issue_cycle = decode_cycle + 1;
+            uint64_t exec_cycle = issue_cycle;
+            int blocking = -1;
+            for (int read: reads) {
+                if (read >= 0 && read != pc && ready[read] > exec_cycle) {
+                    exec_cycle = ready[read];
+                    blocking = read;
+                }
+            }
+            if (blocking >= 0) {
+                uint64_t stall = exec_cycle - issue_cycle;
+                if (config.forwarding && is_load_result[blocking]) {
+                    stats.stall_load_use += stall;
+                } else if (blocking == psw) {
+                    stats.stall_raw_psw += stall;
+                } else {
+                    stats.stall_raw_register += stall;
+                }
+            }
+            // 前の命令がMEMに留まっている間はEXから進めない
+            if (last_memory_end > exec_cycle) {
+                stats.stall_memory += last_memory_end - exec_cycle;
+                exec_cycle = last_memory_end;
+            }
+            uint64_t memory_penalty = 0;
+            // デバイスに割り当てたアドレスはキャッシュを通さない
+            bool is_device = (inst.type == InstructionType::LD || inst.type == InstructionType::ST)
+                             && devices && devices->is_mapped(second_operand);
+            if (is_device) {
+                // pass
+            } else if (cache && inst.type == InstructionType::LD) {
+                memory_penalty = cache->load(second_operand);
+            } else if (cache && inst.type == InstructionType::ST) {
+                memory_penalty = cache->store(second_operand);
+            }
+            uint64_t memory_cycle = exec_cycle + 1;
+            uint64_t write_back_cycle = memory_cycle + memory_penalty + 1;
+            last_memory_end = write_back_cycle - 1;
+            // 次の命令はこの命令がIFを空けたクロックからフェッチできる
+            next_fetch = decode_cycle;
+            last_ex = exec_cycle;
+
+            // アーキテクチャ上の実行 (FastCpuのeagerなフラグと同じ)
+            uint16_t inst_pc = regs[pc];
+            regs[pc]++;
+            bool is_taken = false;
+            switch (inst.type) {
+                case InstructionType::MOV:
+                    regs[first_operand] = regs[source];
+                    break;
+                case InstructionType::ADD:
+                    regs[first_operand] = regs[first_operand] + regs[source];
+                    break;
+                case InstructionType::SUB:
+                    regs[first_operand] = regs[first_operand] - regs[source];
+                    break;
+                case InstructionType::AND:
+                    regs[first_operand] = regs[first_operand] & regs[source];
+                    break;
+                case InstructionType::OR:
+                    regs[first_operand] = regs[first_operand] | regs[source];
+                    break;
+                case InstructionType::SL:
+                    regs[first_operand] = regs[first_operand] << 1;
+                    break;
+                case InstructionType::SR:
+                    regs[first_operand] = regs[first_operand] >> 1;
+                    break;
+                case InstructionType::LDL:
+                    regs[first_operand] |= second_operand;
+                    break;
+                case InstructionType::LDH:
+                    regs[first_operand] |= second_operand << 8;
+                    break;
+                case InstructionType::CMP:
+                    if (static_cast<uint16_t>(regs[first_operand] - regs[source]) == 0) {
+                        regs[psw] |= 0b0100000000000000;
+                    } else {
+                        regs[psw] &= 0b0011111111111111;
+                    }
+                    break;
+                case InstructionType::JE:
+                    is_taken = (regs[psw] >> 14) & 0x1;
+                    if (is_taken) {
+                        regs[pc] = second_operand;
+                    }
+                    break;
+                case InstructionType::JMP:
+                    is_taken = true;
+                    regs[pc] = second_operand;
+                    break;
+                case InstructionType::LD:
+                    regs[first_operand] = is_device ? devices->read(second_operand) : mem[second_operand];
+                    break;
+                case InstructionType::ST:
+                    if (is_device) {
+                        devices->write(second_operand, regs[first_operand]);
+                    } else {
+                        mem[second_operand] = regs[first_operand];
+                    }
+                    break;
+                case InstructionType::HLT:
+                    is_hlt = true;
+                    break;
+            }
+
+            // 分岐先が分かる段の次のクロックまでフェッチをやり直す
+            if (inst.type == InstructionType::JE || inst.type == InstructionType::JMP) {
+                // 予測器がなければjeは分岐しない、jmpは分岐すると予測してBTBはないものとする
+                bool is_jmp = inst.type == InstructionType::JMP;
+                BranchOutcome outcome = {is_jmp, !is_jmp && is_taken, false};
+                if (branch_unit) {
+                    outcome = branch_unit->resolve(inst_pc, inst.type, is_taken, second_operand);
+                    pending_branch = inst_pc;
+                }
+                if (outcome.is_mispredicted) {
+                    next_fetch = max(next_fetch, exec_cycle + 1);
+                } else if (is_taken && !outcome.is_target_known) {
+                    next_fetch = max(next_fetch, decode_cycle + 1);
+                }
+                pending_flush = inst.type == InstructionType::JE ? &stats.flush_je : &stats.flush_jmp;
+            } else if (write == pc) {
+                next_fetch = max(next_fetch, (inst.type == InstructionType::LD ? write_back_cycle : exec_cycle + 1));
+                pending_flush = &stats.flush_pc_write;
+            }
+            if (write >= 0 && write != pc) {
+                if (!config.forwarding) {
+                    ready[write] = write_back_cycle + 1;
+                } else if (inst.type == InstructionType::LD) {
+                    ready[write] = write_back_cycle;
+                } else {
+                    ready[write] = exec_cycle + 1;
+                }
+                is_load_result[write] = inst.type == InstructionType::LD;
+            }
+
+            clock_counter = write_back_cycle + 1;
+            instruction_counter++;
+            stats.instructions++;
+            // Cpu::clockもキャッシュのミスでは同じだけ待つ
+            stats.multi_cycle_cycles += inst.cycles + fetch_penalty + memory_penalty;
+        }
+
+        // 次の実行はこの続きのパイプラインから始める
+        expected_clock = clock_counter;
+        stats.cycles += clock_counter - cpu->clock_counter;
+        cpu->clock_counter = clock_counter;
+        cpu->instruction_counter = instruction_counter;
+        // hltで止まった場合はCpu::clockと同じくWRITE_BACKで止まった状態にしておく
+        cpu->current_status = is_hlt ? CpuStatus::WRITE_BACK : CpuStatus::FETCH_INST_0;
+
+        auto end = chrono::steady_clock::now();
+        run_stats.cycles = clock_counter - 1;
+        run_stats.instructions = instruction_counter;
+        run_stats.wall_seconds = chrono::duration<double>(end - start).count();
+        return run_stats;
+    }
+};
+
+// CPIと、余分にかかったクロック数の内訳を表示する
+inline void print_pipeline_report(ostream &os, const PipelineCpu &pipeline) {
+    const PipelineStats &stats = pipeline.stats;
+    auto per_inst = [&](uint64_t cycles) {
+        return stats.instructions > 0 ? (double) cycles / stats.instructions : 0.0;
+    };
+    os << "PIPE cycles=" << stats.cycles
+       << " instructions=" << stats.instructions
+       << " CPI=" << fixed << setprecision(3) << per_inst(stats.cycles)
+       << " forwarding=" << (pipeline.config.forwarding ? "on" : "off") << defaultfloat << endl;
+    os << "PIPE fill=" << stats.fill
+       << " stalls=" << stats.get_stall_total()
+       << " (load-use=" << stats.stall_load_use
+       << " raw-reg=" << stats.stall_raw_register
+       << " raw-psw=" << stats.stall_raw_psw
+       << " fetch=" << stats.stall_fetch
+       << " memory=" << stats.stall_memory << ")"
+       << " flushes=" << stats.get_flush_total()
+       << " (je=" << stats.flush_je
+       << " jmp=" << stats.flush_jmp
+       << " pc-write=" << stats.flush_pc_write << ")" << endl;
+    os << "PIPE CPI ideal=1.000"
+       << " +stall=" << fixed << setprecision(3) << per_inst(stats.get_stall_total())
+       << " +flush=" << per_inst(stats.get_flush_total())
+       << " +fill=" << per_inst(stats.fill) << defaultfloat << endl;
+    os << "PIPE multi-cycle cycles=" << stats.multi_cycle_cycles
+       << " CPI=" << fixed << setprecision(3) << per_inst(stats.multi_cycle_cycles)
+       << " speedup=" << setprecision(2)
+       << (stats.cycles > 0 ? (double) stats.multi_cycle_cycles / stats.cycles : 0.0) << "x" << defaultfloat << endl;
+}
+
+#endif //EMULATOR_PIPELINE_HPP
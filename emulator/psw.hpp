@@ -44,4 +44,34 @@ public:
         return (*(this->reg_psw) >> 14) & 0x1;
     }
 };
+
+// cmpの結果をr5に書かずに覚えておき、r5が読まれるときに初めてN/Zを書き込むPSW
+//   反映していないcmpの効果は「and_maskでbitを落としてor_maskでbitを立てる」にまとめておく
+//   jeはr5にこの効果をかけた値からZを読むのでr5を読み書きしない
+class LazyPsw {
+public:
+    uint16_t and_mask = 0xffff;
+    uint16_t or_mask = 0;
+
+    // Alu::calcのCMPと同じく、0ならZを立て(Nはそのまま)、0でなければNとZを0にする
+    void record_cmp(uint16_t result) {
+        if (result == 0) {
+            or_mask = 0b0100000000000000;
+        } else {
+            and_mask = 0b0011111111111111;
+            or_mask = 0;
+        }
+    }
+
+    bool get_zero_flag(uint16_t reg_psw) const {
+        return (((reg_psw & and_mask) | or_mask) >> 14) & 0x1;
+    }
+
+    void materialize(uint16_t &reg_psw) {
+        reg_psw = (reg_psw & and_mask) | or_mask;
+        and_mask = 0xffff;
+        or_mask = 0;
+    }
+};
+
 #endif //EMULATOR_PSW_HPP
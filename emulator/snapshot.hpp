@@ -0,0 +1,90 @@
+#ifndef EMULATOR_SNAPSHOT_HPP
+#define EMULATOR_SNAPSHOT_HPP
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <cstring>
+#include <type_traits>
+#include "cpu.hpp"
+#include "memory.hpp"
+
+using namespace std;
+
+// マシン全体 (Cpuの状態とメモリ) のスナップショット
+//   ポインタを含まない1つのブロックなので、保存も復元も構造体の代入1回で済む
+//   命令が書き込めるのは0ページだけなので、1ページ目より後ろは持たない (実行中に変わらない)
+struct MachineSnapshot {
+    CpuState cpu;
+    uint16_t memory[MEMORY_SIZE];
+};
+static_assert(is_trivially_copyable<MachineSnapshot>::value, "MachineSnapshot must be trivially copyable");
+
+// スナップショットファイルのヘッダ
+//   本体はMachineSnapshotをホストのレイアウトのまま書くので、sizeが違うファイルは読まない
+struct SnapshotHeader {
+    char magic[4];  // "TCSN"
+    uint32_t version;
+    uint32_t size;  // sizeof(MachineSnapshot)
+    uint32_t memory_size;  // MEMORY_SIZE
+};
+
+inline void take_snapshot(Cpu &cpu, MachineSnapshot &snapshot) {
+    snapshot.cpu = cpu.get_state();
+    memcpy(snapshot.memory, cpu.memory->memory, sizeof(snapshot.memory));
+}
+
+// Cpuとそのメモリをスナップショットの状態に戻す
+//   JitCpuやThreadedCpuは翻訳結果をキャッシュしているので、復元後は作り直すこと
+inline void restore_snapshot(Cpu &cpu, const MachineSnapshot &snapshot) {
+    cpu.get_state() = snapshot.cpu;
+    memcpy(cpu.memory->memory, snapshot.memory, sizeof(snapshot.memory));
+}
+
+// 同じ状態から独立して実行できるCpuを作る (メモリも複製する)
+inline shared_ptr<Cpu> fork_machine(shared_ptr<Cpu> cpu) {
+    shared_ptr<Memory> memory(new Memory(*cpu->memory));
+    shared_ptr<Cpu> child(new Cpu(memory, cpu->arch));
+    child->get_state() = cpu->get_state();
+    child->is_headless = cpu->is_headless;
+    return child;
+}
+
+inline void save_snapshot(string file_path, const MachineSnapshot &snapshot) {
+    ofstream ofs(file_path, ios::binary);
+    if (!ofs) {
+        cerr << "can not open " << file_path << endl;
+        exit(1);
+    }
+    SnapshotHeader header;
+    memcpy(header.magic, "TCSN", 4);
+    header.version = 1;
+    header.size = sizeof(MachineSnapshot);
+    header.memory_size = MEMORY_SIZE;
+    ofs.write((char *) &header, sizeof(header));
+    ofs.write((char *) &snapshot, sizeof(snapshot));
+    ofs.close();
+}
+
+inline void load_snapshot(string file_path, MachineSnapshot &snapshot) {
+    ifstream ifs(file_path, ios::binary);
+    if (!ifs) {
+        cerr << "can not open " << file_path << endl;
+        exit(1);
+    }
+    SnapshotHeader header;
+    if (!ifs.read((char *) &header, sizeof(header)) || memcmp(header.magic, "TCSN", 4) != 0) {
+        cerr << file_path << " is not a snapshot" << endl;
+        exit(1);
+    }
+    if (header.version != 1 || header.size != sizeof(MachineSnapshot) || header.memory_size != MEMORY_SIZE) {
+        cerr << file_path << " was saved by an incompatible emulator" << endl;
+        exit(1);
+    }
+    if (!ifs.read((char *) &snapshot, sizeof(snapshot))) {
+        cerr << file_path << " is truncated" << endl;
+        exit(1);
+    }
+}
+
+#endif //EMULATOR_SNAPSHOT_HPP
@@ -0,0 +1,292 @@
+#ifndef EMULATOR_THREADED_CPU_HPP
+#define EMULATOR_THREADED_CPU_HPP
+
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include "cpu.hpp"
+#include "engine.hpp"
+#include "decode.hpp"
+#include "memory.hpp"
+#include "arch.hpp"
+
+using namespace std;
+
+// GCC/Clangならラベルのアドレス(&&label)を使ったcomputed gotoでディスパッチする
+//   それ以外のコンパイラではswitchにフォールバックする
+#ifndef THREADED_USE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_USE_COMPUTED_GOTO 1
+#else
+#define THREADED_USE_COMPUTED_GOTO 0
+#endif
+#endif
+
+// ハンドラの番号 (InstructionTypeと同じ並びで不正命令とデバイスへのld, stを後ろに置く)
+const int THREADED_HANDLER_INVALID = 15;
+const int THREADED_HANDLER_DEVICE_LD = 16;
+const int THREADED_HANDLER_DEVICE_ST = 17;
+const int THREADED_HANDLER_COUNT = 18;
+
+// メモリ1ワードを翻訳したもの
+struct ThreadedInst {
+    const void *handler;  // computed gotoの飛び先
+    uint8_t handler_index;  // 命令本体のハンドラ番号
+    uint8_t first_operand;
+    uint8_t second_operand;
+    uint8_t source;  // 第2オペランドのレジスタ番号 (second_operand >> 5)
+    uint8_t cycles;
+    uint8_t opcode;
+};
+
+// メモリの各ワードをハンドラとオペランドに翻訳しておき、ハンドラからハンドラへ直接飛んで実行するエンジン
+//   stでメモリを書き換えたときはそのワードだけ翻訳し直すので自己書き換えにも追従する
+//   0ページは実行のたびに翻訳し、1ページ目より後ろはMemoryが書き換わったときだけ翻訳し直す
+//   cmpはその場でr5のZを書き換える (r5の更新は1命令なので、遅延させても速くならない)
+class ThreadedCpu : public Engine {
+public:
+    shared_ptr<Cpu> cpu;
+    vector<ThreadedInst> code;  // メモリの大きさだけ作る (PCはメモリの大きさで折り返して引く)
+    uint64_t translated_generation = 0;  // codeを作ったときのMemory::generation
+    const DeviceBus *translated_devices = nullptr;
+    bool is_translated = false;
+
+    ThreadedCpu() {
+
+    }
+    ThreadedCpu(shared_ptr<Cpu> cpu) {
+        this->cpu = cpu;
+        this->code.resize(cpu->memory->size);
+    }
+
+    RunStats run(RunLimit limit) override {
+        RunStats stats;
+        auto start = chrono::steady_clock::now();
+
+        // マイクロステップの途中から呼ばれた場合は命令の境界までリファレンスで進める
+        bool is_hlt = cpu->finish_instruction();
+
+        // レジスタはローカルにコピーしておく (メモリへのポインタとエイリアスしないのでレジスタに載りやすい)
+        uint16_t regs[CpuArch::REGISTER_COUNT];
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            regs[i] = cpu->registers[i];
+        }
+        uint16_t *mem = cpu->memory->memory;
+        const Memory &memory = *cpu->memory;
+        const uint16_t code_mask = memory.size - 1;
+        const DecodedInst *decode_table = cpu->decode_table->entries;
+        const int pc = cpu->arch->PC_REG_NUMBER;
+        const int psw = cpu->arch->PSW_REG_NUMBER;
+        DeviceBus *devices = cpu->devices;
+        uint64_t clock_counter = cpu->clock_counter;
+        uint64_t instruction_counter = cpu->instruction_counter;
+
+        // 上限は命令の境界で判定する (0なら無制限)
+        uint64_t cycle_end = limit.max_cycles > 0 ? limit.max_cycles + 1 : numeric_limits<uint64_t>::max();
+        uint64_t inst_end = limit.max_instructions > 0 ? limit.max_instructions : numeric_limits<uint64_t>::max();
+
+#if THREADED_USE_COMPUTED_GOTO
+        static const void *handlers[THREADED_HANDLER_COUNT] = {
+                &&HANDLER_MOV, &&HANDLER_ADD, &&HANDLER_SUB, &&HANDLER_AND, &&HANDLER_OR,
+                &&HANDLER_SL, &&HANDLER_SR, &&HANDLER_LDL, &&HANDLER_LDH, &&HANDLER_CMP,
+                &&HANDLER_JE, &&HANDLER_JMP, &&HANDLER_LD, &&HANDLER_ST, &&HANDLER_HLT,
+                &&HANDLER_INVALID, &&HANDLER_DEVICE_LD, &&HANDLER_DEVICE_ST
+        };
+#else
+        static const void *handlers[THREADED_HANDLER_COUNT] = {nullptr};
+#endif
+
+        // メモリ1ワードをハンドラとオペランドに翻訳する
+        auto translate = [&](uint16_t addr) {
+            const DecodedInst &d = decode_table[memory.read(addr)];
+            ThreadedInst &t = code[addr];
+            t.handler_index = d.is_valid ? static_cast<uint8_t>(d.type) : THREADED_HANDLER_INVALID;
+            // ld, stのアドレスは即値なので、デバイスに渡すかどうかは翻訳の時点で決まる
+            if ((d.type == InstructionType::LD || d.type == InstructionType::ST) && devices && devices->is_mapped(d.second_operand)) {
+                t.handler_index = d.type == InstructionType::LD ? THREADED_HANDLER_DEVICE_LD : THREADED_HANDLER_DEVICE_ST;
+            }
+            t.handler = handlers[t.handler_index];
+            t.first_operand = d.first_operand;
+            t.second_operand = d.second_operand;
+            t.source = d.second_operand >> 5;
+            t.cycles = d.cycles;
+            t.opcode = d.opcode;
+        };
+        // デバイスがメモリに書き込むかバンクを切り替えたら、変わったワードを翻訳し直す
+        auto sync_memory = [&]() {
+            if (memory.generation == translated_generation + 1 && memory.last_write >= 0) {
+                translate(memory.last_write);
+            } else {
+                for (int addr = 0; addr < memory.size; addr++) {
+                    translate(addr);
+                }
+            }
+            translated_generation = memory.generation;
+        };
+        if (!is_translated || code.size() != memory.size || translated_devices != devices
+            || memory.generation != translated_generation) {
+            code.resize(memory.size);
+            for (int addr = 0; addr < memory.size; addr++) {
+                translate(addr);
+            }
+            is_translated = true;
+            translated_devices = devices;
+            translated_generation = memory.generation;
+        } else {
+            for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+                translate(addr);
+            }
+        }
+
+        const ThreadedInst *ip = nullptr;
+
+#if THREADED_USE_COMPUTED_GOTO
+#define THREADED_CASE(name) HANDLER_##name:
+#define THREADED_DISPATCH() goto *ip->handler
+#else
+#define THREADED_CASE(name) case static_cast<uint8_t>(InstructionType::name):
+#define THREADED_DISPATCH() goto dispatch
+#endif
+        // 次の命令へ進む
+        //   PCを1つ進めてからハンドラを実行するのはCpu::clockのFETCH_OPERAND_0と同じ
+#define THREADED_NEXT() \
+        if (instruction_counter >= inst_end || clock_counter >= cycle_end) { \
+            goto limit_reached; \
+        } \
+        ip = &code[regs[pc] & code_mask]; \
+        regs[pc]++; \
+        clock_counter += ip->cycles; \
+        instruction_counter++; \
+        THREADED_DISPATCH()
+
+        if (is_hlt) {
+            goto halted;
+        }
+        THREADED_NEXT();
+
+#if !THREADED_USE_COMPUTED_GOTO
+        dispatch:
+        switch (ip->handler_index) {
+#endif
+        THREADED_CASE(MOV)
+            regs[ip->first_operand] = regs[ip->source];
+            THREADED_NEXT();
+        THREADED_CASE(ADD)
+            regs[ip->first_operand] = regs[ip->first_operand] + regs[ip->source];
+            THREADED_NEXT();
+        THREADED_CASE(SUB)
+            regs[ip->first_operand] = regs[ip->first_operand] - regs[ip->source];
+            THREADED_NEXT();
+        THREADED_CASE(AND)
+            regs[ip->first_operand] = regs[ip->first_operand] & regs[ip->source];
+            THREADED_NEXT();
+        THREADED_CASE(OR)
+            regs[ip->first_operand] = regs[ip->first_operand] | regs[ip->source];
+            THREADED_NEXT();
+        THREADED_CASE(SL)
+            regs[ip->first_operand] = regs[ip->first_operand] << 1;
+            THREADED_NEXT();
+        THREADED_CASE(SR)
+            regs[ip->first_operand] = regs[ip->first_operand] >> 1;
+            THREADED_NEXT();
+        THREADED_CASE(LDL)
+            regs[ip->first_operand] |= ip->second_operand;
+            THREADED_NEXT();
+        THREADED_CASE(LDH)
+            regs[ip->first_operand] |= ip->second_operand << 8;
+            THREADED_NEXT();
+        THREADED_CASE(CMP)
+            // Alu::calcのCMPと同じくNは0になる方向にだけ更新する
+            if (regs[ip->first_operand] == regs[ip->source]) {
+                regs[psw] |= 0b0100000000000000;
+            } else {
+                regs[psw] &= 0b0011111111111111;
+            }
+            THREADED_NEXT();
+        THREADED_CASE(JE)
+            if ((regs[psw] >> 14) & 0x1) {
+                regs[pc] = ip->second_operand;
+            }
+            THREADED_NEXT();
+        THREADED_CASE(JMP)
+            regs[pc] = ip->second_operand;
+            THREADED_NEXT();
+        THREADED_CASE(LD)
+            regs[ip->first_operand] = mem[ip->second_operand];
+            THREADED_NEXT();
+        THREADED_CASE(ST)
+            mem[ip->second_operand] = regs[ip->first_operand];
+            // 書き換えたワードが命令として実行されるかもしれないので翻訳し直す
+            translate(ip->second_operand);
+            THREADED_NEXT();
+        THREADED_CASE(HLT)
+            goto halted;
+#if THREADED_USE_COMPUTED_GOTO
+        HANDLER_DEVICE_LD:
+#else
+        case THREADED_HANDLER_DEVICE_LD:
+#endif
+            regs[ip->first_operand] = devices->read(ip->second_operand);
+            THREADED_NEXT();
+#if THREADED_USE_COMPUTED_GOTO
+        HANDLER_DEVICE_ST:
+#else
+        case THREADED_HANDLER_DEVICE_ST:
+#endif
+            devices->write(ip->second_operand, regs[ip->first_operand]);
+            if (memory.generation != translated_generation) {
+                sync_memory();
+            }
+            THREADED_NEXT();
+#if THREADED_USE_COMPUTED_GOTO
+        HANDLER_INVALID:
+#else
+        default:
+#endif
+            cerr << "invalid opcode " << static_cast<int>(ip->opcode) << endl;
+            goto invalid;
+#if !THREADED_USE_COMPUTED_GOTO
+        }
+#endif
+
+#undef THREADED_CASE
+#undef THREADED_DISPATCH
+#undef THREADED_NEXT
+
+        limit_reached:
+        stats.halt_reason = clock_counter >= cycle_end ? HaltReason::CYCLE_LIMIT : HaltReason::INST_LIMIT;
+        cpu->current_status = CpuStatus::FETCH_INST_0;
+        goto finished;
+
+        invalid:
+        // THREADED_NEXTで数えた分を戻し、PCは不正な命令を指したままにする
+        regs[pc]--;
+        clock_counter -= ip->cycles;
+        instruction_counter--;
+        stats.halt_reason = HaltReason::INVALID_OPCODE;
+        cpu->current_status = CpuStatus::FETCH_INST_0;
+        goto finished;
+
+        halted:
+        stats.halt_reason = HaltReason::HLT;
+        // Cpu::clockと同じくWRITE_BACKで止まった状態にしておく
+        cpu->current_status = CpuStatus::WRITE_BACK;
+
+        finished:
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            cpu->registers[i] = regs[i];
+        }
+        cpu->clock_counter = clock_counter;
+        cpu->instruction_counter = instruction_counter;
+
+        auto end = chrono::steady_clock::now();
+        stats.cycles = clock_counter - 1;
+        stats.instructions = instruction_counter;
+        stats.wall_seconds = chrono::duration<double>(end - start).count();
+        return stats;
+    }
+};
+
+#endif //EMULATOR_THREADED_CPU_HPP
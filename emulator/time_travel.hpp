@@ -0,0 +1,289 @@
+#ifndef EMULATOR_TIME_TRAVEL_HPP
+#define EMULATOR_TIME_TRAVEL_HPP
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "cpu.hpp"
+#include "engine.hpp"
+#include "fast_cpu.hpp"
+#include "snapshot.hpp"
+#include "undo_log.hpp"
+
+using namespace std;
+
+// 実行を過去に戻せるようにするデバッガの土台
+//   一定の命令数ごとにマシン全体のチェックポイントを取り、直近の命令はUndoLogで1命令ずつ戻す
+//   UndoLogより前に戻るときは、その前のチェックポイントから目的の位置までFastCpuで実行し直す
+//   チェックポイントとUndoLogは使った分だけ広げ、予算に達したらチェックポイントは1つおきに捨てて間隔を倍にし、
+//   UndoLogは古いものから上書きするので、メモリの使用量は予算を超えない
+//   位置は命令の境界で表す。実行は決定的なので、過去に戻っても先のチェックポイントはそのまま使える
+class TimeTravel {
+private:
+    shared_ptr<Cpu> cpu;
+    shared_ptr<FastCpu> engine;
+    UndoLog undo_log;
+    vector<MachineSnapshot> checkpoints;  // instruction_counterの昇順
+    size_t max_checkpoints;
+    uint64_t interval = 1024;  // チェックポイントの間の命令数
+
+    // 記録した範囲の先に進んだときだけチェックポイントを足す
+    void take_checkpoint() {
+        if (!checkpoints.empty() && checkpoints.back().cpu.instruction_counter >= cpu->instruction_counter) {
+            return;
+        }
+        if (checkpoints.size() >= max_checkpoints) {
+            // 最初のチェックポイントは残して1つおきに間引く
+            size_t kept = 1;
+            for (size_t i = 2; i < checkpoints.size(); i += 2) {
+                checkpoints[kept++] = checkpoints[i];
+            }
+            checkpoints.resize(kept);
+            interval *= 2;
+        }
+        if (checkpoints.size() == checkpoints.capacity()) {
+            checkpoints.reserve(min(max<size_t>(1, checkpoints.capacity() * 2), max_checkpoints));
+        }
+        checkpoints.push_back(MachineSnapshot());
+        take_snapshot(*cpu, checkpoints.back());
+    }
+
+    // instruction以前で最後のチェックポイント
+    vector<MachineSnapshot>::iterator find_checkpoint(uint64_t instruction) {
+        auto it = upper_bound(checkpoints.begin(), checkpoints.end(), instruction,
+                              [](uint64_t value, const MachineSnapshot &snapshot) {
+                                  return value < snapshot.cpu.instruction_counter;
+                              });
+        return it == checkpoints.begin() ? it : it - 1;
+    }
+
+    void apply_undo(const UndoEntry &entry) {
+        uint16_t *regs = cpu->registers;
+        if (entry.reg != UNDO_NO_REGISTER) {
+            regs[entry.reg] = entry.reg_value;
+        }
+        if (entry.has_memory) {
+            cpu->memory->memory[entry.memory_addr] = entry.memory_value;
+        }
+        regs[cpu->arch->PC_REG_NUMBER] = entry.pc;
+        cpu->clock_counter = entry.clock_counter;
+        cpu->instruction_counter--;
+        cpu->current_status = CpuStatus::FETCH_INST_0;
+    }
+
+    // 記録しながらlimitまで進める (上限の意味はRunLimitと同じ)
+    RunStats advance(RunLimit limit) {
+        engine->undo_log = &undo_log;
+        RunStats stats = engine->run(limit);
+        engine->undo_log = nullptr;
+        return stats;
+    }
+
+    // instruction以前で最後のチェックポイントから実行し直してinstruction番目の命令の前に移る
+    //   UndoLogにはそのチェックポイントからinstructionまでの命令が入る
+    //   is_strictならinstructionちょうどのチェックポイントは使わない (UndoLogを空にしないため)
+    void replay_to(uint64_t instruction, bool is_strict = false) {
+        restore_snapshot(*cpu, *find_checkpoint(instruction - (is_strict ? 1 : 0)));
+        undo_log.clear();
+        if (cpu->instruction_counter < instruction) {
+            RunLimit limit;
+            limit.max_instructions = instruction;
+            run(limit);
+        }
+    }
+
+    // instruction番目の命令の前に移る
+    //   近い過去ならUndoLogで1命令ずつ戻し、近い未来なら今の位置から進め、それ以外はチェックポイントから実行し直す
+    void seek_instruction_internal(uint64_t instruction) {
+        uint64_t current = cpu->instruction_counter;
+        if (instruction == current) {
+            return;
+        }
+        if (instruction < current && current - instruction <= undo_log.size() && current - instruction <= interval) {
+            while (cpu->instruction_counter > instruction) {
+                apply_undo(undo_log.from_back(0));
+                undo_log.pop_back();
+            }
+            return;
+        }
+        if (instruction > current && current >= find_checkpoint(instruction)->cpu.instruction_counter) {
+            RunLimit limit;
+            limit.max_instructions = instruction;
+            run(limit);
+            return;
+        }
+        replay_to(instruction);
+    }
+
+    // 今いる位置より前で、PCがbreakpointsに含まれる最後の命令の位置 (UndoLogの中だけを探す)
+    bool find_breakpoint_in_log(const vector<bool> &breakpoints, uint64_t &found) const {
+        for (size_t i = 0; i < undo_log.size(); i++) {
+            uint16_t pc = undo_log.from_back(i).pc;
+            if (pc < breakpoints.size() && breakpoints[pc]) {
+                found = cpu->instruction_counter - 1 - i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    // budget_bytesはチェックポイントとUndoLogに使うメモリの上限 (半分ずつ使い、先には確保しない)
+    TimeTravel(shared_ptr<Cpu> cpu, size_t budget_bytes)
+            : undo_log(budget_bytes / 2 / sizeof(UndoEntry)) {
+        this->cpu = cpu;
+        this->engine = shared_ptr<FastCpu>(new FastCpu(cpu));
+        this->max_checkpoints = max<size_t>(2, budget_bytes / 2 / sizeof(MachineSnapshot));
+        cpu->finish_instruction();
+        take_checkpoint();
+    }
+
+    uint64_t get_first_instruction() const {
+        return checkpoints.front().cpu.instruction_counter;
+    }
+
+    uint64_t get_interval() const {
+        return interval;
+    }
+
+    size_t get_checkpoint_count() const {
+        return checkpoints.size();
+    }
+
+    size_t get_undo_count() const {
+        return undo_log.size();
+    }
+
+    // 今確保しているチェックポイントとUndoLogのバイト数
+    size_t get_memory_usage() const {
+        return checkpoints.capacity() * sizeof(MachineSnapshot) + undo_log.capacity() * sizeof(UndoEntry);
+    }
+
+    bool is_halted() const {
+        return cpu->current_status == CpuStatus::WRITE_BACK;
+    }
+
+    // チェックポイントを取りながらlimitまで進める
+    //   hltで止まっている場合は何もしない
+    RunStats run(RunLimit limit) {
+        RunStats stats;
+        stats.cycles = cpu->clock_counter - 1;
+        stats.instructions = cpu->instruction_counter;
+        if (is_halted()) {
+            return stats;
+        }
+        double wall_seconds = 0;
+        while (true) {
+            // 記録した範囲の中ならその終わりまで、その先ならintervalごとに区切ってチェックポイントを取る
+            RunLimit chunk = limit;
+            uint64_t next = checkpoints.back().cpu.instruction_counter;
+            if (cpu->instruction_counter >= next) {
+                next += interval;
+            }
+            if (chunk.max_instructions == 0 || chunk.max_instructions > next) {
+                chunk.max_instructions = next;
+            }
+            stats = advance(chunk);
+            wall_seconds += stats.wall_seconds;
+            bool is_chunk_end = stats.halt_reason == HaltReason::INST_LIMIT && chunk.max_instructions != limit.max_instructions;
+            if (cpu->instruction_counter >= next) {
+                take_checkpoint();
+            }
+            if (!is_chunk_end) {
+                break;
+            }
+        }
+        stats.wall_seconds = wall_seconds;
+        return stats;
+    }
+
+    // breakpointsのアドレスの命令を実行する手前まで進める (見つからなければlimitかhltまで)
+    //   UndoLogに入る分ずつ進めて、通ったPCを後から調べる
+    bool continue_to(const vector<bool> &breakpoints, RunLimit limit) {
+        while (!is_halted()) {
+            uint64_t start = cpu->instruction_counter;
+            RunLimit chunk = limit;
+            uint64_t end = start + min<uint64_t>(undo_log.max_capacity(), interval);
+            if (chunk.max_instructions == 0 || chunk.max_instructions > end) {
+                chunk.max_instructions = end;
+            }
+            RunStats stats = run(chunk);
+            uint64_t executed = cpu->instruction_counter - start;
+            // 実行した命令を古い方から調べる (最初の命令は今いる位置なので飛ばす)
+            for (uint64_t i = executed; i-- > 0;) {
+                uint64_t instruction = cpu->instruction_counter - 1 - i;
+                uint16_t pc = undo_log.from_back(i).pc;
+                if (instruction > start && pc < breakpoints.size() && breakpoints[pc]) {
+                    seek_instruction_internal(instruction);
+                    return true;
+                }
+            }
+            if (stats.halt_reason != HaltReason::INST_LIMIT || chunk.max_instructions == limit.max_instructions
+                || executed == 0) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    // 1命令だけ戻る (記録の先頭ならfalse)
+    bool step_back() {
+        if (cpu->instruction_counter <= get_first_instruction()) {
+            return false;
+        }
+        seek_instruction_internal(cpu->instruction_counter - 1);
+        return true;
+    }
+
+    // breakpointsのアドレスの命令を実行する手前まで戻る (見つからなければ記録の先頭まで戻ってfalse)
+    //   UndoLogになければ、その前の区間をチェックポイントから実行し直してUndoLogを作り、また探す
+    bool reverse_continue(const vector<bool> &breakpoints) {
+        // endより前の命令を探す
+        uint64_t end = cpu->instruction_counter;
+        while (end > get_first_instruction()) {
+            if (cpu->instruction_counter != end || undo_log.empty()) {
+                replay_to(end, true);
+            }
+            uint64_t found;
+            if (find_breakpoint_in_log(breakpoints, found)) {
+                seek_instruction_internal(found);
+                return true;
+            }
+            end = cpu->instruction_counter - undo_log.size();
+        }
+        seek_instruction_internal(get_first_instruction());
+        return false;
+    }
+
+    // instruction番目の命令の前に移る (記録の先頭より前なら先頭、hltより後ならhlt)
+    void seek_instruction(uint64_t instruction) {
+        seek_instruction_internal(max(instruction, get_first_instruction()));
+    }
+
+    // 実行したクロック数がcycles以下の最後の命令の境界に移る
+    void seek_cycle(uint64_t cycles) {
+        if (cycles <= checkpoints.front().cpu.clock_counter - 1) {
+            seek_instruction_internal(get_first_instruction());
+            return;
+        }
+        // cycles以前で最後のチェックポイントか、それより後なら今の位置から進める
+        auto it = upper_bound(checkpoints.begin(), checkpoints.end(), cycles,
+                              [](uint64_t value, const MachineSnapshot &snapshot) {
+                                  return value < snapshot.cpu.clock_counter - 1;
+                              });
+        uint64_t checkpoint = (it - 1)->cpu.instruction_counter;
+        if (cpu->clock_counter - 1 > cycles || cpu->instruction_counter < checkpoint) {
+            seek_instruction_internal(checkpoint);
+        }
+        RunLimit limit;
+        limit.max_cycles = cycles;
+        run(limit);
+        // 命令の途中では止まれないので、超えていたら1命令戻る
+        if (cpu->clock_counter - 1 > cycles && cpu->instruction_counter > get_first_instruction()) {
+            step_back();
+        }
+    }
+};
+
+#endif //EMULATOR_TIME_TRAVEL_HPP
@@ -0,0 +1,346 @@
+#ifndef EMULATOR_TRACE_HPP
+#define EMULATOR_TRACE_HPP
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include "arch.hpp"
+#include "memory.hpp"
+#include "decode.hpp"
+
+using namespace std;
+
+// 実行トレースのファイル形式
+//   TraceHeaderの後に、実行した命令ごとに1つのレコードが続く
+//   レコードは1バイトのフラグと、フラグが示す値の可変長整数(LEB128)だけで、ほとんどの命令は1〜3バイトになる
+//   値は下のフラグの順に並ぶ
+//     TRACE_PC_JUMP    PCが前の命令の次のアドレスでない (PCの差分)
+//     TRACE_REG_WRITE  レジスタに書き込んだ (番号はフラグの4-6bit、値は書き込む前の値との差分)
+//     TRACE_MEM_READ   メモリを読んだ (アドレスは前にアクセスしたアドレスとの差分)
+//     TRACE_MEM_WRITE  メモリに書いた (アドレスは前にアクセスしたアドレスとの差分、値は書く前の値との差分)
+//   命令のワードは書かない。読む側はヘッダのメモリにstを反映していけばPCのワードが分かる
+//   差分はzigzag符号化して、小さな負の数も短くなるようにする
+const char TRACE_MAGIC[4] = {'T', 'C', 'T', 'R'};
+const uint32_t TRACE_VERSION = 1;
+const uint8_t TRACE_PC_JUMP = 0x01;
+const uint8_t TRACE_REG_WRITE = 0x02;
+const uint8_t TRACE_MEM_READ = 0x04;
+const uint8_t TRACE_MEM_WRITE = 0x08;
+const int TRACE_REG_SHIFT = 4;
+const int TRACE_MAX_RECORD_SIZE = 16;  // フラグ1バイト + 3バイトの可変長整数5つまで
+
+// 記録を始めたときのマシンの状態
+struct TraceHeader {
+    char magic[4];  // "TCTR"
+    uint32_t version;
+    uint32_t memory_size;  // MEMORY_SIZE
+    uint32_t reserved;
+    uint64_t clock_counter;
+    uint64_t instruction_counter;
+    uint16_t registers[CpuArch::REGISTER_COUNT];
+    uint16_t memory[MEMORY_SIZE];
+};
+
+inline uint32_t zigzag_encode(uint16_t delta) {
+    int32_t value = static_cast<int16_t>(delta);
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+inline uint16_t zigzag_decode(uint32_t value) {
+    return static_cast<uint16_t>((value >> 1) ^ -(value & 1));
+}
+
+// トレースを書き出すライタ
+//   エミュレーションのスレッドはメモリ上のバッファにレコードを詰めるだけで、
+//   いっぱいになったバッファはバックグラウンドのスレッドがファイルに書く
+//   全てのバッファが書き込み待ちになったときだけエミュレーションが待たされる
+class TraceWriter {
+private:
+    ofstream ofs;
+    thread worker;
+    mutex lock;
+    condition_variable cond;
+    vector<vector<uint8_t> *> full_buffers;  // 書き込み待ち (先頭から書く)
+    vector<vector<uint8_t> *> free_buffers;  // 空いているバッファ
+    vector<unique_ptr<vector<uint8_t>>> buffers;
+    bool is_closing = false;
+
+    vector<uint8_t> *current = nullptr;
+    uint8_t *cursor = nullptr;
+    uint8_t *limit = nullptr;
+    uint8_t *flags = nullptr;  // 書いている途中のレコードのフラグ
+    uint16_t expected_pc = 0;  // 次の命令のPCがこれならPCを書かない
+    uint16_t last_addr = 0;
+
+    void write_varint(uint32_t value) {
+        while (value >= 0x80) {
+            *cursor++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *cursor++ = static_cast<uint8_t>(value);
+    }
+
+    void run_worker() {
+        while (true) {
+            vector<uint8_t> *buffer;
+            {
+                unique_lock<mutex> guard(lock);
+                cond.wait(guard, [&]() { return !full_buffers.empty() || is_closing; });
+                if (full_buffers.empty()) {
+                    return;
+                }
+                buffer = full_buffers.front();
+                full_buffers.erase(full_buffers.begin());
+            }
+            ofs.write((char *) buffer->data(), buffer->size());
+            {
+                lock_guard<mutex> guard(lock);
+                free_buffers.push_back(buffer);
+            }
+            cond.notify_all();
+        }
+    }
+
+    // 今のバッファを書き込み待ちにして空いているバッファに切り替える
+    void swap_buffer() {
+        unique_lock<mutex> guard(lock);
+        if (current != nullptr) {
+            current->resize(cursor - current->data());
+            byte_count += current->size();
+            full_buffers.push_back(current);
+            cond.notify_all();
+        }
+        cond.wait(guard, [&]() { return !free_buffers.empty(); });
+        current = free_buffers.back();
+        free_buffers.pop_back();
+        current->resize(current->capacity());
+        cursor = current->data();
+        limit = cursor + current->size() - TRACE_MAX_RECORD_SIZE;
+    }
+
+public:
+    uint64_t record_count = 0;
+    uint64_t byte_count = 0;  // ヘッダを除いたレコードのバイト数 (closeの後に確定する)
+    bool is_started = false;
+
+    TraceWriter(string file_path, size_t buffer_size = 1 << 20, int buffer_count = 4) {
+        ofs.open(file_path, ios::binary);
+        if (!ofs) {
+            cerr << "can not open " << file_path << endl;
+            exit(1);
+        }
+        for (int i = 0; i < buffer_count; i++) {
+            buffers.push_back(unique_ptr<vector<uint8_t>>(new vector<uint8_t>()));
+            buffers.back()->reserve(buffer_size);
+            free_buffers.push_back(buffers.back().get());
+        }
+        // 記録中にヒープを確保しないように待ち行列も先に確保しておく
+        full_buffers.reserve(buffer_count);
+    }
+
+    ~TraceWriter() {
+        close();
+    }
+
+    // 記録を始める時点の状態をヘッダとして書き、バックグラウンドのスレッドを起動する
+    void begin(const uint16_t *registers, const uint16_t *memory, uint64_t clock_counter, uint64_t instruction_counter,
+               int pc_register) {
+        TraceHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, 4);
+        header.version = TRACE_VERSION;
+        header.memory_size = MEMORY_SIZE;
+        header.clock_counter = clock_counter;
+        header.instruction_counter = instruction_counter;
+        memcpy(header.registers, registers, sizeof(header.registers));
+        memcpy(header.memory, memory, sizeof(header.memory));
+        ofs.write((char *) &header, sizeof(header));
+        expected_pc = registers[pc_register];
+        is_started = true;
+        swap_buffer();
+        worker = thread([this]() { run_worker(); });
+    }
+
+    // 1命令分のレコードを始める (この後にadd_*を呼ぶ)
+    void begin_record(uint16_t pc) {
+        if (cursor > limit) {
+            swap_buffer();
+        }
+        flags = cursor++;
+        *flags = 0;
+        if (pc != expected_pc) {
+            *flags |= TRACE_PC_JUMP;
+            write_varint(zigzag_encode(pc - expected_pc));
+        }
+        expected_pc = pc + 1;
+        record_count++;
+    }
+
+    void add_register_write(int reg, uint16_t old_value, uint16_t new_value) {
+        *flags |= TRACE_REG_WRITE | (reg << TRACE_REG_SHIFT);
+        write_varint(zigzag_encode(new_value - old_value));
+    }
+
+    void add_memory_read(uint16_t addr) {
+        *flags |= TRACE_MEM_READ;
+        write_varint(zigzag_encode(addr - last_addr));
+        last_addr = addr;
+    }
+
+    void add_memory_write(uint16_t addr, uint16_t old_value, uint16_t new_value) {
+        *flags |= TRACE_MEM_WRITE;
+        write_varint(zigzag_encode(addr - last_addr));
+        write_varint(zigzag_encode(new_value - old_value));
+        last_addr = addr;
+    }
+
+    // 残りのバッファを書き出してファイルを閉じる
+    void close() {
+        if (!is_started) {
+            return;
+        }
+        is_started = false;
+        {
+            lock_guard<mutex> guard(lock);
+            current->resize(cursor - current->data());
+            byte_count += current->size();
+            full_buffers.push_back(current);
+            current = nullptr;
+            is_closing = true;
+        }
+        cond.notify_all();
+        worker.join();
+        ofs.close();
+    }
+};
+
+// トレースの1命令分
+struct TraceRecord {
+    uint64_t index;  // 何番目の命令か (ヘッダのinstruction_counterから数える)
+    uint64_t clock;  // 命令を始めたときのクロック数
+    uint16_t pc;
+    uint16_t word;  // 命令のワード
+    DecodedInst inst;
+    bool has_register_write;
+    uint8_t reg;
+    uint16_t reg_value;  // 書き込んだ後の値
+    bool has_memory_read;
+    bool has_memory_write;
+    uint16_t memory_addr;
+    uint16_t memory_value;  // 読んだ値か書いた値
+};
+
+// トレースを先頭から1命令ずつ読むリーダ
+//   レジスタとメモリを自分で更新していき、差分から値を復元する
+class TraceReader {
+private:
+    ifstream ifs;
+    string file_path;
+    const DecodeTable *decode_table;
+    int pc_register;
+    uint16_t expected_pc;
+    uint16_t last_addr = 0;
+    uint64_t index;
+    uint64_t clock;
+
+    bool read_byte(uint8_t &value) {
+        int c = ifs.get();
+        if (c == EOF) {
+            return false;
+        }
+        value = static_cast<uint8_t>(c);
+        return true;
+    }
+
+    uint32_t read_varint() {
+        uint32_t value = 0;
+        for (int shift = 0; shift < 32; shift += 7) {
+            uint8_t byte;
+            if (!read_byte(byte)) {
+                cerr << file_path << " is truncated" << endl;
+                exit(1);
+            }
+            value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        return value;
+    }
+
+public:
+    TraceHeader header;
+    uint16_t registers[CpuArch::REGISTER_COUNT];
+    uint16_t memory[MEMORY_SIZE];
+
+    TraceReader(string file_path, int pc_register) {
+        this->file_path = file_path;
+        this->pc_register = pc_register;
+        this->decode_table = &DecodeTable::get_instance();
+        ifs.open(file_path, ios::binary);
+        if (!ifs) {
+            cerr << "can not open " << file_path << endl;
+            exit(1);
+        }
+        if (!ifs.read((char *) &header, sizeof(header)) || memcmp(header.magic, TRACE_MAGIC, 4) != 0) {
+            cerr << file_path << " is not a trace" << endl;
+            exit(1);
+        }
+        if (header.version != TRACE_VERSION || header.memory_size != MEMORY_SIZE) {
+            cerr << file_path << " was recorded by an incompatible emulator" << endl;
+            exit(1);
+        }
+        memcpy(registers, header.registers, sizeof(registers));
+        memcpy(memory, header.memory, sizeof(memory));
+        expected_pc = registers[pc_register];
+        index = header.instruction_counter;
+        clock = header.clock_counter;
+    }
+
+    // 次の命令を読んでレジスタとメモリに反映する (終わりならfalse)
+    bool next(TraceRecord &record) {
+        uint8_t flags;
+        if (!read_byte(flags)) {
+            return false;
+        }
+        record.index = index++;
+        record.clock = clock;
+        record.pc = expected_pc;
+        if (flags & TRACE_PC_JUMP) {
+            record.pc += zigzag_decode(read_varint());
+        }
+        expected_pc = record.pc + 1;
+        record.word = memory[record.pc % MEMORY_SIZE];
+        record.inst = decode_table->decode(record.word);
+        clock += record.inst.cycles;
+        registers[pc_register] = record.pc + 1;
+
+        record.has_register_write = flags & TRACE_REG_WRITE;
+        if (record.has_register_write) {
+            record.reg = (flags >> TRACE_REG_SHIFT) & 0x7;
+            registers[record.reg] += zigzag_decode(read_varint());
+            record.reg_value = registers[record.reg];
+        }
+        record.has_memory_read = flags & TRACE_MEM_READ;
+        record.has_memory_write = flags & TRACE_MEM_WRITE;
+        if (record.has_memory_read) {
+            last_addr += zigzag_decode(read_varint());
+            record.memory_addr = last_addr;
+            record.memory_value = memory[last_addr % MEMORY_SIZE];
+        }
+        if (record.has_memory_write) {
+            last_addr += zigzag_decode(read_varint());
+            record.memory_addr = last_addr;
+            memory[last_addr % MEMORY_SIZE] += zigzag_decode(read_varint());
+            record.memory_value = memory[last_addr % MEMORY_SIZE];
+        }
+        return true;
+    }
+};
+
+#endif //EMULATOR_TRACE_HPP
@@ -0,0 +1,93 @@
+#ifndef EMULATOR_UNDO_LOG_HPP
+#define EMULATOR_UNDO_LOG_HPP
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+const uint8_t UNDO_NO_REGISTER = 0xff;
+// 最初に確保するUndoEntryの数
+const size_t UNDO_INITIAL_CAPACITY = 1024;
+
+// 1命令を取り消すのに必要な値 (書き換えたレジスタとメモリの、書き換える前の値だけ)
+struct UndoEntry {
+    uint64_t clock_counter;  // 命令を始める前のクロック数
+    uint16_t pc;  // 命令のアドレス
+    uint16_t reg_value;
+    uint16_t memory_addr;
+    uint16_t memory_value;
+    uint8_t reg;  // 書き込んだレジスタ (UNDO_NO_REGISTERなら無し)
+    bool has_memory;  // stでメモリに書いた
+};
+
+// 直近の命令のUndoEntryを持つリングバッファ
+//   いっぱいになったらmax_capacityまでは倍に広げ、それ以上は古いものから上書きする
+class UndoLog {
+private:
+    vector<UndoEntry> entries;
+    size_t head = 0;  // 次に書く位置
+    size_t count = 0;
+    size_t limit;  // entriesの大きさの上限
+
+    // 古い方から順に並べ直してから広げる
+    void grow() {
+        rotate(entries.begin(), entries.begin() + head, entries.end());
+        head = entries.size();
+        entries.resize(min(entries.size() * 2, limit));
+    }
+
+public:
+    UndoLog(size_t max_capacity) {
+        this->limit = max_capacity > 0 ? max_capacity : 1;
+        entries.resize(min<size_t>(limit, UNDO_INITIAL_CAPACITY));
+    }
+
+    // 今確保している数
+    size_t capacity() const {
+        return entries.size();
+    }
+
+    // 広げられる上限 (これより多くは覚えられない)
+    size_t max_capacity() const {
+        return limit;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    void clear() {
+        head = 0;
+        count = 0;
+    }
+
+    void push(const UndoEntry &entry) {
+        if (count == entries.size() && entries.size() < limit) {
+            grow();
+        }
+        entries[head] = entry;
+        head = head + 1 == entries.size() ? 0 : head + 1;
+        if (count < entries.size()) {
+            count++;
+        }
+    }
+
+    // 新しい方からi番目 (0が最後に実行した命令)
+    const UndoEntry &from_back(size_t i) const {
+        size_t index = (head + entries.size() - 1 - i) % entries.size();
+        return entries[index];
+    }
+
+    void pop_back() {
+        head = head == 0 ? entries.size() - 1 : head - 1;
+        count--;
+    }
+};
+
+#endif //EMULATOR_UNDO_LOG_HPP
@@ -0,0 +1,235 @@
+#ifndef EMULATOR_VISUALIZER_HPP
+#define EMULATOR_VISUALIZER_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <bitset>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include "cpu.hpp"
+#include "perf_counters.hpp"
+#include "symbols.hpp"
+
+using namespace std;
+
+// 実行中のCpuの状態を端末に描画する
+//   描画は専用のスレッドで一定のフレームレートで行い、CpuのスレッドとはFrameExchangeでだけやりとりする
+//   前のフレームから変わった行だけを書き直す
+class Visualizer {
+private:
+    FrameExchange exchange;
+    thread worker;
+    atomic<bool> is_stopping{false};
+    const SymbolTable *symbols;
+    vector<string> drawn_lines;  // 端末に出ている行
+
+    chrono::steady_clock::time_point start_time;
+    chrono::steady_clock::time_point last_time;
+    uint64_t start_instructions = 0;
+    uint64_t last_instructions = 0;
+    double instructions_per_second = 0;
+
+    // "12.3M" の形式で表す
+    static string format_rate(double rate) {
+        const char *units[] = {"", "K", "M", "G"};
+        int unit = 0;
+        while (rate >= 1000 && unit < 3) {
+            rate /= 1000;
+            unit++;
+        }
+        stringstream ss;
+        ss << fixed << setprecision(unit == 0 ? 0 : 2) << rate << units[unit];
+        return ss.str();
+    }
+
+    // 1から1G inst/sまでを対数で20文字のバーにする
+    static string format_gauge(double rate) {
+        const int width = 20;
+        int filled = rate >= 1 ? static_cast<int>(log10(rate) / 9 * width) : 0;
+        if (filled > width) {
+            filled = width;
+        }
+        return string(filled, '#') + string(width - filled, '.');
+    }
+
+    vector<string> format_frame(const CpuFrame &frame) const {
+        const CpuState &state = frame.state;
+        const int pc = CpuArch::PC_REG_NUMBER;
+        vector<string> lines;
+        stringstream ss;
+        auto end_line = [&]() {
+            lines.push_back(ss.str());
+            ss.str("");
+        };
+
+        end_line();
+        ss << "----------CLOCK------------";
+        end_line();
+        ss << " " << "CLOCK [" << dec << state.clock_counter << "]";
+        end_line();
+        ss << " " << "SPEED [" << format_gauge(instructions_per_second) << "] "
+           << format_rate(instructions_per_second) << " inst/s";
+        end_line();
+        end_line();
+        ss << "-------INSTRUCTION---------";
+        end_line();
+        const DecodedInst &inst = state.current_inst;
+        if (inst.is_valid) {
+            ss << " " << "IR [ " << CpuArch::get_inst_by_opcode(inst.opcode)->mnemonic << " ";
+            if (inst.operand_type == OperandType::SINGLE_OPERAND || inst.operand_type == OperandType::DOUBLE_OPERAND) {
+                ss << bitset<3>(inst.first_operand) << " ";
+                if (inst.operand_type == OperandType::DOUBLE_OPERAND) {
+                    ss << bitset<8>(inst.second_operand) << " ";
+                }
+            }
+            ss << "]";
+        }
+        // 命令がなくても行の位置がずれないように空行にする
+        end_line();
+        end_line();
+        ss << "------STATUS COUNTER--------";
+        end_line();
+        for (int i = 0; i < PERF_PHASE_COUNT; i++) {
+            ss << " " << PERF_PHASE_NAMES[i] << " ";
+            if (state.current_status == static_cast<CpuStatus>(i)) {
+                ss << " <";
+            }
+            end_line();
+        }
+        end_line();
+        ss << "---------REGISTER-----------";
+        end_line();
+        for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+            uint16_t reg = state.registers[i];
+            ss << " " << "R" << i << " [" << bitset<16>(reg) << "] (0x" << hex << reg << ") ";
+            if (i == CpuArch::PC_REG_NUMBER) {
+                ss << " (PC) ";
+            }
+            if (i == CpuArch::SP_REG_NUMBER) {
+                ss << " (SP) ";
+            }
+            if (i == CpuArch::PSW_REG_NUMBER) {
+                ss << "N = " << ((reg >> 15) & 0x1) << " ";
+                ss << "Z = " << ((reg >> 14) & 0x1) << " ";
+                ss << " (PSW) ";
+            }
+            end_line();
+        }
+        end_line();
+        ss << "----------MEMORY------------";
+        end_line();
+        int min_memory_index = state.registers[pc] >= 2 ? state.registers[pc] - 2 : 0;
+        for (int i = min_memory_index; i < min_memory_index + 5 && i < MEMORY_SIZE; i++) {
+            ss << " " << "[0x" << hex << i << "] [" << bitset<16>(frame.memory[i]) << "] ";
+            if (i == state.registers[pc]) {
+                ss << "(PC) ";
+            }
+            if (symbols) {
+                ss << symbols->describe(i);
+            }
+            end_line();
+        }
+        end_line();
+        ss << " " << "[0x64] [" << bitset<16>(frame.memory[0x64]) << "] (" << dec << frame.memory[0x64] << ") ";
+        end_line();
+        ss << "--------------------------";
+        end_line();
+        return lines;
+    }
+
+    // 前に描画した行と違う行だけカーソルを動かして書き直す
+    void draw(const CpuFrame &frame) {
+        vector<string> lines = format_frame(frame);
+        if (drawn_lines.empty()) {
+            cout << "\033[2J";  // clear screen
+        }
+        for (int i = 0; i < lines.size(); i++) {
+            if (i < drawn_lines.size() && drawn_lines[i] == lines[i]) {
+                continue;
+            }
+            cout << "\033[" << i + 1 << ";1H" << lines[i] << "\033[K";
+        }
+        if (lines.size() < drawn_lines.size()) {
+            cout << "\033[" << lines.size() + 1 << ";1H\033[J";
+        }
+        cout << "\033[" << lines.size() + 1 << ";1H" << flush;
+        drawn_lines = lines;
+    }
+
+    void update_rate(uint64_t instructions, chrono::steady_clock::time_point now) {
+        double seconds = chrono::duration<double>(now - last_time).count();
+        if (seconds > 0) {
+            instructions_per_second = (instructions - last_instructions) / seconds;
+        }
+        last_instructions = instructions;
+        last_time = now;
+    }
+
+    void render_loop() {
+        auto interval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / fps));
+        auto next_frame = chrono::steady_clock::now();
+        uint64_t drawn = 0;
+        while (!is_stopping.load()) {
+            next_frame += interval;
+            this_thread::sleep_until(next_frame);
+            // 前回の要求に応えてCpuが書いたフレームがあれば描く (Cpuが止まっていれば前のまま)
+            uint64_t published = exchange.get_published();
+            if (published != drawn) {
+                const CpuFrame *frame = exchange.get_front();
+                update_rate(frame->state.instruction_counter, chrono::steady_clock::now());
+                draw(*frame);
+                drawn = published;
+                exchange.request();
+            }
+        }
+    }
+
+public:
+    int fps;
+
+    Visualizer(const SymbolTable *symbols, int fps = 30) {
+        this->symbols = symbols;
+        this->fps = fps;
+    }
+
+    ~Visualizer() {
+        if (worker.joinable()) {
+            is_stopping = true;
+            worker.join();
+        }
+    }
+
+    // Cpu::framesに渡す
+    FrameExchange *get_exchange() {
+        return &exchange;
+    }
+
+    void start(uint64_t instruction_counter) {
+        start_time = chrono::steady_clock::now();
+        last_time = start_time;
+        start_instructions = instruction_counter;
+        last_instructions = instruction_counter;
+        worker = thread([this]() { render_loop(); });
+    }
+
+    // 描画のスレッドを止めて、止まった時点の状態を描く (速度は実行全体の平均にする)
+    void stop(const CpuState &state, const uint16_t *memory) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        is_stopping = true;
+        if (worker.joinable()) {
+            worker.join();
+        }
+        CpuFrame frame;
+        frame.state = state;
+        memcpy(frame.memory, memory, sizeof(frame.memory));
+        instructions_per_second = seconds > 0 ? (state.instruction_counter - start_instructions) / seconds : 0;
+        draw(frame);
+    }
+};
+
+#endif //EMULATOR_VISUALIZER_HPP
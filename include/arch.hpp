@@ -1,4 +1,11 @@
 #include <memory>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <array>
+#include <string_view>
+#include <utility>
 
 #ifndef CPU_BASIC_ARCH_HPP
 #define CPU_BASIC_ARCH_HPP
@@ -22,7 +29,7 @@
 
 using namespace std;
 
-enum class InstructionType {
+enum class InstructionType : uint8_t {
     MOV,
     ADD,
     SUB,
@@ -40,23 +47,29 @@ enum class InstructionType {
     HLT
 };
 
-enum class OperandType {
+enum class OperandType : uint8_t {
     SINGLE_OPERAND,
     DOUBLE_OPERAND,
     NO_OPERAND
 };
 
+// InstructionTypeの数 (HLTが最後)
+const int INSTRUCTION_TYPE_COUNT = static_cast<int>(InstructionType::HLT) + 1;
+// opcodeは4bitなので16通り
+const int OPCODE_COUNT = 16;
+
 // 命令の定義
+//   文字列を持たないリテラル型なのでconstexprの表に置ける
 class Instruction {
 public:
-    InstructionType type;
-    OperandType operand_type;
-    uint16_t opcode;
-    string mnemonic;
-    Instruction() {
+    InstructionType type = InstructionType::HLT;
+    OperandType operand_type = OperandType::NO_OPERAND;
+    uint16_t opcode = 0;
+    string_view mnemonic;
+    constexpr Instruction() {
 
     }
-    Instruction(InstructionType type, string mnemonic, uint16_t opcode, OperandType operand_type) {
+    constexpr Instruction(InstructionType type, string_view mnemonic, uint16_t opcode, OperandType operand_type) {
         this->type = type;
         this->operand_type = operand_type;
         this->mnemonic = mnemonic;
@@ -67,119 +80,161 @@ public:
 // レジスタの定義
 class Register {
 public:
-    string name;
-    uint16_t code;  // 3bitしかつかわないけど
-    Register() {
+    string_view name;
+    uint16_t code = 0;  // 3bitしかつかわないけど
+    constexpr Register() {
 
     }
-    Register(string name, uint16_t code) {
+    constexpr Register(string_view name, uint16_t code) {
         this->name = name;
         this->code = code;
     }
 };
 
+// 命令セットの表 (InstructionTypeと同じ並び)
+inline constexpr array<Instruction, INSTRUCTION_TYPE_COUNT> INSTRUCTIONS = {{
+        Instruction(InstructionType::MOV, "mov", 0b0000, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::ADD, "add", 0b0001, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::SUB, "sub", 0b0010, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::AND, "and", 0b0011, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::OR, "or", 0b0100, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::SL, "sl", 0b0101, OperandType::SINGLE_OPERAND),
+        Instruction(InstructionType::SR, "sr", 0b0110, OperandType::SINGLE_OPERAND),
+        Instruction(InstructionType::LDL, "ldl", 0b1000, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::LDH, "ldh", 0b1001, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::CMP, "cmp", 0b1010, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::JE, "je", 0b1011, OperandType::SINGLE_OPERAND),
+        Instruction(InstructionType::JMP, "jmp", 0b1100, OperandType::SINGLE_OPERAND),
+        Instruction(InstructionType::LD, "ld", 0b1101, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::ST, "st", 0b1110, OperandType::DOUBLE_OPERAND),
+        Instruction(InstructionType::HLT, "hlt", 0b1111, OperandType::NO_OPERAND)
+}};
+
+inline constexpr array<Register, 8> REGISTERS = {{
+        Register("r0", 0b000),
+        Register("r1", 0b001),
+        Register("r2", 0b010),
+        Register("r3", 0b011),
+        Register("r4", 0b100),
+        Register("r5", 0b101), // PSW
+        Register("r6", 0b110), // Stack Pointer
+        Register("r7", 0b111), // Program Counter
+}};
+
+// opcodeからINSTRUCTIONSの添字を引く表をコンパイル時に作る (定義されていないopcodeは-1)
+constexpr array<int8_t, OPCODE_COUNT> make_opcode_table() {
+    array<int8_t, OPCODE_COUNT> table = {};
+    for (int opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+        table[opcode] = -1;
+    }
+    for (int i = 0; i < INSTRUCTIONS.size(); i++) {
+        table[INSTRUCTIONS[i].opcode] = i;
+    }
+    return table;
+}
+inline constexpr array<int8_t, OPCODE_COUNT> OPCODE_TABLE = make_opcode_table();
+
+// 表の整合性はコンパイル時に確かめる
+constexpr bool is_valid_instruction_table() {
+    int defined = 0;
+    for (int i = 0; i < INSTRUCTIONS.size(); i++) {
+        if (static_cast<int>(INSTRUCTIONS[i].type) != i || INSTRUCTIONS[i].opcode >= OPCODE_COUNT) {
+            return false;
+        }
+    }
+    for (int opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+        defined += OPCODE_TABLE[opcode] >= 0 ? 1 : 0;
+    }
+    return defined == INSTRUCTIONS.size();  // opcodeの重複があると足りなくなる
+}
+static_assert(is_valid_instruction_table(), "INSTRUCTIONS must be ordered by InstructionType with unique opcodes");
+
 // CPUのアーキテクチャの構造
+//   表は全てconstexprなので、インスタンスを作ってもコストはかからない
 class CpuArch {
 public:
-    vector<Instruction> instructions = {
-            Instruction(InstructionType::MOV, "mov", 0b0000, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::ADD, "add", 0b0001, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::SUB, "sub", 0b0010, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::AND, "and", 0b0011, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::OR, "or", 0b0100, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::SL, "sl", 0b0101, OperandType::SINGLE_OPERAND),
-            Instruction(InstructionType::SR, "sr", 0b0110, OperandType::SINGLE_OPERAND),
-            Instruction(InstructionType::LDL, "ldl", 0b1000, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::LDH, "ldh", 0b1001, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::CMP, "cmp", 0b1010, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::JE, "je", 0b1011, OperandType::SINGLE_OPERAND),
-            Instruction(InstructionType::JMP, "jmp", 0b1100, OperandType::SINGLE_OPERAND),
-            Instruction(InstructionType::LD, "ld", 0b1101, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::ST, "st", 0b1110, OperandType::DOUBLE_OPERAND),
-            Instruction(InstructionType::HLT, "hlt", 0b1111, OperandType::NO_OPERAND)
-    };
-
-    vector<Register> registers = {
-            Register("r0", 0b000),
-            Register("r1", 0b001),
-            Register("r2", 0b010),
-            Register("r3", 0b011),
-            Register("r4", 0b100),
-            Register("r5", 0b101), // PSW
-            Register("r6", 0b110), // Stack Pointer
-            Register("r7", 0b111), // Program Counter
-    };
-
-    const int PSW_REG_NUMBER = 5;
-    const int SP_REG_NUMBER = 6;
-    const int PC_REG_NUMBER = 7;
-
-    CpuArch() {
-
-    }
-
-    optional<Instruction> get_inst_by_mnemonic(string mnemonic) {
-        int find_index = -1;
-        for (int i = 0; i < this->instructions.size(); i++) {
-            if (this->instructions[i].mnemonic == mnemonic) {
-                find_index = i;
-                break;
-            }
-        }
-        if (find_index >= 0) {
-            return this->instructions[find_index];
-        } else {
-            return nullopt;
-        }
+    static constexpr const array<Instruction, INSTRUCTION_TYPE_COUNT> &instructions = INSTRUCTIONS;
+    static constexpr const array<Register, 8> &registers = REGISTERS;
+
+    static const int REGISTER_COUNT = 8;
+    static constexpr int PSW_REG_NUMBER = 5;
+    static constexpr int SP_REG_NUMBER = 6;
+    static constexpr int PC_REG_NUMBER = 7;
+
+    constexpr CpuArch() {
+
     }
 
-    optional<Instruction> get_inst_by_opcode(uint16_t opcode) {
-        int find_index = -1;
-        for (int i = 0; i < this->instructions.size(); i++) {
-            if (this->instructions[i].opcode == opcode) {
-                find_index = i;
-                break;
+    static constexpr optional<Instruction> get_inst_by_mnemonic(string_view mnemonic) {
+        for (const Instruction &inst: INSTRUCTIONS) {
+            if (inst.mnemonic == mnemonic) {
+                return inst;
             }
         }
-        if (find_index >= 0) {
-            return this->instructions[find_index];
-        } else {
+        return nullopt;
+    }
+
+    static constexpr optional<Instruction> get_inst_by_opcode(uint16_t opcode) {
+        if (opcode >= OPCODE_COUNT || OPCODE_TABLE[opcode] < 0) {
             return nullopt;
         }
+        return INSTRUCTIONS[OPCODE_TABLE[opcode]];
     }
 
-    optional<Register> get_register_by_name(string name) {
-        int find_index = -1;
-        for (int i = 0; i < this->registers.size(); i++) {
-            if (this->registers[i].name == name) {
-                find_index = i;
-                break;
+    static constexpr Instruction get_inst_by_type(InstructionType type) {
+        return INSTRUCTIONS[static_cast<int>(type)];
+    }
+
+    static constexpr optional<Register> get_register_by_name(string_view name) {
+        for (const Register &reg: REGISTERS) {
+            if (reg.name == name) {
+                return reg;
             }
         }
-        if (find_index >= 0) {
-            return this->registers[find_index];
-        } else {
-            return nullopt;
-        }
+        return nullopt;
     }
 };
 
+static_assert(CpuArch::get_inst_by_mnemonic("ld")->opcode == 0b1101, "mnemonic lookup is resolved at compile time");
+static_assert(!CpuArch::get_inst_by_opcode(0b0111), "opcode 0b0111 is not defined");
+static_assert(CpuArch::get_register_by_name("r7")->code == CpuArch::PC_REG_NUMBER, "r7 is the program counter");
+
+// opcodeごとの命令の性質をコンパイル時の定数として持つ
+//   テンプレート引数で受け取ると、デコードやディスパッチをopcodeごとに特殊化したコードにできる
+template <uint16_t OPCODE>
+struct OpcodeTraits {
+    static constexpr uint16_t opcode = OPCODE;
+    static constexpr bool is_valid = OPCODE_TABLE[OPCODE] >= 0;
+    static constexpr Instruction inst = is_valid ? INSTRUCTIONS[OPCODE_TABLE[OPCODE]] : Instruction();
+};
+
+template <typename F, uint16_t... OPCODES>
+constexpr void for_each_opcode_impl(F &&f, integer_sequence<uint16_t, OPCODES...>) {
+    (f(OpcodeTraits<OPCODES>()), ...);
+}
+
+// 16通りのopcodeそれぞれのOpcodeTraitsでfを呼ぶ (fの中身はopcodeごとに実体化される)
+template <typename F>
+constexpr void for_each_opcode(F &&f) {
+    for_each_opcode_impl(f, make_integer_sequence<uint16_t, OPCODE_COUNT>());
+}
+
 // 命令とオペランドの構造
 class Program {
 public:
     Instruction inst;
-    uint16_t first_operand;
-    uint16_t second_operand;
-    Program() {
+    uint16_t first_operand = 0;
+    uint16_t second_operand = 0;
+    constexpr Program() {
 
     }
-    Program(Instruction inst, uint16_t first_operand, uint16_t second_operand) {
+    constexpr Program(Instruction inst, uint16_t first_operand, uint16_t second_operand) {
         this->inst = inst;
         this->first_operand = first_operand;
         this->second_operand = second_operand;
     }
 
-    static uint16_t assemble(Program p) {
+    static constexpr uint16_t assemble(Program p) {
         uint16_t code = 0;
 
         code |= p.inst.opcode << 11;
@@ -192,13 +247,13 @@ public:
         return code;
     }
 
-    static shared_ptr<Program> decode(uint16_t code, shared_ptr<CpuArch> arch) {
+    static Program decode(uint16_t code) {
         uint16_t mask_opcode = 0b0111100000000000;
         uint16_t mask_first_operand = 0b0000011100000000;
         uint16_t mask_second_operand = 0b0000000011111111;
 
         uint16_t opcode = (code & mask_opcode) >> 11;
-        auto inst = arch->get_inst_by_opcode(opcode);
+        auto inst = CpuArch::get_inst_by_opcode(opcode);
 
         if (!inst) {
             cerr << "invalid opcode " << opcode << endl;
@@ -208,11 +263,13 @@ public:
         uint16_t first_operand = (code & mask_first_operand) >> 8;
         uint16_t second_operand = (code & mask_second_operand);
 
-        return shared_ptr<Program>(new Program(inst.value(), first_operand, second_operand));
+        return Program(inst.value(), first_operand, second_operand);
     }
 
 };
 
+static_assert(Program::assemble(Program(OpcodeTraits<0b1001>::inst, 0b011, 0x12)) == 0x4B12, "ldh r3, 0x12");
+
 
 
 #endif //CPU_BASIC_ARCH_HPP
@@ -0,0 +1,170 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#ifndef CPU_BASIC_PROGRAM_IMAGE_HPP
+#define CPU_BASIC_PROGRAM_IMAGE_HPP
+
+// アセンブラが出力し、エミュレータが読み込むプログラムのイメージ
+//   ヘッダ、セクション表、セクションの中身の順に並べる (値はホストのバイト順のまま)
+//   セクションの中身はPROGRAM_IMAGE_ALIGNバイト境界に置き、長さもその倍数まで0で埋める
+//     ロードアドレスがページの先頭なら、エミュレータはファイルをそのままメモリのページとしてmmapできる
+//   checksumはセクション表とセクションの中身 (埋めた0は含まない) から求める
+//   マジックで始まらないファイルは、ワードを0番地から並べただけの古い形式として読む
+
+using namespace std;
+
+const char PROGRAM_IMAGE_MAGIC[4] = {'T', 'C', 'P', 'I'};
+const uint16_t PROGRAM_IMAGE_VERSION = 1;
+const uint32_t PROGRAM_IMAGE_ALIGN = 512;  // 256ワード (エミュレータのメモリの1ページ)
+const uint32_t PROGRAM_IMAGE_ADDRESS_SPACE = 1 << 16;  // ロードアドレスとワード数の上限
+
+enum class ProgramSectionType : uint16_t {
+    CODE = 1,
+    DATA = 2
+};
+
+struct ProgramImageHeader {
+    char magic[4];  // "TCPI"
+    uint16_t version;
+    uint16_t section_count;
+    uint16_t entry;  // PCの初期値
+    uint16_t reserved;
+    uint32_t checksum;
+};
+static_assert(sizeof(ProgramImageHeader) == 16, "ProgramImageHeader must be 16 bytes");
+
+struct ProgramSectionHeader {
+    uint16_t type;  // ProgramSectionType
+    uint16_t load_address;  // 先頭のワードを置くアドレス
+    uint32_t word_count;
+    uint32_t offset;  // ファイルの先頭から中身までのバイト数
+    uint32_t reserved;
+};
+static_assert(sizeof(ProgramSectionHeader) == 16, "ProgramSectionHeader must be 16 bytes");
+
+// 1つのセクション (読み込んだときはwordsがファイルの中を指す)
+struct ProgramSection {
+    ProgramSectionType type;
+    uint16_t load_address;
+    const uint16_t *words;
+    uint32_t word_count;
+    uint32_t offset;
+};
+
+// 32bitのFNV-1a
+inline uint32_t update_program_checksum(uint32_t hash, const void *data, size_t bytes) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < bytes; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+inline uint32_t get_program_checksum(const vector<ProgramSectionHeader> &headers, const vector<ProgramSection> &sections) {
+    uint32_t hash = update_program_checksum(2166136261u, headers.data(), headers.size() * sizeof(ProgramSectionHeader));
+    for (auto &section: sections) {
+        hash = update_program_checksum(hash, section.words, section.word_count * sizeof(uint16_t));
+    }
+    return hash;
+}
+
+inline bool is_program_image(const void *data, size_t bytes) {
+    return bytes >= sizeof(ProgramImageHeader) && memcmp(data, PROGRAM_IMAGE_MAGIC, 4) == 0;
+}
+
+// セクションの中身を置く位置を決めてヘッダとセクション表を作る
+inline vector<ProgramSectionHeader> layout_program_sections(vector<ProgramSection> &sections) {
+    vector<ProgramSectionHeader> headers;
+    uint32_t offset = sizeof(ProgramImageHeader) + sections.size() * sizeof(ProgramSectionHeader);
+    for (auto &section: sections) {
+        offset = (offset + PROGRAM_IMAGE_ALIGN - 1) / PROGRAM_IMAGE_ALIGN * PROGRAM_IMAGE_ALIGN;
+        section.offset = offset;
+        headers.push_back({static_cast<uint16_t>(section.type), section.load_address, section.word_count, offset, 0});
+        offset += section.word_count * sizeof(uint16_t);
+    }
+    return headers;
+}
+
+inline void write_program_image(string file_path, uint16_t entry, vector<ProgramSection> sections) {
+    ofstream ofs(file_path, ios::binary);
+    if (!ofs) {
+        cerr << "can not open " << file_path << endl;
+        exit(1);
+    }
+    vector<ProgramSectionHeader> headers = layout_program_sections(sections);
+    ProgramImageHeader header;
+    memcpy(header.magic, PROGRAM_IMAGE_MAGIC, 4);
+    header.version = PROGRAM_IMAGE_VERSION;
+    header.section_count = sections.size();
+    header.entry = entry;
+    header.reserved = 0;
+    header.checksum = get_program_checksum(headers, sections);
+    ofs.write((char *) &header, sizeof(header));
+    ofs.write((char *) headers.data(), headers.size() * sizeof(ProgramSectionHeader));
+    uint32_t written = sizeof(header) + headers.size() * sizeof(ProgramSectionHeader);
+    const char zeros[PROGRAM_IMAGE_ALIGN] = {0};
+    for (auto &section: sections) {
+        ofs.write(zeros, section.offset - written);
+        ofs.write((char *) section.words, section.word_count * sizeof(uint16_t));
+        written = section.offset + section.word_count * sizeof(uint16_t);
+        // 最後のページもファイルの中に収まるように0で埋める
+        uint32_t padding = (PROGRAM_IMAGE_ALIGN - written % PROGRAM_IMAGE_ALIGN) % PROGRAM_IMAGE_ALIGN;
+        ofs.write(zeros, padding);
+        written += padding;
+    }
+    ofs.close();
+}
+
+// メモリ上に読み込んだ (mmapした) イメージのヘッダを確かめ、セクションを取り出す
+//   壊れていればerrorに理由を入れてfalseを返す
+inline bool parse_program_image(const void *data, size_t bytes, uint16_t &entry, vector<ProgramSection> &sections,
+                                string &error) {
+    const uint8_t *base = static_cast<const uint8_t *>(data);
+    if (!is_program_image(data, bytes)) {
+        error = "is not a program image";
+        return false;
+    }
+    ProgramImageHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (header.version != PROGRAM_IMAGE_VERSION) {
+        error = "has unsupported image version " + to_string(header.version);
+        return false;
+    }
+    size_t table_end = sizeof(header) + static_cast<size_t>(header.section_count) * sizeof(ProgramSectionHeader);
+    if (table_end > bytes) {
+        error = "is truncated";
+        return false;
+    }
+    vector<ProgramSectionHeader> headers(header.section_count);
+    memcpy(headers.data(), base + sizeof(header), headers.size() * sizeof(ProgramSectionHeader));
+    sections.clear();
+    for (auto &h: headers) {
+        if (h.type != static_cast<uint16_t>(ProgramSectionType::CODE) && h.type != static_cast<uint16_t>(ProgramSectionType::DATA)) {
+            error = "has a section of unknown type " + to_string(h.type);
+            return false;
+        }
+        if (h.offset % sizeof(uint16_t) != 0 || h.offset < table_end
+            || h.offset + static_cast<size_t>(h.word_count) * sizeof(uint16_t) > bytes) {
+            error = "is truncated";
+            return false;
+        }
+        if (h.load_address + static_cast<size_t>(h.word_count) > PROGRAM_IMAGE_ADDRESS_SPACE) {
+            error = "has a section beyond the 16-bit address space";
+            return false;
+        }
+        sections.push_back({static_cast<ProgramSectionType>(h.type), h.load_address,
+                            reinterpret_cast<const uint16_t *>(base + h.offset), h.word_count, h.offset});
+    }
+    if (get_program_checksum(headers, sections) != header.checksum) {
+        error = "has a bad checksum";
+        return false;
+    }
+    entry = header.entry;
+    return true;
+}
+
+#endif //CPU_BASIC_PROGRAM_IMAGE_HPP
@@ -0,0 +1,175 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#ifndef CPU_BASIC_SYMBOLS_HPP
+#define CPU_BASIC_SYMBOLS_HPP
+
+// アセンブラが出力するシンボルファイル (バイナリと同じ名前 + ".sym")
+//   # toy-cpu symbols 1
+//   source sum.s
+//   label loop 0x8 0xe     (ラベル名、先頭アドレス、終わりのアドレス(含まない))
+//   line 0x0 2             (アドレスとそのワードを生成したソースの行番号)
+
+using namespace std;
+
+struct Symbol {
+    string name;
+    uint16_t start;
+    uint16_t end;  // 次のラベルの先頭かコードの終わり (含まない)
+};
+
+class SymbolTable {
+private:
+    vector<int> word_symbols;  // アドレスごとのsymbolsの添字 (ラベルより前なら-1)
+
+public:
+    string source_name;  // アセンブルしたソースのファイル名
+    vector<Symbol> symbols;  // 先頭アドレス順
+    vector<int> lines;  // アドレスごとのソースの行番号 (1から)
+
+    SymbolTable() {
+
+    }
+
+    // ラベル(名前とアドレス)から範囲を求め、アドレスからラベルを引く表を作る
+    //   同じアドレスに複数のラベルがある場合は後ろのラベルがそのアドレスを持つ
+    void set_labels(const map<string, int> &label_table, int code_size) {
+        symbols.clear();
+        for (auto &label: label_table) {
+            symbols.push_back({label.first, static_cast<uint16_t>(label.second), 0});
+        }
+        stable_sort(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) {
+            return a.start < b.start;
+        });
+        for (int i = 0; i < symbols.size(); i++) {
+            symbols[i].end = i + 1 < symbols.size() ? symbols[i + 1].start : code_size;
+        }
+        build_lookup();
+    }
+
+    void build_lookup() {
+        word_symbols.assign(lines.size(), -1);
+        for (int i = 0; i < symbols.size(); i++) {
+            for (int addr = symbols[i].start; addr < symbols[i].end && addr < word_symbols.size(); addr++) {
+                word_symbols[addr] = i;
+            }
+        }
+    }
+
+    // addrを含むラベル (なければnullptr)
+    const Symbol *find(int addr) const {
+        if (addr < 0 || addr >= word_symbols.size() || word_symbols[addr] < 0) {
+            return nullptr;
+        }
+        return &symbols[word_symbols[addr]];
+    }
+
+    int get_line(int addr) const {
+        if (addr < 0 || addr >= lines.size()) {
+            return 0;
+        }
+        return lines[addr];
+    }
+
+    // "loop+2 (sum.s:13)" の形式でアドレスを表す (ラベルも行番号もなければ "0x0a")
+    string describe(int addr) const {
+        stringstream ss;
+        const Symbol *symbol = find(addr);
+        if (symbol) {
+            ss << symbol->name;
+            if (addr != symbol->start) {
+                ss << "+" << addr - symbol->start;
+            }
+        } else {
+            ss << "0x" << hex << setw(2) << setfill('0') << addr << dec;
+        }
+        int line = get_line(addr);
+        if (line > 0) {
+            ss << " (" << source_name << ":" << line << ")";
+        }
+        return ss.str();
+    }
+
+    void save(string file_path) const {
+        ofstream ofs(file_path);
+        if (!ofs) {
+            cerr << "can not open " << file_path << endl;
+            exit(1);
+        }
+        ofs << "# toy-cpu symbols 1" << endl;
+        ofs << "source " << source_name << endl;
+        for (auto &symbol: symbols) {
+            ofs << "label " << symbol.name << hex << " 0x" << symbol.start << " 0x" << symbol.end << dec << endl;
+        }
+        for (int addr = 0; addr < lines.size(); addr++) {
+            ofs << "line " << hex << "0x" << addr << dec << " " << lines[addr] << endl;
+        }
+        ofs.close();
+    }
+
+    void load(string file_path) {
+        ifstream ifs(file_path);
+        if (!ifs) {
+            cerr << "can not open " << file_path << endl;
+            exit(1);
+        }
+        symbols.clear();
+        lines.clear();
+        string line;
+        int line_number = 0;
+        while (getline(ifs, line)) {
+            line_number++;
+            stringstream ss(line);
+            string kind;
+            if (!(ss >> kind) || kind[0] == '#') {
+                continue;
+            }
+            bool is_valid = true;
+            if (kind == "source") {
+                is_valid = static_cast<bool>(ss >> source_name);
+            } else if (kind == "label") {
+                Symbol symbol;
+                string start;
+                string end;
+                is_valid = static_cast<bool>(ss >> symbol.name >> start >> end);
+                if (is_valid) {
+                    symbol.start = stoi(start, 0, 16);
+                    symbol.end = stoi(end, 0, 16);
+                    symbols.push_back(symbol);
+                }
+            } else if (kind == "line") {
+                string addr;
+                int source_line;
+                is_valid = static_cast<bool>(ss >> addr >> source_line);
+                if (is_valid) {
+                    int index = stoi(addr, 0, 16);
+                    if (index >= lines.size()) {
+                        lines.resize(index + 1, 0);
+                    }
+                    lines[index] = source_line;
+                }
+            } else {
+                is_valid = false;
+            }
+            if (!is_valid) {
+                cerr << file_path << ":" << line_number << " invalid symbol line" << endl;
+                exit(1);
+            }
+        }
+        // 範囲がコードの外に出るラベルも引けるように表を広げておく
+        for (auto &symbol: symbols) {
+            if (symbol.end > lines.size()) {
+                lines.resize(symbol.end, 0);
+            }
+        }
+        build_lookup();
+    }
+};
+
+#endif //CPU_BASIC_SYMBOLS_HPP
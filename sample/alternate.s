@@ -0,0 +1,27 @@
+;; A loop whose first je alternates between taken and not taken (used for branch predictor comparisons)
+ldh r0, 0x00
+ldl r0, 0x00  ; toggles between 0 and 1
+ldh r1, 0x00
+ldl r1, 0x01  ; step
+ldh r2, 0x00
+ldl r2, 0x00  ; zero
+ldh r4, 0x10
+ldl r4, 0x00  ; loop count
+ldh r6, 0x00
+ldl r6, 0x00  ; number of odd iterations
+
+loop:
+mov r3, r1
+sub r3, r0
+mov r0, r3    ; r0 = 1 - r0
+cmp r0, r2
+je skip
+add r6, r1
+skip:
+sub r4, r1
+cmp r4, r2
+je done
+jmp loop
+done:
+st r6, 0x64  ; store result to 0x64 address
+hlt
@@ -0,0 +1,24 @@
+;; A compare-heavy loop counting r0 up to 0xffff (used for benchmarks)
+ldh r0, 0x00
+ldl r0, 0x00
+ldh r1, 0x00
+ldl r1, 0x01  ; step
+ldh r2, 0xff
+ldl r2, 0xff  ; A last number
+ldh r3, 0x80
+ldl r3, 0x00  ; A middle number
+
+;; every iteration compares r0 three times before looping
+loop:
+add r0, r1
+cmp r0, r3
+je middle
+middle:
+cmp r1, r3
+je loop
+cmp r0, r2
+je else
+jmp loop
+else:
+st r0, 0x64  ; store result to 0x64 address
+hlt
@@ -0,0 +1,29 @@
+;; Copy the input device to the console until the input ends, counting the bytes
+;; (run with --devices --input FILE)
+ldh r1, 0x00
+ldl r1, 0x00  ; zero
+ldh r2, 0x00
+ldl r2, 0x02  ; INPUT_STATUS: end of input
+ldh r4, 0x00
+ldl r4, 0x01  ; INPUT_STATUS: data available, and the step of the counter
+
+;; wait until a byte arrives or the input ends
+wait:
+ld r3, 0xf5   ; INPUT_STATUS
+cmp r3, r4
+je space
+cmp r3, r2
+je done
+jmp wait
+;; wait until the console has room, then copy one byte
+space:
+ld r6, 0xf1   ; CONSOLE_STATUS: free slots
+cmp r6, r1
+je space
+ld r3, 0xf4   ; INPUT_DATA
+st r3, 0xf0   ; CONSOLE_DATA
+add r0, r4
+jmp wait
+done:
+st r0, 0x64  ; store result to 0x64 address
+hlt
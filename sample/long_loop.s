@@ -0,0 +1,26 @@
+;; A nested loop running about 170 million cycles (used for time-travel benchmarks)
+ldh r0, 0x00
+ldl r0, 0x00  ; outer counter
+ldh r1, 0x00
+ldl r1, 0x01  ; step
+ldh r3, 0xff
+ldl r3, 0xff  ; A last number of the inner loop
+ldh r4, 0x00
+ldl r4, 0x80  ; A last number of the outer loop
+
+outer:
+sub r2, r2
+;; count r2 up to r3
+inner:
+add r2, r1
+cmp r2, r3
+je next
+jmp inner
+next:
+add r0, r1
+st r0, 0x64  ; store the outer counter to 0x64 address
+cmp r0, r4
+je else
+jmp outer
+else:
+hlt
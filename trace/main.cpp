@@ -0,0 +1,172 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <iomanip>
+#include <stdexcept>
+#include "arch.hpp"
+#include "trace.hpp"
+
+using namespace std;
+
+// 命令をアセンブリの形で表す
+string format_inst(shared_ptr<CpuArch> arch, const DecodedInst &inst) {
+    stringstream ss;
+    ss << arch->get_inst_by_opcode(inst.opcode)->mnemonic;
+    switch (inst.type) {
+        case InstructionType::MOV:
+        case InstructionType::ADD:
+        case InstructionType::SUB:
+        case InstructionType::AND:
+        case InstructionType::OR:
+        case InstructionType::CMP:
+            ss << " r" << (int) inst.first_operand << ", r" << (inst.second_operand >> 5);
+            break;
+        case InstructionType::LDL:
+        case InstructionType::LDH:
+        case InstructionType::LD:
+        case InstructionType::ST:
+            ss << " r" << (int) inst.first_operand << ", 0x" << hex << (int) inst.second_operand;
+            break;
+        case InstructionType::SL:
+        case InstructionType::SR:
+            ss << " r" << (int) inst.first_operand;
+            break;
+        case InstructionType::JE:
+        case InstructionType::JMP:
+            ss << " 0x" << hex << (int) inst.second_operand;
+            break;
+        case InstructionType::HLT:
+            break;
+    }
+    return ss.str();
+}
+
+void print_record(ostream &os, shared_ptr<CpuArch> arch, const TraceRecord &record) {
+    os << "#" << dec << record.index
+       << " clock=" << record.clock
+       << " pc=0x" << hex << setw(2) << setfill('0') << record.pc << setfill(' ')
+       << " " << setw(14) << left << format_inst(arch, record.inst) << right;
+    if (record.has_register_write) {
+        os << " r" << dec << (int) record.reg << "=0x" << hex << record.reg_value;
+    }
+    if (record.has_memory_read) {
+        os << " R[0x" << hex << record.memory_addr << "]=0x" << record.memory_value;
+    }
+    if (record.has_memory_write) {
+        os << " W[0x" << hex << record.memory_addr << "]=0x" << record.memory_value;
+    }
+    os << dec << endl;
+}
+
+void exit_with_help() {
+    cerr << "[USAGE] trace [--pc START:END] [--type MNEMONIC[,MNEMONIC...]] [--limit N] [--quiet]"
+         << " [--mem-export FILE] TRACE_FILE" << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    char *trace_file = NULL;
+    char *mem_export_file = NULL;
+    int pc_start = 0;
+    int pc_end = 0xffff;
+    bool type_filter[16] = {false};
+    bool is_type_filter = false;
+    uint64_t limit = 0;
+    bool is_quiet = false;
+    shared_ptr<CpuArch> arch(new CpuArch());
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--pc" && i + 1 < argc) {
+                string range = argv[++i];
+                auto pos = range.find(':');
+                if (pos == string::npos) {
+                    exit_with_help();
+                }
+                pc_start = stoi(range.substr(0, pos), 0, 16);
+                pc_end = stoi(range.substr(pos + 1), 0, 16);
+                if (pc_start < 0 || pc_end > 0xffff || pc_start > pc_end) {
+                    exit_with_help();
+                }
+            } else if (arg == "--type" && i + 1 < argc) {
+                stringstream ss(argv[++i]);
+                string mnemonic;
+                while (getline(ss, mnemonic, ',')) {
+                    auto inst = arch->get_inst_by_mnemonic(mnemonic);
+                    if (!inst) {
+                        cerr << "invalid inst [" << mnemonic << "]" << endl;
+                        exit(1);
+                    }
+                    type_filter[static_cast<int>(inst->type)] = true;
+                }
+                is_type_filter = true;
+            } else if (arg == "--limit" && i + 1 < argc) {
+                limit = stoull(argv[++i]);
+            } else if (arg == "--quiet") {
+                is_quiet = true;
+            } else if (arg == "--mem-export" && i + 1 < argc) {
+                mem_export_file = argv[++i];
+            } else if (arg.substr(0, 2) == "--") {
+                exit_with_help();
+            } else {
+                trace_file = argv[i];
+            }
+        }
+    } catch (const logic_error &) {
+        exit_with_help();
+    }
+    if (trace_file == NULL) {
+        exit_with_help();
+    }
+
+    // メモリアクセスはdinero形式 (0: 読み込み、1: 書き込み、2: 命令フェッチ、アドレスは16進数) で書き出す
+    ofstream mem_export;
+    if (mem_export_file != NULL) {
+        mem_export.open(mem_export_file);
+        if (!mem_export) {
+            cerr << "can not open " << mem_export_file << endl;
+            exit(1);
+        }
+        mem_export << hex;
+    }
+
+    TraceReader reader(trace_file, arch->PC_REG_NUMBER);
+    TraceRecord record;
+    uint64_t record_count = 0;
+    uint64_t shown_count = 0;
+    while (reader.next(record)) {
+        record_count++;
+        // PCの範囲 (ENDを含む) と命令の種類で絞り込む
+        if (record.pc < pc_start || record.pc > pc_end) {
+            continue;
+        }
+        if (is_type_filter && !type_filter[static_cast<int>(record.inst.type)]) {
+            continue;
+        }
+        if (limit > 0 && shown_count >= limit) {
+            continue;
+        }
+        shown_count++;
+        if (!is_quiet) {
+            print_record(cout, arch, record);
+        }
+        if (mem_export_file != NULL) {
+            mem_export << "2 " << record.pc << "\n";
+            if (record.has_memory_read) {
+                mem_export << "0 " << record.memory_addr << "\n";
+            }
+            if (record.has_memory_write) {
+                mem_export << "1 " << record.memory_addr << "\n";
+            }
+        }
+    }
+
+    cout << "TRACE records=" << record_count << " shown=" << shown_count << " regs=";
+    for (int i = 0; i < CpuArch::REGISTER_COUNT; i++) {
+        cout << (i == 0 ? "" : ",") << hex << reader.registers[i];
+    }
+    cout << dec << endl;
+    return 0;
+}